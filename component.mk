@@ -4,7 +4,7 @@ COMPONENT_SRCDIRS	:= src src/Arch/$(SMING_ARCH)
 COMPONENT_DOXYGEN_INPUT := src/include
 
 COMPONENT_VARS			+= DISK_MAX_SECTOR_SIZE
-DISK_MAX_SECTOR_SIZE	?= 512
+DISK_MAX_SECTOR_SIZE	?= 4096
 GLOBAL_CFLAGS			+= -DDISK_MAX_SECTOR_SIZE=$(DISK_MAX_SECTOR_SIZE)
 
 COMPONENT_RELINK_VARS += ENABLE_BLOCK_DEVICE_STATS
@@ -0,0 +1,558 @@
+/****
+ * ChunkedImageDevice.cpp
+ *
+ * Copyright 2022 mikee47 <mike@sillyhouse.net>
+ *
+ * This file is part of the DiskStorage Library
+ *
+ * This library is free software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation, version 3 or later.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this library.
+ * If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****/
+
+#include <hostlib/hostlib.h>
+#include <Storage/Disk/ChunkedImageDevice.h>
+#include <Storage/Disk/diskdefs.h>
+#include <Storage/Disk/Lz4.h>
+#include <debug_progmem.h>
+#include <cstdio>
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+namespace Storage::Disk
+{
+/*
+ * File layout:
+ *
+ * 	Header
+ * 	IndexEntry[chunkCount]
+ * 	Chunk data
+ *
+ * All values are little-endian.
+ */
+struct ChunkedImageDevice::Header {
+	static constexpr uint64_t MAGIC{0x4b4e554843445344ULL}; // "DSDCHUNK"
+	static constexpr uint32_t VERSION{1};
+
+	uint64_t magic;
+	uint32_t version;
+	uint32_t headerSize; ///< Offset of index
+	uint64_t diskSize;   ///< In bytes
+	uint32_t chunkSize;
+	uint32_t chunkCount;
+	uint16_t sectorSize;
+	uint16_t reserved;
+	uint32_t headerCrc; ///< Calculated with this field set to 0
+
+	uint32_t calculateCrc() const
+	{
+		Header tmp{*this};
+		tmp.headerCrc = 0;
+		return crc32(&tmp, sizeof(tmp));
+	}
+};
+
+struct ChunkedImageDevice::IndexEntry {
+	enum Flag {
+		compressed = 0x01,
+	};
+
+	uint64_t offset; ///< Location of chunk data, 0 if chunk contains only zeroes
+	uint32_t length; ///< Stored data size
+	uint32_t flags;
+};
+
+struct ChunkedImageDevice::CacheEntry {
+	std::unique_ptr<uint8_t[]> data;
+	uint32_t chunk{0};
+	uint32_t lastUse{0};
+	bool valid{false};
+	bool dirty{false};
+};
+
+namespace
+{
+constexpr uint32_t headerAreaSize{512};
+constexpr uint32_t maxChunkSize{0x1000000};
+
+bool readAt(int file, uint64_t offset, void* dst, size_t size)
+{
+	if(uint64_t(::lseek64(file, offset, SEEK_SET)) != offset) {
+		return false;
+	}
+	return size_t(::read(file, dst, size)) == size;
+}
+
+bool writeAt(int file, uint64_t offset, const void* src, size_t size)
+{
+	if(uint64_t(::lseek64(file, offset, SEEK_SET)) != offset) {
+		return false;
+	}
+	return size_t(::write(file, src, size)) == size;
+}
+
+} // namespace
+
+ChunkedImageDevice::ChunkedImageDevice(const String& name, const String& filename, storage_size_t size,
+									   size_t chunkSize)
+	: name(name)
+{
+	if(chunkSize < sectorSize || chunkSize > maxChunkSize || !isLog2(chunkSize)) {
+		debug_e("[CID] Invalid chunk size %u", chunkSize);
+		return;
+	}
+
+	uint64_t sectors = size >> sectorSizeShift;
+	chunkShift = getSizeBits(chunkSize) - sectorSizeShift;
+	uint64_t chunks = (sectors + (1U << chunkShift) - 1) >> chunkShift;
+	if(chunks == 0 || chunks > UINT32_MAX) {
+		debug_e("[CID] Invalid size %llu", uint64_t(size));
+		return;
+	}
+
+	file = ::open(filename.c_str(), O_CREAT | O_TRUNC | O_BINARY | O_RDWR, 0644);
+	if(file < 0) {
+		debug_e("[CID] Failed to create '%s'", filename.c_str());
+		return;
+	}
+
+	static_assert(sizeof(Header) <= headerAreaSize, "Header too large");
+	Header header{};
+	header.magic = Header::MAGIC;
+	header.version = Header::VERSION;
+	header.headerSize = headerAreaSize;
+	header.diskSize = sectors << sectorSizeShift;
+	header.chunkSize = chunkSize;
+	header.chunkCount = chunks;
+	header.sectorSize = sectorSize;
+	header.headerCrc = header.calculateCrc();
+
+	// Index is initially all zeroes, i.e. every chunk is empty
+	fileSize = headerAreaSize + chunks * sizeof(IndexEntry);
+	if(!writeAt(file, 0, &header, sizeof(header)) || ::ftruncate64(file, fileSize) != 0) {
+		debug_e("[CID] Failed to initialise '%s'", filename.c_str());
+		::close(file);
+		file = -1;
+		::unlink(filename.c_str());
+		return;
+	}
+
+	index.reset(new IndexEntry[chunks]{});
+	this->chunkSize = chunkSize;
+	chunkCount = chunks;
+	sectorCount = sectors;
+	if(!init()) {
+		sectorCount = 0;
+	}
+}
+
+ChunkedImageDevice::ChunkedImageDevice(const String& name, const String& filename)
+	: name(name)
+{
+	file = ::open(filename.c_str(), O_BINARY | O_RDWR);
+	if(file < 0) {
+		return;
+	}
+
+	Header header;
+	if(!readImage(file, header, index)) {
+		debug_e("[CID] '%s' is not a valid image", filename.c_str());
+		::close(file);
+		file = -1;
+		return;
+	}
+	if(header.sectorSize != sectorSize) {
+		debug_e("[CID] '%s' unsupported sector size %u", filename.c_str(), header.sectorSize);
+		::close(file);
+		file = -1;
+		return;
+	}
+#ifndef ENABLE_STORAGE_SIZE64
+	if(Storage::isSize64(header.diskSize)) {
+		debug_e("[CID] Failed to open '%s', too big %llu, require ENABLE_STORAGE_SIZE64=1", filename.c_str(),
+				header.diskSize);
+		::close(file);
+		file = -1;
+		return;
+	}
+#endif
+
+	fileSize = ::lseek64(file, 0, SEEK_END);
+	chunkSize = header.chunkSize;
+	chunkCount = header.chunkCount;
+	chunkShift = getSizeBits(chunkSize) - sectorSizeShift;
+	sectorCount = header.diskSize >> sectorSizeShift;
+	if(!init()) {
+		sectorCount = 0;
+	}
+}
+
+ChunkedImageDevice::~ChunkedImageDevice()
+{
+	if(file >= 0) {
+		sync();
+		::close(file);
+	}
+}
+
+bool ChunkedImageDevice::readImage(int file, Header& header, std::unique_ptr<IndexEntry[]>& index)
+{
+	if(!readAt(file, 0, &header, sizeof(header))) {
+		return false;
+	}
+	if(header.magic != Header::MAGIC || header.version != Header::VERSION || header.headerCrc != header.calculateCrc()) {
+		return false;
+	}
+	if(header.chunkSize < header.sectorSize || header.chunkSize > maxChunkSize || !isLog2(header.chunkSize) ||
+	   header.sectorSize < DISK_MIN_SECTOR_SIZE || !isLog2(header.sectorSize)) {
+		return false;
+	}
+	if(header.chunkCount != (header.diskSize + header.chunkSize - 1) / header.chunkSize) {
+		return false;
+	}
+
+	index.reset(new(std::nothrow) IndexEntry[header.chunkCount]);
+	if(!index) {
+		return false;
+	}
+	return readAt(file, header.headerSize, index.get(), header.chunkCount * sizeof(IndexEntry));
+}
+
+bool ChunkedImageDevice::init()
+{
+	compressBuffer.reset(new(std::nothrow) uint8_t[chunkSize]);
+	if(!compressBuffer || !setCacheSize(defaultCacheChunks)) {
+		return false;
+	}
+
+	// Reads and writes are mostly served from chunk cache so don't need many sector buffers
+	allocateBuffers(4);
+
+	debug_d("[CID] '%s' %u chunks of %u bytes", name.c_str(), chunkCount, chunkSize);
+	return true;
+}
+
+bool ChunkedImageDevice::setCacheSize(unsigned numChunks)
+{
+	if(!raw_sync()) {
+		return false;
+	}
+	numChunks = std::max(numChunks, 1U);
+	cacheCount = 0;
+	cache.reset(new(std::nothrow) CacheEntry[numChunks]);
+	if(!cache) {
+		return false;
+	}
+	cacheCount = numChunks;
+	return true;
+}
+
+ChunkedImageDevice::Stats ChunkedImageDevice::getStats() const
+{
+	Stats stats{fileSize, 0, chunkCount, 0};
+	for(unsigned i = 0; i < chunkCount; ++i) {
+		if(index[i].offset != 0) {
+			stats.dataSize += index[i].length;
+			++stats.storedCount;
+		}
+	}
+	return stats;
+}
+
+ChunkedImageDevice::CacheEntry* ChunkedImageDevice::findChunk(uint32_t chunk)
+{
+	for(unsigned i = 0; i < cacheCount; ++i) {
+		auto& entry = cache[i];
+		if(entry.valid && entry.chunk == chunk) {
+			entry.lastUse = ++useCounter;
+			return &entry;
+		}
+	}
+	return nullptr;
+}
+
+ChunkedImageDevice::CacheEntry* ChunkedImageDevice::loadChunk(uint32_t chunk, bool overwrite)
+{
+	auto entry = findChunk(chunk);
+	if(entry != nullptr) {
+		return entry;
+	}
+
+	// Evict least recently used
+	entry = &cache[0];
+	for(unsigned i = 0; i < cacheCount; ++i) {
+		auto& e = cache[i];
+		if(!e.valid) {
+			entry = &e;
+			break;
+		}
+		if(e.lastUse < entry->lastUse) {
+			entry = &e;
+		}
+	}
+	if(entry->valid && entry->dirty && !flushChunk(*entry)) {
+		return nullptr;
+	}
+
+	entry->valid = false;
+	if(!entry->data) {
+		entry->data.reset(new(std::nothrow) uint8_t[chunkSize]);
+		if(!entry->data) {
+			return nullptr;
+		}
+	}
+	if(!overwrite && !readChunk(chunk, entry->data.get())) {
+		return nullptr;
+	}
+
+	entry->chunk = chunk;
+	entry->valid = true;
+	entry->dirty = false;
+	entry->lastUse = ++useCounter;
+	return entry;
+}
+
+bool ChunkedImageDevice::readChunk(uint32_t chunk, uint8_t* buffer)
+{
+	auto& entry = index[chunk];
+	if(entry.offset == 0) {
+		memset(buffer, 0, chunkSize);
+		return true;
+	}
+
+	if(!(entry.flags & IndexEntry::compressed)) {
+		return entry.length == chunkSize && readAt(file, entry.offset, buffer, chunkSize);
+	}
+
+	if(entry.length > chunkSize || !readAt(file, entry.offset, compressBuffer.get(), entry.length)) {
+		return false;
+	}
+	auto len = LZ4::decompress(compressBuffer.get(), entry.length, buffer, chunkSize);
+	if(len != int(chunkSize)) {
+		debug_e("[CID] Chunk #%u corrupt", chunk);
+		return false;
+	}
+	return true;
+}
+
+bool ChunkedImageDevice::flushChunk(CacheEntry& entry)
+{
+	IndexEntry newEntry{};
+	if(!isZeroFilled(entry.data.get(), chunkSize)) {
+		// Only keep compressed data if it actually saves space
+		const void* data = compressBuffer.get();
+		size_t length = LZ4::compress(entry.data.get(), chunkSize, compressBuffer.get(), chunkSize - 1);
+		if(length == 0) {
+			data = entry.data.get();
+			length = chunkSize;
+		} else {
+			newEntry.flags = IndexEntry::compressed;
+		}
+
+		// Always append so the existing chunk remains intact until the index is updated
+		if(!writeAt(file, fileSize, data, length)) {
+			return false;
+		}
+		newEntry.offset = fileSize;
+		newEntry.length = length;
+		fileSize += length;
+	}
+
+	index[entry.chunk] = newEntry;
+	if(!writeIndexEntry(entry.chunk)) {
+		return false;
+	}
+	entry.dirty = false;
+	return true;
+}
+
+bool ChunkedImageDevice::writeIndexEntry(uint32_t chunk)
+{
+	return writeAt(file, headerAreaSize + uint64_t(chunk) * sizeof(IndexEntry), &index[chunk], sizeof(IndexEntry));
+}
+
+bool ChunkedImageDevice::raw_sector_read(storage_size_t address, void* dst, size_t size)
+{
+	auto dstptr = static_cast<uint8_t*>(dst);
+	const uint32_t chunkMask = (1U << chunkShift) - 1;
+	uint64_t sector = address;
+	while(size != 0) {
+		uint32_t chunk = sector >> chunkShift;
+		uint32_t offset = sector & chunkMask;
+		size_t count = std::min(size_t(chunkMask + 1 - offset), size);
+		size_t len = count << sectorSizeShift;
+
+		auto entry = findChunk(chunk);
+		if(entry == nullptr && index[chunk].offset == 0) {
+			// Don't waste cache space on empty chunks
+			memset(dstptr, 0, len);
+		} else {
+			if(entry == nullptr) {
+				entry = loadChunk(chunk, false);
+				if(entry == nullptr) {
+					return false;
+				}
+			}
+			memcpy(dstptr, &entry->data[offset << sectorSizeShift], len);
+		}
+
+		dstptr += len;
+		sector += count;
+		size -= count;
+	}
+
+	return true;
+}
+
+bool ChunkedImageDevice::raw_sector_write(storage_size_t address, const void* src, size_t size)
+{
+	auto srcptr = static_cast<const uint8_t*>(src);
+	const uint32_t chunkMask = (1U << chunkShift) - 1;
+	uint64_t sector = address;
+	while(size != 0) {
+		uint32_t chunk = sector >> chunkShift;
+		uint32_t offset = sector & chunkMask;
+		size_t count = std::min(size_t(chunkMask + 1 - offset), size);
+		size_t len = count << sectorSizeShift;
+
+		auto entry = loadChunk(chunk, len == chunkSize);
+		if(entry == nullptr) {
+			return false;
+		}
+		memcpy(&entry->data[offset << sectorSizeShift], srcptr, len);
+		entry->dirty = true;
+
+		srcptr += len;
+		sector += count;
+		size -= count;
+	}
+
+	return true;
+}
+
+bool ChunkedImageDevice::raw_sector_erase_range(storage_size_t address, size_t size)
+{
+	const uint32_t chunkMask = (1U << chunkShift) - 1;
+	uint64_t sector = address;
+	while(size != 0) {
+		uint32_t chunk = sector >> chunkShift;
+		uint32_t offset = sector & chunkMask;
+		size_t count = std::min(size_t(chunkMask + 1 - offset), size);
+		size_t len = count << sectorSizeShift;
+
+		if(len == chunkSize) {
+			auto entry = findChunk(chunk);
+			if(entry != nullptr) {
+				entry->valid = false;
+			}
+			if(index[chunk].offset != 0) {
+				index[chunk] = IndexEntry{};
+				if(!writeIndexEntry(chunk)) {
+					return false;
+				}
+			}
+		} else if(findChunk(chunk) != nullptr || index[chunk].offset != 0) {
+			auto entry = loadChunk(chunk, false);
+			if(entry == nullptr) {
+				return false;
+			}
+			memset(&entry->data[offset << sectorSizeShift], 0, len);
+			entry->dirty = true;
+		}
+
+		sector += count;
+		size -= count;
+	}
+
+	return true;
+}
+
+bool ChunkedImageDevice::raw_sync()
+{
+	for(unsigned i = 0; i < cacheCount; ++i) {
+		auto& entry = cache[i];
+		if(entry.valid && entry.dirty && !flushChunk(entry)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool ChunkedImageDevice::raw_sector_is_allocated(storage_size_t address, storage_size_t size)
+{
+	if(size == 0) {
+		return false;
+	}
+	uint32_t firstChunk = uint64_t(address) >> chunkShift;
+	uint32_t lastChunk = (uint64_t(address) + size - 1) >> chunkShift;
+	for(uint32_t chunk = firstChunk; chunk <= lastChunk; ++chunk) {
+		if(index[chunk].offset != 0) {
+			return true;
+		}
+		auto entry = findChunk(chunk);
+		if(entry != nullptr && entry->dirty) {
+			return true;
+		}
+	}
+	return false;
+}
+
+bool ChunkedImageDevice::compact(const String& filename)
+{
+	int src = ::open(filename.c_str(), O_BINARY | O_RDONLY);
+	if(src < 0) {
+		return false;
+	}
+
+	Header header;
+	std::unique_ptr<IndexEntry[]> index;
+	if(!readImage(src, header, index)) {
+		::close(src);
+		return false;
+	}
+
+	String tmpFilename = filename + ".tmp";
+	int dst = ::open(tmpFilename.c_str(), O_CREAT | O_TRUNC | O_BINARY | O_WRONLY, 0644);
+	if(dst < 0) {
+		::close(src);
+		return false;
+	}
+
+	const size_t indexSize = header.chunkCount * sizeof(IndexEntry);
+	uint64_t offset = header.headerSize + indexSize;
+	std::unique_ptr<uint8_t[]> buffer(new uint8_t[header.chunkSize]);
+	bool ok = writeAt(dst, 0, &header, sizeof(header));
+	for(unsigned i = 0; ok && i < header.chunkCount; ++i) {
+		auto& entry = index[i];
+		if(entry.offset == 0) {
+			continue;
+		}
+		ok = entry.length <= header.chunkSize && readAt(src, entry.offset, buffer.get(), entry.length) &&
+			 writeAt(dst, offset, buffer.get(), entry.length);
+		entry.offset = offset;
+		offset += entry.length;
+	}
+	ok = ok && writeAt(dst, header.headerSize, index.get(), indexSize);
+
+	::close(dst);
+	::close(src);
+
+	if(ok && ::rename(tmpFilename.c_str(), filename.c_str()) == 0) {
+		return true;
+	}
+
+	debug_e("[CID] Compact '%s' failed", filename.c_str());
+	::unlink(tmpFilename.c_str());
+	return false;
+}
+
+} // namespace Storage::Disk
@@ -10,12 +10,20 @@
 
 #include <hostlib/hostlib.h>
 #include <Storage/Disk/HostFileDevice.h>
+#include <Storage/Disk/diskdefs.h>
 #include <debug_progmem.h>
+#include <cerrno>
 
 #ifndef O_BINARY
 #define O_BINARY 0
 #endif
 
+#ifdef __linux__
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
 #ifdef __WIN32
 #include <winioctl.h>
 #ifndef FSCTL_SET_ZERO_DATA
@@ -53,6 +61,16 @@ bool zeroSparse(int file, uint64_t offset, uint64_t len)
 #endif
 }
 
+bool isBlockDevice(int file)
+{
+#ifdef __linux__
+	struct stat st;
+	return ::fstat(file, &st) == 0 && S_ISBLK(st.st_mode);
+#else
+	return false;
+#endif
+}
+
 } // namespace
 
 namespace Storage::Disk
@@ -63,6 +81,10 @@ HostFileDevice::HostFileDevice(const String& name, const String& filename, stora
 	if(file < 0) {
 		return;
 	}
+	if(isBlockDevice(file)) {
+		initBlockDevice(size);
+		return;
+	}
 	setSparse(file);
 	size -= size % getBlockSize();
 	sectorCount = size >> sectorSizeShift;
@@ -94,6 +116,10 @@ HostFileDevice::HostFileDevice(const String& name, const String& filename) : nam
 	if(file < 0) {
 		return;
 	}
+	if(isBlockDevice(file)) {
+		initBlockDevice(0);
+		return;
+	}
 	auto filesize = ::lseek64(file, 0, SEEK_END);
 #ifndef ENABLE_STORAGE_SIZE64
 	if(Storage::isSize64(filesize)) {
@@ -110,6 +136,63 @@ HostFileDevice::HostFileDevice(const String& name, const String& filename) : nam
 	allocateBuffers(4);
 }
 
+void HostFileDevice::initBlockDevice(storage_size_t maxSize)
+{
+#ifdef __linux__
+	uint64_t size{0};
+	int logicalSectorSize{0};
+	unsigned physSectorSize{0};
+	unsigned ioSize{0};
+	if(::ioctl(file, BLKGETSIZE64, &size) < 0 || ::ioctl(file, BLKSSZGET, &logicalSectorSize) < 0 ||
+	   ::ioctl(file, BLKPBSZGET, &physSectorSize) < 0 || ::ioctl(file, BLKIOOPT, &ioSize) < 0) {
+		debug_e("[HFD] '%s' ioctl failed, %d", name.c_str(), errno);
+		::close(file);
+		file = -1;
+		return;
+	}
+
+	if(!isValidSectorSize(logicalSectorSize)) {
+		debug_e("[HFD] '%s' unsupported sector size %d", name.c_str(), logicalSectorSize);
+		::close(file);
+		file = -1;
+		return;
+	}
+
+#ifndef ENABLE_STORAGE_SIZE64
+	if(Storage::isSize64(size)) {
+		debug_e("[HFD] Failed to open '%s', too big %llu, require ENABLE_STORAGE_SIZE64=1", name.c_str(), size);
+		::close(file);
+		file = -1;
+		return;
+	}
+#endif
+
+	if(maxSize != 0 && maxSize < size) {
+		size = maxSize;
+	}
+
+	blockDevice = true;
+	setSectorSize(logicalSectorSize);
+	physicalSectorSize = physSectorSize;
+	optimalIoSize = ioSize;
+	sectorCount = size >> sectorSizeShift;
+
+	// Cache enough sectors to cover the optimal transfer size, rounded down to a power of 2
+	unsigned numBuffers = std::max(4U, std::min(ioSize >> sectorSizeShift, 32U));
+	while(!isLog2(numBuffers)) {
+		numBuffers &= numBuffers - 1;
+	}
+	if(!allocateBuffers(numBuffers)) {
+		debug_w("[HFD] '%s' failed to allocate %u buffers", name.c_str(), numBuffers);
+	}
+
+	debug_i("[HFD] '%s' block device, %llu sectors, logical %u, physical %u, optimal I/O %u", name.c_str(),
+			uint64_t(sectorCount), sectorSize, physSectorSize, ioSize);
+#else
+	(void)maxSize;
+#endif
+}
+
 HostFileDevice::~HostFileDevice()
 {
 	if(file >= 0) {
@@ -117,37 +200,224 @@ HostFileDevice::~HostFileDevice()
 	}
 }
 
-bool HostFileDevice::raw_sector_read(storage_size_t address, void* dst, size_t size)
+void HostFileDevice::loadExtents()
+{
+	if(extentsLoaded) {
+		return;
+	}
+
+	extents.clear();
+
+	// Raw devices have no holes
+	if(blockDevice) {
+		extents.add(0, sectorCount);
+		extentsLoaded = true;
+		return;
+	}
+
+#ifdef SEEK_DATA
+	const uint64_t filesize = getSize();
+	uint64_t pos{0};
+	while(pos < filesize) {
+		auto start = ::lseek64(file, pos, SEEK_DATA);
+		if(start < 0) {
+			if(errno == ENXIO) {
+				// No more data
+				break;
+			}
+			// Not supported by filesystem, so all sectors must be considered allocated
+			debug_w("[HFD] SEEK_DATA failed, %d", errno);
+			extents.clear();
+			extents.add(0, sectorCount);
+			break;
+		}
+		auto end = ::lseek64(file, start, SEEK_HOLE);
+		if(end < 0 || uint64_t(end) > filesize) {
+			end = filesize;
+		}
+		// Filesystem blocks may be larger than sectors, so round outwards
+		uint64_t startSector = uint64_t(start) >> sectorSizeShift;
+		uint64_t endSector = (uint64_t(end) + sectorSize - 1) >> sectorSizeShift;
+		extents.add(startSector, endSector - startSector);
+		pos = end;
+	}
+#else
+	extents.add(0, sectorCount);
+#endif
+
+	debug_d("[HFD] '%s' has %u extents, %llu sectors allocated", name.c_str(), extents.count(),
+			extents.totalSectors());
+
+	extentsLoaded = true;
+}
+
+bool HostFileDevice::readData(uint64_t sector, void* dst, size_t count)
 {
-	auto offset = uint64_t(address) << sectorSizeShift;
+	auto offset = sector << sectorSizeShift;
 	auto res = ::lseek64(file, offset, SEEK_SET);
 	if(uint64_t(res) != offset) {
 		return false;
 	}
 
-	size <<= sectorSizeShift;
-	auto count = ::read(file, dst, size);
-	return size_t(count) == size;
+	size_t size = count << sectorSizeShift;
+	auto n = ::read(file, dst, size);
+	return size_t(n) == size;
 }
 
-bool HostFileDevice::raw_sector_write(storage_size_t address, const void* src, size_t size)
+bool HostFileDevice::raw_sector_read(storage_size_t address, void* dst, size_t size)
+{
+	loadExtents();
+
+	auto dstptr = static_cast<uint8_t*>(dst);
+	uint64_t sector = address;
+	const uint64_t endSector = sector + size;
+	while(sector < endSector) {
+		auto ext = extents.find(sector);
+		uint64_t dataStart = ext ? std::max(ext.start, sector) : endSector;
+		dataStart = std::min(dataStart, endSector);
+
+		// Hole: no need to touch the file
+		if(dataStart > sector) {
+			size_t len = (dataStart - sector) << sectorSizeShift;
+			memset(dstptr, 0, len);
+			dstptr += len;
+			sector = dataStart;
+			continue;
+		}
+
+		auto count = std::min(ext.end(), endSector) - sector;
+		if(!readData(sector, dstptr, count)) {
+			return false;
+		}
+		dstptr += count << sectorSizeShift;
+		sector += count;
+	}
+
+	return true;
+}
+
+bool HostFileDevice::writeData(uint64_t sector, const void* src, size_t count)
 {
-	auto offset = uint64_t(address) << sectorSizeShift;
+	auto offset = sector << sectorSizeShift;
 	auto res = ::lseek64(file, offset, SEEK_SET);
 	if(uint64_t(res) != offset) {
 		return false;
 	}
 
-	size <<= sectorSizeShift;
-	auto count = ::write(file, src, size);
-	return size_t(count) == size;
+	size_t size = count << sectorSizeShift;
+	auto n = ::write(file, src, size);
+	if(size_t(n) != size) {
+		return false;
+	}
+
+	if(extentsLoaded) {
+		extents.add(sector, count);
+	}
+	return true;
+}
+
+bool HostFileDevice::punchHole(uint64_t sector, size_t count)
+{
+	auto offset = sector << sectorSizeShift;
+	auto len = uint64_t(count) << sectorSizeShift;
+	if(!zeroSparse(file, offset, len)) {
+		return false;
+	}
+
+	// Range reads as zeroes whether or not the filesystem actually released the blocks
+	if(extentsLoaded) {
+		extents.remove(sector, count);
+	}
+	return true;
+}
+
+bool HostFileDevice::raw_sector_write(storage_size_t address, const void* src, size_t size)
+{
+	if(!zeroDetect || blockDevice) {
+		return writeData(address, src, size);
+	}
+
+	loadExtents();
+
+	// Split into runs of zero and non-zero sectors
+	auto srcptr = static_cast<const uint8_t*>(src);
+	uint64_t sector = address;
+	while(size != 0) {
+		bool zero = isZeroFilled(srcptr, sectorSize);
+		size_t count{1};
+		while(count < size && isZeroFilled(&srcptr[count << sectorSizeShift], sectorSize) == zero) {
+			++count;
+		}
+
+		if(!zero) {
+			if(!writeData(sector, srcptr, count)) {
+				return false;
+			}
+		} else if(extents.intersects(sector, count)) {
+			if(!punchHole(sector, count)) {
+				return false;
+			}
+		}
+
+		srcptr += count << sectorSizeShift;
+		sector += count;
+		size -= count;
+	}
+
+	return true;
 }
 
 bool HostFileDevice::raw_sector_erase_range(storage_size_t address, size_t size)
 {
-	auto offset = uint64_t(address) << sectorSizeShift;
-	auto len = uint64_t(size) << sectorSizeShift;
-	return zeroSparse(file, offset, len);
+#ifdef __linux__
+	if(blockDevice) {
+		/*
+		 * Erased sectors must read as zeroes, which BLKDISCARD does not guarantee.
+		 * The kernel implements BLKZEROOUT using discard (unmap) where the device supports this.
+		 */
+		uint64_t range[]{uint64_t(address) << sectorSizeShift, uint64_t(size) << sectorSizeShift};
+		if(::ioctl(file, BLKZEROOUT, range) == 0) {
+			return true;
+		}
+		debug_e("[HFD] BLKZEROOUT failed, %d", errno);
+		return false;
+	}
+#endif
+
+	return punchHole(address, size);
+}
+
+bool HostFileDevice::clone(const String& source, const String& dest)
+{
+#ifdef FICLONE
+	int src = ::open(source.c_str(), O_BINARY | O_RDONLY);
+	if(src < 0) {
+		return false;
+	}
+	int dst = ::open(dest.c_str(), O_CREAT | O_TRUNC | O_BINARY | O_WRONLY, 0644);
+	if(dst < 0) {
+		::close(src);
+		return false;
+	}
+	bool res = ::ioctl(dst, FICLONE, src) == 0;
+	if(!res) {
+		debug_w("[HFD] Reflink '%s' failed, %d", source.c_str(), errno);
+	}
+	::close(dst);
+	::close(src);
+	if(!res) {
+		::unlink(dest.c_str());
+	}
+	return res;
+#else
+	return false;
+#endif
+}
+
+bool HostFileDevice::raw_sector_is_allocated(storage_size_t address, storage_size_t size)
+{
+	loadExtents();
+	return extents.intersects(address, size);
 }
 
 } // namespace Storage::Disk
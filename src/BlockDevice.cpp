@@ -9,6 +9,7 @@
  ****/
 
 #include "include/Storage/Disk/BlockDevice.h"
+#include "include/Storage/Disk/diskdefs.h"
 #include <debug_progmem.h>
 
 namespace Storage::Disk
@@ -86,6 +87,12 @@ bool BlockDevice::read(storage_size_t address, void* dst, size_t size)
 	uint32_t offset = address & (sectorSize - 1);
 	auto dstptr = static_cast<uint8_t*>(dst);
 
+	// Multi-sector transfers bypass buffers, picking up any unwritten data first
+	if(offset == 0 && size > sectorSize && (size & (sectorSize - 1)) == 0) {
+		auto count = size >> sectorSizeShift;
+		return flushBuffers(sector, count) && raw_sector_read(sector, dst, count);
+	}
+
 	while(size != 0) {
 		size_t chunkSize = std::min(size, size_t(sectorSize - offset));
 		auto& buf = buffers->get(sector);
@@ -123,6 +130,13 @@ bool BlockDevice::write(storage_size_t address, const void* src, size_t size)
 	uint32_t offset = address & (sectorSize - 1);
 	auto srcptr = static_cast<const uint8_t*>(src);
 
+	// Multi-sector transfers bypass buffers, so discard any stale copies
+	if(offset == 0 && size > sectorSize && (size & (sectorSize - 1)) == 0) {
+		auto count = size >> sectorSizeShift;
+		invalidateBuffers(sector, count);
+		return raw_sector_write(sector, src, count);
+	}
+
 	while(size != 0) {
 		size_t chunkSize = std::min(size, size_t(sectorSize - offset));
 		auto& buf = buffers->get(sector);
@@ -170,10 +184,10 @@ bool BlockDevice::erase_range(storage_size_t address, storage_size_t size)
 		return true;
 	}
 
-	for(; size != 0; --size, ++address) {
-		auto& buf = buffers->get(address);
-		stat.update(stat.erase, address, buf.sector);
-		if(buf.sector == address) {
+	// Range may be very large, so check each buffer rather than each sector
+	for(auto& buf : *buffers) {
+		if(buf.sector != Buffer::invalid && buf.sector >= address && buf.sector - address < size) {
+			stat.update(stat.erase, buf.sector, buf.sector);
 			memset(buf.get(), 0, sectorSize);
 			buf.dirty = false;
 		}
@@ -182,6 +196,25 @@ bool BlockDevice::erase_range(storage_size_t address, storage_size_t size)
 	return true;
 }
 
+bool BlockDevice::isAllocated(storage_size_t address, storage_size_t size)
+{
+	CHECK_ALIGN("isAllocated")
+
+	address >>= sectorSizeShift;
+	size >>= sectorSizeShift;
+
+	// Unflushed data counts as allocated
+	if(buffers) {
+		for(auto& buf : *buffers) {
+			if(buf.dirty && buf.sector >= address && buf.sector < address + size) {
+				return true;
+			}
+		}
+	}
+
+	return raw_sector_is_allocated(address, size);
+}
+
 bool BlockDevice::allocateBuffers(unsigned numBuffers)
 {
 	if(!flushBuffers()) {
@@ -195,6 +228,25 @@ bool BlockDevice::allocateBuffers(unsigned numBuffers)
 	return buffers && buffers->size() == numBuffers;
 }
 
+bool BlockDevice::setSectorSize(size_t size)
+{
+	if(!isValidSectorSize(size)) {
+		debug_e("[BD] Unsupported sector size %u", size);
+		return false;
+	}
+	if(size == sectorSize) {
+		return true;
+	}
+
+	unsigned numBuffers = buffers ? buffers->size() : 0;
+	if(!allocateBuffers(0)) {
+		return false;
+	}
+	sectorSize = size;
+	sectorSizeShift = getSizeBits(size);
+	return allocateBuffers(numBuffers);
+}
+
 bool BlockDevice::flushBuffer(Buffer& buf)
 {
 	if(!buf.dirty) {
@@ -220,6 +272,34 @@ bool BlockDevice::flushBuffers()
 	return res;
 }
 
+bool BlockDevice::flushBuffers(storage_size_t sector, storage_size_t count)
+{
+	if(!buffers) {
+		return true;
+	}
+
+	for(auto& buf : *buffers) {
+		if(buf.dirty && buf.sector >= sector && buf.sector - sector < count && !flushBuffer(buf)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void BlockDevice::invalidateBuffers(storage_size_t sector, storage_size_t count)
+{
+	if(!buffers) {
+		return;
+	}
+
+	for(auto& buf : *buffers) {
+		if(buf.sector != Buffer::invalid && buf.sector >= sector && buf.sector - sector < count) {
+			buf.invalidate();
+		}
+	}
+}
+
 bool BlockDevice::sync()
 {
 	return flushBuffers() && raw_sync();
@@ -0,0 +1,314 @@
+/****
+ * Crc32.cpp
+ *
+ * Copyright 2022 mikee47 <mike@sillyhouse.net>
+ *
+ * This file is part of the DiskStorage Library
+ *
+ * This library is free software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation, version 3 or later.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this library.
+ * If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****/
+
+#include <Storage/Disk/diskdefs.h>
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CRC32_PCLMUL
+#include <immintrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+#define CRC32_ARMV8
+#include <arm_acle.h>
+#endif
+
+namespace Storage::Disk
+{
+namespace
+{
+constexpr uint32_t polynomial{0xEDB88320}; // Reflected 0x04C11DB7
+
+/*
+ * Tables for slice-by-8 algorithm, generated at compile time.
+ * table[0] is the regular byte-wise table, table[n] advances a byte through n further zero bytes.
+ */
+struct CrcTable {
+	uint32_t table[8][256];
+};
+
+constexpr CrcTable makeTable()
+{
+	CrcTable t{};
+	for(unsigned i = 0; i < 256; ++i) {
+		uint32_t crc = i;
+		for(unsigned j = 0; j < 8; ++j) {
+			crc = (crc >> 1) ^ ((crc & 1) ? polynomial : 0);
+		}
+		t.table[0][i] = crc;
+	}
+	for(unsigned i = 0; i < 256; ++i) {
+		for(unsigned n = 1; n < 8; ++n) {
+			auto prev = t.table[n - 1][i];
+			t.table[n][i] = (prev >> 8) ^ t.table[0][prev & 0xff];
+		}
+	}
+	return t;
+}
+
+const CrcTable crcTable PROGMEM = makeTable();
+
+uint32_t read32(const uint8_t* ptr)
+{
+	uint32_t value;
+	memcpy(&value, ptr, sizeof(value));
+	return value;
+}
+
+/*
+ * All functions operate on the raw (inverted) CRC value
+ */
+uint32_t crc32_table(uint32_t crc, const uint8_t* ptr, size_t length)
+{
+	auto& t = crcTable.table;
+
+	// Byte-wise until aligned
+	while(length != 0 && (uintptr_t(ptr) & 3) != 0) {
+		crc = t[0][(crc ^ *ptr++) & 0xff] ^ (crc >> 8);
+		--length;
+	}
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	while(length >= 8) {
+		uint32_t one = read32(ptr) ^ crc;
+		uint32_t two = read32(ptr + 4);
+		crc = t[7][one & 0xff] ^ t[6][(one >> 8) & 0xff] ^ t[5][(one >> 16) & 0xff] ^ t[4][one >> 24] ^
+			  t[3][two & 0xff] ^ t[2][(two >> 8) & 0xff] ^ t[1][(two >> 16) & 0xff] ^ t[0][two >> 24];
+		ptr += 8;
+		length -= 8;
+	}
+#endif
+
+	while(length-- != 0) {
+		crc = t[0][(crc ^ *ptr++) & 0xff] ^ (crc >> 8);
+	}
+
+	return crc;
+}
+
+/*
+ * Polynomial arithmetic modulo the CRC polynomial, as used by zlib crc32_combine.
+ * Bit 31 represents x^0.
+ */
+constexpr uint32_t multmodp(uint32_t a, uint32_t b)
+{
+	uint32_t m = 1U << 31;
+	uint32_t p = 0;
+	for(;;) {
+		if(a & m) {
+			p ^= b;
+			if((a & (m - 1)) == 0) {
+				break;
+			}
+		}
+		m >>= 1;
+		b = (b & 1) ? (b >> 1) ^ polynomial : b >> 1;
+	}
+	return p;
+}
+
+// x^(2^n) modulo polynomial
+struct X2nTable {
+	uint32_t table[32];
+};
+
+constexpr X2nTable makeX2nTable()
+{
+	X2nTable t{};
+	uint32_t p = 1U << 30; // x^1
+	t.table[0] = p;
+	for(unsigned n = 1; n < 32; ++n) {
+		p = multmodp(p, p);
+		t.table[n] = p;
+	}
+	return t;
+}
+
+const X2nTable x2nTable PROGMEM = makeX2nTable();
+
+// x^(n * 2^k) modulo polynomial
+uint32_t x2nmodp(uint64_t n, unsigned k)
+{
+	uint32_t p = 1U << 31; // x^0
+	while(n != 0) {
+		if(n & 1) {
+			p = multmodp(x2nTable.table[k & 31], p);
+		}
+		n >>= 1;
+		++k;
+	}
+	return p;
+}
+
+#ifdef CRC32_PCLMUL
+
+__attribute__((target("pclmul,sse4.1"))) inline __m128i fold(__m128i acc, __m128i k, __m128i next)
+{
+	auto lo = _mm_clmulepi64_si128(acc, k, 0x00);
+	acc = _mm_clmulepi64_si128(acc, k, 0x11);
+	return _mm_xor_si128(_mm_xor_si128(acc, next), lo);
+}
+
+/*
+ * Carry-less multiplication folding, as described in Intel's paper
+ * "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction".
+ * Constants and structure as used in zlib (chromium) crc32_sse42_simd_.
+ *
+ * Length must be at least 64 and a multiple of 16.
+ */
+__attribute__((target("pclmul,sse4.1"))) uint32_t crc32_pclmul(uint32_t crc, const uint8_t* buf, size_t len)
+{
+	alignas(16) static const uint64_t k1k2[]{0x0154442bd4, 0x01c6e41596};
+	alignas(16) static const uint64_t k3k4[]{0x01751997d0, 0x00ccaa009e};
+	alignas(16) static const uint64_t k5k0[]{0x0163cd6124, 0x0000000000};
+	alignas(16) static const uint64_t poly[]{0x01db710641, 0x01f7011641};
+
+	__m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+	x1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf + 0x00));
+	x2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf + 0x10));
+	x3 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf + 0x20));
+	x4 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+	x0 = _mm_load_si128(reinterpret_cast<const __m128i*>(k1k2));
+	buf += 64;
+	len -= 64;
+
+	// Fold 64-byte blocks in parallel
+	while(len >= 64) {
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf + 0x00)));
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf + 0x10)));
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf + 0x20)));
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf + 0x30)));
+		buf += 64;
+		len -= 64;
+	}
+
+	// Fold into 128 bits
+	x0 = _mm_load_si128(reinterpret_cast<const __m128i*>(k3k4));
+	x1 = fold(x1, x0, x2);
+	x1 = fold(x1, x0, x3);
+	x1 = fold(x1, x0, x4);
+
+	// Fold remaining 16-byte blocks
+	while(len >= 16) {
+		x1 = fold(x1, x0, _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf)));
+		buf += 16;
+		len -= 16;
+	}
+
+	// Fold 128 bits to 64 bits
+	x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+	x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+	x1 = _mm_srli_si128(x1, 8);
+	x1 = _mm_xor_si128(x1, x2);
+
+	x0 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(k5k0));
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, x3);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	// Barrett reduction to 32 bits
+	x0 = _mm_load_si128(reinterpret_cast<const __m128i*>(poly));
+	x2 = _mm_and_si128(x1, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+	x2 = _mm_and_si128(x2, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	return _mm_extract_epi32(x1, 1);
+}
+
+bool havePclmul()
+{
+	// Initialisation is thread-safe
+	static const bool supported = []() {
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+	}();
+	return supported;
+}
+
+#elif defined(CRC32_ARMV8)
+
+uint32_t crc32_armv8(uint32_t crc, const uint8_t* ptr, size_t length)
+{
+	while(length != 0 && (uintptr_t(ptr) & 7) != 0) {
+		crc = __crc32b(crc, *ptr++);
+		--length;
+	}
+	while(length >= 8) {
+		uint64_t value;
+		memcpy(&value, ptr, sizeof(value));
+		crc = __crc32d(crc, value);
+		ptr += 8;
+		length -= 8;
+	}
+	while(length-- != 0) {
+		crc = __crc32b(crc, *ptr++);
+	}
+	return crc;
+}
+
+#endif
+
+} // namespace
+
+uint32_t crc32_byte(uint32_t crc, uint8_t d)
+{
+	return crcTable.table[0][(crc ^ d) & 0xff] ^ (crc >> 8);
+}
+
+uint32_t crc32_combine(uint32_t crc1, uint32_t crc2, uint64_t length2)
+{
+	// Append length2 zero bytes (8 * length2 bits) to crc1
+	return multmodp(x2nmodp(length2, 3), crc1) ^ crc2;
+}
+
+uint32_t crc32(uint32_t bcc, const void* data, size_t length)
+{
+	uint32_t crc = ~bcc;
+	auto ptr = static_cast<const uint8_t*>(data);
+
+#if defined(CRC32_PCLMUL)
+	if(length >= 64 && havePclmul()) {
+		size_t blockLength = length & ~size_t(15);
+		crc = crc32_pclmul(crc, ptr, blockLength);
+		ptr += blockLength;
+		length -= blockLength;
+	}
+	crc = crc32_table(crc, ptr, length);
+#elif defined(CRC32_ARMV8)
+	crc = crc32_armv8(crc, ptr, length);
+#else
+	crc = crc32_table(crc, ptr, length);
+#endif
+
+	return ~crc;
+}
+
+} // namespace Storage::Disk
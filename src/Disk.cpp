@@ -2,23 +2,102 @@
 #include "include/Storage/Disk/Scanner.h"
 #include <Storage/Device.h>
 
+#ifdef ARCH_HOST
+#include <thread>
+#include <atomic>
+#endif
+
 namespace Storage::Disk
 {
-bool scanPartitions(Device& device)
+namespace
+{
+bool scan(Device& device, Scanner& scanner)
 {
 	auto& pt = device.editablePartitions();
 	pt.clear();
 
-	Scanner scanner(device);
 	std::unique_ptr<PartInfo> part;
 	while((part = scanner.next())) {
-		if(part->name.length() == 0 && part->uniqueGuid) {
-			part->name = part->uniqueGuid;
-		}
 		pt.add(part.release());
 	}
 
 	return bool(scanner);
 }
 
+} // namespace
+
+bool scanPartitions(Device& device, bool identifyVolumes)
+{
+	Scanner scanner(device, identifyVolumes);
+	return scan(device, scanner);
+}
+
+unsigned scanPartitions(Device* const devices[], unsigned count, bool results[], bool identifyVolumes)
+{
+#ifdef ARCH_HOST
+	// Scanning is I/O bound so use more threads than processors, bounded by number of devices
+	constexpr unsigned maxThreads{16};
+	unsigned numThreads = std::min(count, maxThreads);
+	if(numThreads > 1) {
+		auto scanDevice = [&](unsigned i) {
+			bool res = scanPartitions(*devices[i], identifyVolumes);
+			if(results != nullptr) {
+				results[i] = res;
+			}
+			return res;
+		};
+		std::atomic<unsigned> nextIndex{0};
+		std::atomic<unsigned> successCount{0};
+		auto worker = [&]() {
+			unsigned i;
+			while((i = nextIndex++) < count) {
+				if(scanDevice(i)) {
+					++successCount;
+				}
+			}
+		};
+
+		// Calling thread also does work
+		std::unique_ptr<std::thread[]> threads(new std::thread[numThreads - 1]);
+		for(unsigned i = 0; i < numThreads - 1; ++i) {
+			threads[i] = std::thread(worker);
+		}
+		worker();
+		for(unsigned i = 0; i < numThreads - 1; ++i) {
+			threads[i].join();
+		}
+		return successCount;
+	}
+#endif
+
+	MultiScanTask task(devices, count, identifyVolumes);
+	task.run();
+	if(results != nullptr) {
+		for(unsigned i = 0; i < count; ++i) {
+			results[i] = task.getResult(i);
+		}
+	}
+	return task.getSuccessCount();
+}
+
+bool scanPartitions(Device& device, ScanCache& cache)
+{
+	if(cache.load(device)) {
+		return true;
+	}
+
+	Scanner scanner(device);
+	if(!scan(device, scanner)) {
+		cache.invalidate();
+		return false;
+	}
+
+	if(scanner.hasExtendedPartition() || scanner.usedBackupGpt()) {
+		cache.invalidate();
+	} else {
+		cache.save(device);
+	}
+	return true;
+}
+
 } // namespace Storage::Disk
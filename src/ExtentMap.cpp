@@ -0,0 +1,124 @@
+/****
+ * ExtentMap.cpp
+ *
+ * Copyright 2022 mikee47 <mike@sillyhouse.net>
+ *
+ * This file is part of the DiskStorage Library
+ *
+ * This library is free software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation, version 3 or later.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this library.
+ * If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****/
+
+#include "include/Storage/Disk/ExtentMap.h"
+#include <algorithm>
+
+namespace Storage::Disk
+{
+void ExtentMap::add(uint64_t start, uint64_t count)
+{
+	if(count == 0) {
+		return;
+	}
+	auto end = start + count;
+
+	// Merge with any preceding extent which overlaps or abuts this one
+	auto it = map.upper_bound(start);
+	if(it != map.begin()) {
+		auto prev = std::prev(it);
+		if(prev->second >= start) {
+			start = prev->first;
+			end = std::max(end, prev->second);
+			it = map.erase(prev);
+		}
+	}
+
+	// Absorb following extents
+	while(it != map.end() && it->first <= end) {
+		end = std::max(end, it->second);
+		it = map.erase(it);
+	}
+
+	map.emplace_hint(it, start, end);
+}
+
+void ExtentMap::remove(uint64_t start, uint64_t count)
+{
+	if(count == 0) {
+		return;
+	}
+	auto end = start + count;
+
+	auto it = map.upper_bound(start);
+	if(it != map.begin()) {
+		auto prev = std::prev(it);
+		if(prev->second > start) {
+			auto prevEnd = prev->second;
+			prev->second = start;
+			if(prev->first == start) {
+				map.erase(prev);
+			}
+			if(prevEnd > end) {
+				map.emplace(end, prevEnd);
+				return;
+			}
+		}
+	}
+
+	while(it != map.end() && it->first < end) {
+		auto extEnd = it->second;
+		it = map.erase(it);
+		if(extEnd > end) {
+			map.emplace_hint(it, end, extEnd);
+			break;
+		}
+	}
+}
+
+bool ExtentMap::intersects(uint64_t start, uint64_t count) const
+{
+	auto ext = find(start);
+	return ext && ext.start < start + count;
+}
+
+bool ExtentMap::contains(uint64_t start, uint64_t count) const
+{
+	if(count == 0) {
+		return true;
+	}
+	auto ext = find(start);
+	return ext && ext.start <= start && ext.end() >= start + count;
+}
+
+ExtentMap::Extent ExtentMap::find(uint64_t sector) const
+{
+	auto it = map.upper_bound(sector);
+	if(it != map.begin()) {
+		auto prev = std::prev(it);
+		if(prev->second > sector) {
+			it = prev;
+		}
+	}
+	if(it == map.end()) {
+		return Extent{};
+	}
+	return Extent{it->first, it->second - it->first};
+}
+
+uint64_t ExtentMap::totalSectors() const
+{
+	uint64_t total{0};
+	for(auto& e : map) {
+		total += e.second - e.first;
+	}
+	return total;
+}
+
+} // namespace Storage::Disk
@@ -22,6 +22,7 @@
 #include <Storage/Disk/SectorBuffer.h>
 #include <Storage/Disk/diskdefs.h>
 #include <FlashString/Array.hpp>
+#include <debug_progmem.h>
 
 // Definitions from FileSystem
 namespace Storage::Disk
@@ -54,98 +55,319 @@ String getTypeName(const Uuid& typeGuid)
 	return nullptr;
 }
 
-} // namespace GPT
+bool verifyHeader(gpt_header_t& gpt)
+{
+	/* Check signature, version (1.0) and length (92) */
+	if(gpt.signature != GPT_HEADER_SIGNATURE) {
+		debug_e("[GPT] Bad signature");
+		return false;
+	}
+	if(gpt.revision != GPT_HEADER_REVISION_V1) {
+		debug_e("[GPT] Bad revision");
+		return false;
+	}
+	if(gpt.header_size < GPT_HEADER_SIZE) {
+		debug_e("[GPT] Bad size %u", gpt.header_size);
+		return false;
+	}
 
-/* Create partitions in GPT format */
-Error formatDisk(BlockDevice& device, GPT::PartitionTable& table, const Uuid& diskGuid)
+	uint32_t crc32_saved = gpt.header_crc32;
+	gpt.header_crc32 = 0;
+	uint32_t bcc = crc32(&gpt, gpt.header_size);
+	gpt.header_crc32 = crc32_saved;
+	if(bcc != crc32_saved) {
+		debug_e("[GPT] bcc 0x%08x, ~bcc 0x%08x, crc32 0x%08x", bcc, ~bcc, crc32_saved);
+		return false;
+	}
+	// Entry size is 128 * 2^n
+	if(gpt.sizeof_partition_entry < sizeof(gpt_entry_t) || !isLog2(gpt.sizeof_partition_entry)) {
+		debug_e("[GPT] Bad sizeof_partition_entry %u", gpt.sizeof_partition_entry);
+		return false;
+	}
+	// Array size must fit in 32 bits
+	if(gpt.num_partition_entries == 0 ||
+	   uint64_t(gpt.num_partition_entries) * gpt.sizeof_partition_entry > UINT32_MAX) {
+		debug_e("[GPT] Bad num_partition_entries %u", gpt.num_partition_entries);
+		return false;
+	}
+
+	return true;
+}
+
+namespace
 {
-	if(table.isEmpty()) {
-		return Error::BadParam;
+/*
+ * Calculate CRC of partition entry array, reading in chunks of buffer size
+ */
+bool getEntryArrayCrc(BlockDevice& device, const gpt_header_t& header, SectorBuffer& buffer, uint32_t& crc)
+{
+	const uint8_t sectorSizeShift = getSizeBits(device.getSectorSize());
+	const size_t arraySize = size_t(header.num_partition_entries) * header.sizeof_partition_entry;
+	const uint32_t arraySectors = getBlockCount(arraySize, device.getSectorSize());
+
+	Crc32 bcc;
+	size_t remaining = arraySize;
+	for(uint32_t offset = 0; offset < arraySectors; offset += buffer.sectors()) {
+		auto count = std::min(buffer.sectors(), arraySectors - offset);
+		if(!device.read((header.partition_entry_lba + offset) << sectorSizeShift, buffer.get(),
+						count << sectorSizeShift)) {
+			return false;
+		}
+		auto len = std::min(remaining, size_t(count) << sectorSizeShift);
+		bcc.update(buffer.get(), len);
+		remaining -= len;
 	}
+	crc = bcc.value();
+	return true;
+}
 
-#if DISK_MAX_SECTOR_SIZE != DISK_MIN_SECTOR_SIZE
+} // namespace
+
+Error repair(BlockDevice& device)
+{
 	const uint16_t sectorSize = device.getSectorSize();
-	if(sectorSize > DISK_MAX_SECTOR_SIZE || sectorSize < DISK_MIN_SECTOR_SIZE || !isLog2(sectorSize)) {
+	if(!isValidSectorSize(sectorSize)) {
 		return Error::BadParam;
 	}
-#else
-	const uint16_t sectorSize = DISK_MAX_SECTOR_SIZE;
-#endif
 	const uint8_t sectorSizeShift = getSizeBits(sectorSize);
+	const uint64_t lastLba = device.getSectorCount() - 1;
 
-	/* Get working buffer */
-	SectorBuffer workBuffer(sectorSize, 1);
-	if(!workBuffer) {
+	// Index 0 is primary, 1 is backup
+	const uint64_t headerLba[2]{GPT_PRIMARY_PARTITION_TABLE_LBA, lastLba};
+	SectorBuffer headers[2]{{sectorSize, 1}, {sectorSize, 1}};
+	SectorBuffer buffer(sectorSize, std::max(1, 16384 >> sectorSizeShift));
+	if(!headers[0] || !headers[1] || !buffer) {
 		return Error::NoMem;
 	}
 
-	auto writeSectors = [&](storage_size_t sector, const void* buff, size_t count) -> bool {
-		return device.write(sector << sectorSizeShift, buff, count << sectorSizeShift);
-	};
+	bool valid[2]{};
+	uint32_t headerCrc[2]{}; // Non-zero if header itself is intact
+	for(unsigned i = 0; i < 2; ++i) {
+		if(!device.read(headerLba[i] << sectorSizeShift, headers[i].get(), sectorSize)) {
+			return Error::ReadFailure;
+		}
+		auto& header = headers[i].as<gpt_header_t>();
+		if(!verifyHeader(header) || header.header_size > sectorSize || header.my_lba != headerLba[i]) {
+			continue;
+		}
+		headerCrc[i] = header.header_crc32;
+		uint32_t crc;
+		if(!getEntryArrayCrc(device, header, buffer, crc)) {
+			return Error::ReadFailure;
+		}
+		valid[i] = (crc == header.partition_entry_array_crc32);
+	}
+
+	if(valid[0] && valid[1]) {
+		return Error::Success;
+	}
+	if(!valid[0] && !valid[1]) {
+		debug_e("[GPT] Primary and backup tables both invalid");
+		return Error::BadPartitionTable;
+	}
+
+	const unsigned good = valid[0] ? 0 : 1;
+	const unsigned bad = 1 - good;
+	auto& src = headers[good].as<gpt_header_t>();
+	auto& dst = headers[bad].as<gpt_header_t>();
+
+	// Rebuild damaged header from intact copy, preserving any extension fields
+	memcpy(headers[bad].get(), headers[good].get(), sectorSize);
+	const uint32_t arraySectors =
+		getBlockCount(size_t(src.num_partition_entries) * src.sizeof_partition_entry, sectorSize);
+	dst.my_lba = headerLba[bad];
+	dst.alternate_lba = headerLba[good];
+	if(bad == 0) {
+		dst.partition_entry_lba = GPT_PRIMARY_PARTITION_TABLE_LBA + 1;
+		if(dst.partition_entry_lba + arraySectors > src.first_usable_lba) {
+			return Error::BadPartitionTable;
+		}
+	} else {
+		dst.partition_entry_lba = lastLba - arraySectors;
+		if(dst.partition_entry_lba <= src.last_usable_lba) {
+			return Error::BadPartitionTable;
+		}
+	}
+	dst.header_crc32 = 0;
+	dst.header_crc32 = crc32(&dst, dst.header_size);
+
+	// Entry array may be intact even if header is not
+	uint32_t crc;
+	if(!getEntryArrayCrc(device, dst, buffer, crc)) {
+		return Error::ReadFailure;
+	}
+	if(crc != src.partition_entry_array_crc32) {
+		for(uint32_t offset = 0; offset < arraySectors; offset += buffer.sectors()) {
+			size_t size = std::min(buffer.sectors(), arraySectors - offset) << sectorSizeShift;
+			if(!device.read((src.partition_entry_lba + offset) << sectorSizeShift, buffer.get(), size)) {
+				return Error::ReadFailure;
+			}
+			if(!device.write((dst.partition_entry_lba + offset) << sectorSizeShift, buffer.get(), size)) {
+				return Error::WriteFailure;
+			}
+		}
+	}
+
+	// Header goes last so it never refers to an incomplete array
+	if(dst.header_crc32 == headerCrc[bad]) {
+		debug_i("[GPT] Restored %s entry array", bad ? "backup" : "primary");
+		return device.sync() ? Error::Success : Error::WriteFailure;
+	}
+	if(!device.write(dst.my_lba << sectorSizeShift, &dst, sectorSize) || !device.sync()) {
+		return Error::WriteFailure;
+	}
 
-	const auto driveSectors = device.getSectorCount();
-	const auto partAlignSectors = PARTITION_ALIGN >> sectorSizeShift; // Partition alignment for GPT [sector]
-	const auto numPartitionTableSectors =
-		GPT_ITEMS * sizeof(gpt_entry_t) >> sectorSizeShift; // Size of partition table [sector]
-	const uint64_t backupPartitionTableSector = driveSectors - numPartitionTableSectors - 1;
+	debug_i("[GPT] Restored %s table from %s", bad ? "backup" : "primary", good ? "backup" : "primary");
+	return Error::Success;
+}
+
+} // namespace GPT
+
+namespace GPT
+{
+Formatter::Formatter(BlockDevice& device, PartitionTable& table, const Uuid& diskGuid, const FormatOptions& options)
+	: device(device), table(table), diskGuid(diskGuid), options(options)
+{
+}
+
+Error Formatter::init()
+{
+	if(table.isEmpty()) {
+		return Error::BadParam;
+	}
+
+	sectorSize = device.getSectorSize();
+	if(!isValidSectorSize(sectorSize)) {
+		return Error::BadParam;
+	}
+	sectorSizeShift = getSizeBits(sectorSize);
+
+	partCount = 0;
+	for(auto& part : table) {
+		(void)part;
+		++partCount;
+	}
+
+	const uint32_t entrySize = options.entrySize;
+	const uint64_t arraySize = uint64_t(options.numEntries) * entrySize;
+	if(entrySize < sizeof(gpt_entry_t) || !isLog2(entrySize) || options.numEntries < partCount ||
+	   arraySize > UINT32_MAX) {
+		return Error::BadParam;
+	}
+	entryArraySize = arraySize;
+
+	driveSectors = device.getSectorCount();
+	const uint32_t alignment = options.alignment ?: getPartitionAlignment(device);
+	if(alignment % sectorSize != 0) {
+		return Error::BadParam;
+	}
+	const uint32_t partAlignSectors = alignment >> sectorSizeShift; // Partition alignment for GPT [sector]
+	numPartitionTableSectors =
+		getBlockCount(std::max(arraySize, uint64_t(GPT_MIN_ENTRY_ARRAY_SIZE)), sectorSize); // [sector]
 
-	const uint64_t firstAllocatableSector = align_up(2 + numPartitionTableSectors, partAlignSectors);
+	/* Get working buffer. Entry array is written in chunks as large as memory allows, each holding whole entries */
+	const uint32_t minChunkSectors = std::max(entrySize >> sectorSizeShift, 1U);
+	const uint32_t maxChunkSectors = std::max(uint32_t(FORMAT_MAX_TRANSFER_SIZE) >> sectorSizeShift, minChunkSectors);
+	const uint64_t bufferSectors =
+		std::max(uint64_t(numPartitionTableSectors), getBlockCount(uint64_t(options.zeroSize), sectorSize));
+	if(!workBuffer.allocate(sectorSize, std::min(uint64_t(maxChunkSectors), bufferSectors), minChunkSectors)) {
+		return Error::NoMem;
+	}
+	chunkSectors = workBuffer.sectors();
+
+	const uint64_t firstAllocatableSector =
+		getBlockCount(2 + uint64_t(numPartitionTableSectors), partAlignSectors) * partAlignSectors;
+	if(firstAllocatableSector + numPartitionTableSectors + 1 >= driveSectors) {
+		return Error::NoSpace;
+	}
+	backupPartitionTableSector = driveSectors - numPartitionTableSectors - 1;
 	const uint64_t allocatableSectors = backupPartitionTableSector - firstAllocatableSector;
-	auto err = validate(table, firstAllocatableSector, allocatableSectors, sectorSize);
+	auto err = validate(table, firstAllocatableSector, allocatableSectors, sectorSize, alignment);
 	if(!!err) {
 		return err;
 	}
 
-	uint32_t bcc = 0;			 // Cumulative partition entry checksum
-	unsigned partitionIndex = 0; // partition table index
-	auto entries = workBuffer.as<gpt_entry_t[]>();
-	const auto entriesPerSector = sectorSize / sizeof(gpt_entry_t);
-	auto part = table.begin();
-	for(; partitionIndex < GPT_ITEMS; ++partitionIndex) {
-		auto i = partitionIndex % entriesPerSector;
-		if(i == 0) {
-			workBuffer.clear();
-		}
+	if(!diskGuid) {
+		diskGuid.generate();
+	}
+
+	// Entries are written over several steps so keep a list
+	parts.reset(new(std::nothrow) PartInfo*[partCount]);
+	if(!parts) {
+		return Error::NoMem;
+	}
+	unsigned n{0};
+	for(auto& part : table) {
+		parts[n++] = &part;
+	}
 
-		auto& entry = entries[i];
+	progressTotal = numPartitionTableSectors + 3;
+	if(options.discard) {
+		discardSectors = std::max(uint32_t(FORMAT_MAX_DISCARD_SIZE) >> sectorSizeShift, 1U);
+		progressTotal += getBlockCount(driveSectors, discardSectors);
+	}
+	if(options.zeroSize != 0) {
+		progressTotal += partCount;
+	}
 
-		// Add a partition?
-		if(part != table.end()) {
-			auto dp = part->diskpart();
-			assert(dp != nullptr);
-			entry = gpt_entry_t{
-				.partition_type_guid = dp->typeGuid,
-				.unique_partition_guid = dp->uniqueGuid,
-				.starting_lba = part->offset >> sectorSizeShift,
-				.ending_lba = ((uint64_t(part->offset) + part->size) >> sectorSizeShift) - 1,
-			};
-
-			auto namePtr = part->name.c_str();
-			for(unsigned j = 0; j < ARRAY_SIZE(entry.partition_name) && *namePtr != '\0'; ++j, ++namePtr) {
-				entry.partition_name[j] = *namePtr;
-			}
+	return Error::Success;
+}
 
-			++part;
+bool Formatter::writeSectors(uint64_t sector, const void* buff, size_t count)
+{
+	return device.write(sector << sectorSizeShift, buff, count << sectorSizeShift);
+}
+
+bool Formatter::writeEntries()
+{
+	const uint32_t count = std::min(chunkSectors, numPartitionTableSectors - entrySector);
+	const uint32_t chunkSize = count << sectorSizeShift;
+	const uint32_t chunkOffset = entrySector << sectorSizeShift;
+	memset(workBuffer.get(), 0, chunkSize);
+
+	const uint32_t entrySize = options.entrySize;
+	for(uint32_t offset = 0; offset < chunkSize; offset += entrySize) {
+		// Add a partition?
+		uint32_t partitionIndex = (chunkOffset + offset) / entrySize;
+		if(partitionIndex >= partCount) {
+			break;
 		}
 
-		// Update cumulative partition entry checksum
-		bcc = crc32(bcc, &entry, sizeof(entry));
+		auto part = parts[partitionIndex];
+		auto dp = part->diskpart();
+		assert(dp != nullptr);
+		auto& entry = *reinterpret_cast<gpt_entry_t*>(&workBuffer[offset]);
+		entry = gpt_entry_t{
+			.partition_type_guid = dp->typeGuid,
+			.unique_partition_guid = dp->uniqueGuid,
+			.starting_lba = part->offset >> sectorSizeShift,
+			.ending_lba = ((uint64_t(part->offset) + part->size) >> sectorSizeShift) - 1,
+		};
 
-		// Write the buffer if it is filled up
-		if(i + 1 == entriesPerSector) {
-			// Write to primary table
-			auto entryRelativeSector = partitionIndex / entriesPerSector;
-			if(!writeSectors(2 + entryRelativeSector, entries, 1)) {
-				return Error::WriteFailure;
-			}
-			// Write to secondary table
-			if(!writeSectors(backupPartitionTableSector + entryRelativeSector, entries, 1)) {
-				return Error::WriteFailure;
-			}
+		auto namePtr = part->name.c_str();
+		for(unsigned j = 0; j < ARRAY_SIZE(entry.partition_name) && *namePtr != '\0'; ++j, ++namePtr) {
+			entry.partition_name[j] = *namePtr;
 		}
 	}
 
-	/* Create primary GPT header */
+	// Update cumulative partition entry checksum, excluding any padding
+	if(chunkOffset < entryArraySize) {
+		bcc = crc32(bcc, workBuffer.get(), std::min(chunkSize, entryArraySize - chunkOffset));
+	}
+
+	// Write to primary and secondary tables
+	if(!writeSectors(2 + entrySector, workBuffer.get(), count) ||
+	   !writeSectors(backupPartitionTableSector + entrySector, workBuffer.get(), count)) {
+		return false;
+	}
+
+	entrySector += count;
+	return true;
+}
+
+bool Formatter::writeHeader(bool backup)
+{
+	memset(workBuffer.get(), 0, sectorSize);
 	auto& header = workBuffer.as<gpt_header_t>();
 	header = gpt_header_t{
 		.signature = GPT_HEADER_SIGNATURE,
@@ -155,58 +377,145 @@ Error formatDisk(BlockDevice& device, GPT::PartitionTable& table, const Uuid& di
 		.alternate_lba = driveSectors - 1,
 		.first_usable_lba = 2 + numPartitionTableSectors,
 		.last_usable_lba = backupPartitionTableSector - 1,
+		.disk_guid = diskGuid,
 		.partition_entry_lba = 2,
-		.num_partition_entries = GPT_ITEMS,
-		.sizeof_partition_entry = sizeof(gpt_entry_t),
+		.num_partition_entries = options.numEntries,
+		.sizeof_partition_entry = options.entrySize,
 		.partition_entry_array_crc32 = bcc,
 	};
-	if(diskGuid) {
-		header.disk_guid = diskGuid;
-	} else {
-		header.disk_guid.generate();
+	if(backup) {
+		std::swap(header.my_lba, header.alternate_lba);
+		header.partition_entry_lba = backupPartitionTableSector;
 	}
 	header.header_crc32 = crc32(&header, GPT_HEADER_SIZE);
-	if(!writeSectors(header.my_lba, &header, 1)) {
-		return Error::WriteFailure;
+	return writeSectors(header.my_lba, &header, 1);
+}
+
+/*
+ * Both entry arrays are written before either header. The backup header follows, so if interrupted
+ * after this point the new table can be recovered from the backup. The protective MBR goes last.
+ * The device is synced between each of these so a write-back cache cannot re-order them.
+ */
+bool Formatter::step()
+{
+	switch(stage) {
+	case Stage::init: {
+		auto err = init();
+		if(!!err) {
+			return setError(err);
+		}
+		bool zero = options.zeroSize != 0 && partCount != 0;
+		stage = options.discard ? Stage::discard : zero ? Stage::zeroPartitions : Stage::entries;
+		break;
 	}
 
-	/* Create secondary GPT header */
-	std::swap(header.my_lba, header.alternate_lba);
-	header.partition_entry_lba = backupPartitionTableSector;
-	header.header_crc32 = 0;
-	header.header_crc32 = crc32(&header, GPT_HEADER_SIZE);
-	if(!writeSectors(header.my_lba, &header, 1)) {
-		return Error::WriteFailure;
+	case Stage::discard: {
+		auto count = std::min(uint64_t(discardSectors), driveSectors - discardSector);
+		if(!device.erase_range(discardSector << sectorSizeShift, count << sectorSizeShift)) {
+			return setError(Error::EraseFailure);
+		}
+		discardSector += count;
+		if(discardSector == driveSectors) {
+			bool zero = options.zeroSize != 0 && partCount != 0;
+			stage = zero ? Stage::zeroPartitions : Stage::entries;
+		}
+		break;
 	}
 
-	/* Create protective MBR */
-	auto& mbr = workBuffer.as<legacy_mbr_t>();
-	mbr = legacy_mbr_t{
-		.partition_record = {{
-			.boot_indicator = 0,
-			.start_head = 0,
-			.start_sector = 2,
-			.start_track = 0,
-			.os_type = EFI_PMBR_OSTYPE_EFI_GPT,
-			.end_head = 0xff,
-			.end_sector = 0xff,
-			.end_track = 0xff,
-			.starting_lba = 1,
-			.size_in_lba = uint32_t(std::min(storage_size_t(0xffffffff), driveSectors - 1)),
-		}},
-		.signature = MSDOS_MBR_SIGNATURE,
-	};
-	if(!writeSectors(0, &mbr, 1) || !device.sync()) {
-		return Error::WriteFailure;
+	case Stage::zeroPartitions: {
+		auto err = zeroPartitionStart(device, *parts[zeroIndex], options.zeroSize, workBuffer, zeroOffset);
+		if(!!err) {
+			return setError(err);
+		}
+		if(zeroOffset >= options.zeroSize) {
+			zeroOffset = 0;
+			++zeroIndex;
+			if(zeroIndex == partCount) {
+				stage = Stage::entries;
+			}
+		}
+		break;
+	}
+
+	case Stage::entries:
+		if(!writeEntries()) {
+			return setError(Error::WriteFailure);
+		}
+		if(entrySector == numPartitionTableSectors) {
+			stage = Stage::backupHeader;
+		}
+		break;
+
+	case Stage::backupHeader:
+		if(!device.sync() || !writeHeader(true) || !device.sync()) {
+			return setError(Error::WriteFailure);
+		}
+		stage = Stage::primaryHeader;
+		break;
+
+	case Stage::primaryHeader:
+		if(!writeHeader(false) || !device.sync()) {
+			return setError(Error::WriteFailure);
+		}
+		stage = Stage::protectiveMbr;
+		break;
+
+	case Stage::protectiveMbr: {
+		memset(workBuffer.get(), 0, sectorSize);
+		auto& mbr = workBuffer.as<legacy_mbr_t>();
+		mbr = legacy_mbr_t{
+			.partition_record = {{
+				.boot_indicator = 0,
+				.start_head = 0,
+				.start_sector = 2,
+				.start_track = 0,
+				.os_type = EFI_PMBR_OSTYPE_EFI_GPT,
+				.end_head = 0xff,
+				.end_sector = 0xff,
+				.end_track = 0xff,
+				.starting_lba = 1,
+				.size_in_lba = uint32_t(std::min(uint64_t(0xffffffff), driveSectors - 1)),
+			}},
+			.signature = MSDOS_MBR_SIGNATURE,
+		};
+		if(!writeSectors(0, &mbr, 1) || !device.sync()) {
+			return setError(Error::WriteFailure);
+		}
+
+		parts.reset();
+		auto& pt = device.editablePartitions();
+		pt.clear();
+		while(!table.isEmpty()) {
+			pt.add(table.pop());
+		}
+		stage = Stage::done;
+		break;
 	}
 
-	auto& pt = device.editablePartitions();
-	pt.clear();
-	while(!table.isEmpty()) {
-		pt.add(table.pop());
+	case Stage::done:
+		break;
 	}
 
-	return Error::Success;
+	// Device preparation, entry sectors, headers and protective MBR
+	unsigned stepsDone = zeroIndex + entrySector;
+	if(options.discard) {
+		stepsDone += getBlockCount(discardSector, discardSectors);
+	}
+	if(stage > Stage::backupHeader) {
+		stepsDone += unsigned(stage) - unsigned(Stage::backupHeader);
+	}
+	setProgress(stepsDone, progressTotal);
+	return stage != Stage::done;
+}
+
+} // namespace GPT
+
+/* Create partitions in GPT format */
+Error formatDisk(BlockDevice& device, GPT::PartitionTable& table, const Uuid& diskGuid,
+				 const GPT::FormatOptions& options)
+{
+	GPT::Formatter formatter(device, table, diskGuid, options);
+	return formatter.run();
 }
 
 } // namespace Storage::Disk
@@ -0,0 +1,386 @@
+/****
+ * GPTEditor.cpp
+ *
+ * Copyright 2022 mikee47 <mike@sillyhouse.net>
+ *
+ * This file is part of the DiskStorage Library
+ *
+ * This library is free software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation, version 3 or later.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this library.
+ * If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****/
+#include <Storage/Disk/GPT.h>
+#include <Storage/Disk/diskdefs.h>
+#include <debug_progmem.h>
+
+namespace Storage::Disk::GPT
+{
+namespace
+{
+// Buffer size used when reading entry array
+constexpr uint32_t loadChunkSize{16384};
+
+} // namespace
+
+bool Editor::readSectors(uint64_t sector, void* dst, size_t count)
+{
+	return device.read(storage_size_t(sector) << sectorSizeShift, dst, count << sectorSizeShift);
+}
+
+bool Editor::writeSectors(uint64_t sector, const void* src, size_t count)
+{
+	return device.write(storage_size_t(sector) << sectorSizeShift, src, count << sectorSizeShift);
+}
+
+uint32_t Editor::getBlockLength(uint32_t block) const
+{
+	uint32_t blockSize = blockSectors << sectorSizeShift;
+	return std::min(blockSize, entryArraySize - block * blockSize);
+}
+
+Error Editor::load()
+{
+	const uint16_t sectorSize = device.getSectorSize();
+	if(!isValidSectorSize(sectorSize)) {
+		return Error::BadParam;
+	}
+	sectorSizeShift = getSizeBits(sectorSize);
+	const uint64_t headerLba[2]{GPT_PRIMARY_PARTITION_TABLE_LBA, device.getSectorCount() - 1};
+
+	entries.clear();
+	modified = false;
+
+	for(unsigned i = 0; i < 2; ++i) {
+		headers[i] = SectorBuffer(sectorSize, 1);
+		if(!headers[i]) {
+			return Error::NoMem;
+		}
+		if(!readSectors(headerLba[i], headers[i].get(), 1)) {
+			return Error::ReadFailure;
+		}
+		auto& header = headers[i].as<gpt_header_t>();
+		if(!verifyHeader(header) || header.header_size > sectorSize || header.my_lba != headerLba[i]) {
+			debug_e("[GPT] %s header invalid", i ? "Backup" : "Primary");
+			return Error::BadPartitionTable;
+		}
+	}
+
+	auto& primary = headers[0].as<gpt_header_t>();
+	auto& backup = headers[1].as<gpt_header_t>();
+	if(backup.num_partition_entries != primary.num_partition_entries ||
+	   backup.sizeof_partition_entry != primary.sizeof_partition_entry ||
+	   backup.partition_entry_array_crc32 != primary.partition_entry_array_crc32) {
+		debug_e("[GPT] Primary and backup tables differ");
+		return Error::BadPartitionTable;
+	}
+
+	numEntries = primary.num_partition_entries;
+	entrySize = primary.sizeof_partition_entry;
+	entryArraySize = numEntries * entrySize;
+	blockSectors = std::max(entrySize >> sectorSizeShift, 1U);
+	const uint32_t blockSize = blockSectors << sectorSizeShift;
+	entriesPerBlock = blockSize / entrySize;
+	numBlocks = getBlockCount(entryArraySize, blockSize);
+
+	workBuffer = SectorBuffer(sectorSize, blockSectors);
+	blockCrc.reset(new(std::nothrow) uint32_t[numBlocks]);
+	dirty.reset(new(std::nothrow) bool[numBlocks]{});
+	const uint32_t chunkBlocks = std::max(loadChunkSize / blockSize, 1U);
+	SectorBuffer buffer(sectorSize, chunkBlocks * blockSectors);
+	if(!workBuffer || !blockCrc || !dirty || !buffer) {
+		return Error::NoMem;
+	}
+
+	// Obtain checksum for each block and note entries in use
+	uint32_t arrayCrc{0};
+	for(uint32_t block = 0; block < numBlocks; block += chunkBlocks) {
+		auto count = std::min(chunkBlocks, numBlocks - block);
+		if(!readSectors(primary.partition_entry_lba + block * blockSectors, buffer.get(), count * blockSectors)) {
+			return Error::ReadFailure;
+		}
+		for(unsigned i = 0; i < count; ++i) {
+			auto blockData = &buffer[i * blockSize];
+			auto len = getBlockLength(block + i);
+			blockCrc[block + i] = crc32(blockData, len);
+			arrayCrc = crc32_combine(arrayCrc, blockCrc[block + i], len);
+
+			for(uint32_t offset = 0; offset < len; offset += entrySize) {
+				auto& entry = *reinterpret_cast<const gpt_entry_t*>(&blockData[offset]);
+				if(!entry.partition_type_guid) {
+					continue;
+				}
+				entries.push_back(Entry{
+					.firstLba = entry.starting_lba,
+					.lastLba = entry.ending_lba,
+					.uniqueGuid = entry.unique_partition_guid,
+					.index = (block + i) * entriesPerBlock + offset / entrySize,
+				});
+			}
+		}
+	}
+
+	if(arrayCrc != primary.partition_entry_array_crc32) {
+		debug_e("[GPT] Entry array crc 0x%08x, expected 0x%08x", arrayCrc, primary.partition_entry_array_crc32);
+		entries.clear();
+		return Error::BadPartitionTable;
+	}
+
+	return Error::Success;
+}
+
+Editor::Entry* Editor::find(const Uuid& uniqueGuid)
+{
+	for(auto& e : entries) {
+		if(e.uniqueGuid == uniqueGuid) {
+			return &e;
+		}
+	}
+	return nullptr;
+}
+
+bool Editor::isFree(uint64_t firstLba, uint64_t lastLba, const Entry* exclude) const
+{
+	auto& header = headers[0].as<gpt_header_t>();
+	if(firstLba < header.first_usable_lba || lastLba > header.last_usable_lba || lastLba < firstLba) {
+		return false;
+	}
+	for(auto& e : entries) {
+		if(&e != exclude && firstLba <= e.lastLba && lastLba >= e.firstLba) {
+			return false;
+		}
+	}
+	return true;
+}
+
+gpt_entry_t* Editor::readEntry(uint32_t index)
+{
+	uint32_t block = index / entriesPerBlock;
+	auto& header = headers[0].as<gpt_header_t>();
+	if(!readSectors(header.partition_entry_lba + block * blockSectors, workBuffer.get(), blockSectors)) {
+		return nullptr;
+	}
+	return reinterpret_cast<gpt_entry_t*>(&workBuffer[(index % entriesPerBlock) * entrySize]);
+}
+
+Error Editor::writeEntry(uint32_t index)
+{
+	uint32_t block = index / entriesPerBlock;
+	auto& header = headers[0].as<gpt_header_t>();
+	blockCrc[block] = crc32(workBuffer.get(), getBlockLength(block));
+	if(!writeSectors(header.partition_entry_lba + block * blockSectors, workBuffer.get(), blockSectors)) {
+		return Error::WriteFailure;
+	}
+	dirty[block] = true;
+	modified = true;
+	return Error::Success;
+}
+
+Error Editor::add(PartInfo& part, uint32_t alignment)
+{
+	if(!blockCrc) {
+		return Error::BadParam;
+	}
+
+	const uint32_t sectorMask = (1U << sectorSizeShift) - 1;
+	if(part.size == 0 || ((part.offset | part.size) & sectorMask) != 0) {
+		return Error::MisAligned;
+	}
+	const uint64_t sectorCount = part.size >> sectorSizeShift;
+
+	uint64_t firstLba = part.offset >> sectorSizeShift;
+	if(firstLba != 0) {
+		if(!isFree(firstLba, firstLba + sectorCount - 1, nullptr)) {
+			return Error::OutOfRange;
+		}
+	} else {
+		// Try start of usable area, then following each existing partition; lowest position wins
+		auto& header = headers[0].as<gpt_header_t>();
+		if(alignment == 0) {
+			alignment = getPartitionAlignment(device);
+		}
+		const uint32_t alignSectors = alignment >> sectorSizeShift;
+		if(alignSectors == 0 || (alignment & sectorMask) != 0) {
+			return Error::BadParam;
+		}
+		auto tryPosition = [&](uint64_t lba) {
+			lba = getBlockCount(lba, alignSectors) * alignSectors;
+			if((firstLba == 0 || lba < firstLba) && isFree(lba, lba + sectorCount - 1, nullptr)) {
+				firstLba = lba;
+			}
+		};
+		tryPosition(header.first_usable_lba);
+		for(auto& e : entries) {
+			tryPosition(e.lastLba + 1);
+		}
+		if(firstLba == 0) {
+			return Error::NoSpace;
+		}
+	}
+
+	// Find unused entry
+	uint32_t index{0};
+	for(; index < numEntries; ++index) {
+		bool used{false};
+		for(auto& e : entries) {
+			if(e.index == index) {
+				used = true;
+				break;
+			}
+		}
+		if(!used) {
+			break;
+		}
+	}
+	if(index == numEntries) {
+		return Error::NoSpace;
+	}
+
+	if(!part.typeGuid) {
+		part.typeGuid = PARTITION_BASIC_DATA_GUID;
+	}
+	if(!part.uniqueGuid) {
+		part.uniqueGuid.generate();
+	}
+
+	auto entryPtr = readEntry(index);
+	if(entryPtr == nullptr) {
+		return Error::ReadFailure;
+	}
+	memset(static_cast<void*>(entryPtr), 0, entrySize);
+	auto& entry = *entryPtr;
+	entry.partition_type_guid = part.typeGuid;
+	entry.unique_partition_guid = part.uniqueGuid;
+	entry.starting_lba = firstLba;
+	entry.ending_lba = firstLba + sectorCount - 1;
+	auto namePtr = part.name.c_str();
+	for(unsigned j = 0; j < ARRAY_SIZE(entry.partition_name) && *namePtr != '\0'; ++j, ++namePtr) {
+		entry.partition_name[j] = *namePtr;
+	}
+
+	auto err = writeEntry(index);
+	if(!!err) {
+		return err;
+	}
+
+	entries.push_back(Entry{
+		.firstLba = firstLba,
+		.lastLba = entry.ending_lba,
+		.uniqueGuid = part.uniqueGuid,
+		.index = index,
+	});
+	part.offset = storage_size_t(firstLba) << sectorSizeShift;
+	return Error::Success;
+}
+
+Error Editor::remove(const Uuid& uniqueGuid)
+{
+	auto e = find(uniqueGuid);
+	if(e == nullptr) {
+		return Error::BadParam;
+	}
+
+	auto entry = readEntry(e->index);
+	if(entry == nullptr) {
+		return Error::ReadFailure;
+	}
+	memset(static_cast<void*>(entry), 0, entrySize);
+	auto err = writeEntry(e->index);
+	if(!!err) {
+		return err;
+	}
+
+	entries.erase(entries.begin() + (e - entries.data()));
+	return Error::Success;
+}
+
+Error Editor::resize(const Uuid& uniqueGuid, storage_size_t size)
+{
+	auto e = find(uniqueGuid);
+	if(e == nullptr) {
+		return Error::BadParam;
+	}
+	const uint32_t sectorMask = (1U << sectorSizeShift) - 1;
+	if(size == 0 || (size & sectorMask) != 0) {
+		return Error::MisAligned;
+	}
+
+	uint64_t lastLba = e->firstLba + (size >> sectorSizeShift) - 1;
+	if(!isFree(e->firstLba, lastLba, e)) {
+		return Error::NoSpace;
+	}
+
+	auto entry = readEntry(e->index);
+	if(entry == nullptr) {
+		return Error::ReadFailure;
+	}
+	entry->ending_lba = lastLba;
+	auto err = writeEntry(e->index);
+	if(!!err) {
+		return err;
+	}
+
+	e->lastLba = lastLba;
+	return Error::Success;
+}
+
+bool Editor::writeHeader(unsigned copy)
+{
+	uint32_t arrayCrc{0};
+	for(uint32_t block = 0; block < numBlocks; ++block) {
+		arrayCrc = crc32_combine(arrayCrc, blockCrc[block], getBlockLength(block));
+	}
+
+	auto& header = headers[copy].as<gpt_header_t>();
+	header.partition_entry_array_crc32 = arrayCrc;
+	header.header_crc32 = 0;
+	header.header_crc32 = crc32(&header, header.header_size);
+
+	// Entry array must reach the medium before the header describing it
+	return device.sync() && writeSectors(header.my_lba, &header, 1) && device.sync();
+}
+
+Error Editor::commit()
+{
+	if(!modified) {
+		return Error::Success;
+	}
+
+	// Primary array is already written
+	if(!writeHeader(0)) {
+		return Error::WriteFailure;
+	}
+
+	// Copy modified blocks to backup array
+	auto& primary = headers[0].as<gpt_header_t>();
+	auto& backup = headers[1].as<gpt_header_t>();
+	for(uint32_t block = 0; block < numBlocks; ++block) {
+		if(!dirty[block]) {
+			continue;
+		}
+		auto offset = block * blockSectors;
+		if(!readSectors(primary.partition_entry_lba + offset, workBuffer.get(), blockSectors)) {
+			return Error::ReadFailure;
+		}
+		if(!writeSectors(backup.partition_entry_lba + offset, workBuffer.get(), blockSectors)) {
+			return Error::WriteFailure;
+		}
+		dirty[block] = false;
+	}
+
+	if(!writeHeader(1)) {
+		return Error::WriteFailure;
+	}
+
+	modified = false;
+	debug_d("[GPT] Changes committed");
+	return Error::Success;
+}
+
+} // namespace Storage::Disk::GPT
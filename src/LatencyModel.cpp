@@ -0,0 +1,42 @@
+/****
+ * LatencyModel.cpp
+ *
+ * Copyright 2022 mikee47 <mike@sillyhouse.net>
+ *
+ * This file is part of the DiskStorage Library
+ *
+ * This library is free software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation, version 3 or later.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this library.
+ * If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****/
+
+#include "include/Storage/Disk/LatencyModel.h"
+
+namespace Storage::Disk
+{
+uint32_t SimpleLatencyModel::getLatency(Operation op, uint64_t sector, size_t count)
+{
+	auto calc = [count](const Cost& cost) { return cost.setup + cost.perSector * count; };
+
+	switch(op) {
+	case Operation::read:
+		return calc(timings.read);
+	case Operation::write:
+		return calc(timings.write);
+	case Operation::erase:
+		return calc(timings.erase);
+	case Operation::sync:
+		return timings.sync;
+	}
+
+	return 0;
+}
+
+} // namespace Storage::Disk
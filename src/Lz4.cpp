@@ -0,0 +1,229 @@
+/****
+ * Lz4.cpp
+ *
+ * Copyright 2022 mikee47 <mike@sillyhouse.net>
+ *
+ * This file is part of the DiskStorage Library
+ *
+ * This library is free software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation, version 3 or later.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this library.
+ * If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****/
+
+#include "include/Storage/Disk/Lz4.h"
+#include <algorithm>
+#include <cstring>
+#include <memory>
+
+namespace Storage::Disk::LZ4
+{
+namespace
+{
+constexpr size_t minMatch{4};
+constexpr size_t lastLiterals{5}; ///< Final bytes of a block are always literals
+constexpr size_t mfLimit{12};	 ///< Last match must start at least this far from end of block
+constexpr size_t maxDistance{65535};
+constexpr unsigned hashBits{12};
+
+uint32_t read32(const uint8_t* p)
+{
+	uint32_t value;
+	memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+unsigned hash(uint32_t value)
+{
+	return (value * 2654435761U) >> (32 - hashBits);
+}
+
+class Writer
+{
+public:
+	Writer(void* dst, size_t capacity) : ptr(static_cast<uint8_t*>(dst)), end(ptr + capacity)
+	{
+	}
+
+	bool writeLength(size_t length)
+	{
+		while(length >= 255) {
+			if(!writeByte(255)) {
+				return false;
+			}
+			length -= 255;
+		}
+		return writeByte(length);
+	}
+
+	bool writeByte(uint8_t value)
+	{
+		if(ptr >= end) {
+			return false;
+		}
+		*ptr++ = value;
+		return true;
+	}
+
+	bool write(const uint8_t* src, size_t length)
+	{
+		if(length > size_t(end - ptr)) {
+			return false;
+		}
+		memcpy(ptr, src, length);
+		ptr += length;
+		return true;
+	}
+
+	/**
+	 * @brief Emit one sequence
+	 * @param matchLength 0 for final literal-only sequence
+	 */
+	bool sequence(const uint8_t* literals, size_t literalLength, uint16_t offset, size_t matchLength)
+	{
+		auto litNibble = std::min(literalLength, size_t(15));
+		size_t matchCode = matchLength ? matchLength - minMatch : 0;
+		auto matchNibble = std::min(matchCode, size_t(15));
+		if(!writeByte((litNibble << 4) | matchNibble)) {
+			return false;
+		}
+		if(litNibble == 15 && !writeLength(literalLength - 15)) {
+			return false;
+		}
+		if(!write(literals, literalLength)) {
+			return false;
+		}
+		if(matchLength == 0) {
+			return true;
+		}
+		if(!writeByte(offset & 0xff) || !writeByte(offset >> 8)) {
+			return false;
+		}
+		return matchNibble < 15 || writeLength(matchCode - 15);
+	}
+
+	uint8_t* ptr;
+	uint8_t* end;
+};
+
+} // namespace
+
+size_t compress(const void* src, size_t srcSize, void* dst, size_t dstCapacity)
+{
+	auto base = static_cast<const uint8_t*>(src);
+	auto ip = base;
+	auto anchor = base;
+	auto iend = base + srcSize;
+	Writer out(dst, dstCapacity);
+
+	if(srcSize > mfLimit) {
+		std::unique_ptr<uint32_t[]> table(new uint32_t[1U << hashBits]{});
+		auto mfEnd = iend - mfLimit;
+		auto matchLimit = iend - lastLiterals;
+		while(ip <= mfEnd) {
+			auto seq = read32(ip);
+			auto& entry = table[hash(seq)];
+			auto ref = base + entry;
+			entry = ip - base;
+			if(ref >= ip || size_t(ip - ref) > maxDistance || read32(ref) != seq) {
+				++ip;
+				continue;
+			}
+
+			size_t len = minMatch;
+			while(ip + len < matchLimit && ref[len] == ip[len]) {
+				++len;
+			}
+
+			if(!out.sequence(anchor, ip - anchor, ip - ref, len)) {
+				return 0;
+			}
+			ip += len;
+			anchor = ip;
+		}
+	}
+
+	if(!out.sequence(anchor, iend - anchor, 0, 0)) {
+		return 0;
+	}
+
+	return out.ptr - static_cast<uint8_t*>(dst);
+}
+
+int decompress(const void* src, size_t srcSize, void* dst, size_t dstCapacity)
+{
+	auto ip = static_cast<const uint8_t*>(src);
+	auto iend = ip + srcSize;
+	auto base = static_cast<uint8_t*>(dst);
+	auto op = base;
+	auto oend = base + dstCapacity;
+
+	auto readLength = [&](size_t& length) -> bool {
+		uint8_t c;
+		do {
+			if(ip >= iend) {
+				return false;
+			}
+			c = *ip++;
+			length += c;
+		} while(c == 255);
+		return true;
+	};
+
+	for(;;) {
+		if(ip >= iend) {
+			return -1;
+		}
+		auto token = *ip++;
+
+		size_t length = token >> 4;
+		if(length == 15 && !readLength(length)) {
+			return -1;
+		}
+		if(length > size_t(iend - ip) || length > size_t(oend - op)) {
+			return -1;
+		}
+		memcpy(op, ip, length);
+		ip += length;
+		op += length;
+
+		// Final sequence has no match
+		if(ip == iend) {
+			break;
+		}
+
+		if(iend - ip < 2) {
+			return -1;
+		}
+		size_t offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if(offset == 0 || offset > size_t(op - base)) {
+			return -1;
+		}
+
+		length = token & 0x0f;
+		if(length == 15 && !readLength(length)) {
+			return -1;
+		}
+		length += minMatch;
+		if(length > size_t(oend - op)) {
+			return -1;
+		}
+
+		// Regions may overlap so copy bytewise
+		auto match = op - offset;
+		while(length-- != 0) {
+			*op++ = *match++;
+		}
+	}
+
+	return op - base;
+}
+
+} // namespace Storage::Disk::LZ4
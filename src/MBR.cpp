@@ -25,37 +25,55 @@
 // Definitions from FileSystem
 namespace Storage::Disk
 {
-Error formatDisk(BlockDevice& device, MBR::PartitionTable& table)
+Error formatDisk(BlockDevice& device, MBR::PartitionTable& table, const FormatOptions& options)
 {
 	if(table.isEmpty() || table.count() > 4) {
 		return Error::BadParam;
 	}
 
-	uint16_t sectorSize;
-#if FF_MAX_SS != FF_MIN_SS
-	sectorSize = device.getSectorSize();
-	if(sectorSize > FF_MAX_SS || sectorSize < FF_MIN_SS || !isLog2(sectorSize)) {
+	const uint16_t sectorSize = device.getSectorSize();
+	if(!isValidSectorSize(sectorSize)) {
 		return Error::BadParam;
 	}
-#else
-	sectorSize = DISK_MAX_SECTOR_SIZE;
-#endif
 	uint8_t sectorSizeShift = getSizeBits(sectorSize);
 
+	const uint32_t alignment = options.alignment ?: getPartitionAlignment(device);
+	if(alignment % sectorSize != 0) {
+		return Error::BadParam;
+	}
+
 	const uint32_t numDeviceSectors = device.getSectorCount();
-	const uint32_t firstAllocatableSector = PARTITION_ALIGN >> sectorSizeShift;
+	const uint32_t firstAllocatableSector = alignment >> sectorSizeShift;
+	if(firstAllocatableSector >= numDeviceSectors) {
+		return Error::NoSpace;
+	}
 	const uint32_t allocatableSectors = numDeviceSectors - firstAllocatableSector;
-	auto err = validate(table, firstAllocatableSector, allocatableSectors, sectorSize);
+	auto err = validate(table, firstAllocatableSector, allocatableSectors, sectorSize, alignment);
 	if(!!err) {
 		return err;
 	}
 
-	/* Get working buffer */
-	SectorBuffer workBuffer(sectorSize, 1);
-	if(!workBuffer) {
+	/* Get working buffer, larger if partitions are to be cleared */
+	const uint64_t zeroSectors = getBlockCount(uint64_t(options.zeroSize), sectorSize);
+	const uint64_t maxSectors = std::min(uint64_t(FORMAT_MAX_TRANSFER_SIZE >> sectorSizeShift), zeroSectors);
+	SectorBuffer workBuffer;
+	if(!workBuffer.allocate(sectorSize, std::max(maxSectors, uint64_t(1)))) {
 		return Error::NoMem;
 	}
 
+	if(options.discard && !device.erase_range(0, device.getSize())) {
+		return Error::EraseFailure;
+	}
+
+	if(options.zeroSize != 0) {
+		for(auto& part : table) {
+			err = zeroPartitionStart(device, part, options.zeroSize, workBuffer);
+			if(!!err) {
+				return err;
+			}
+		}
+	}
+
 	// Determine drive CHS without any consideration of the drive geometry
 	uint8_t numHeads;
 	for(numHeads = 8; numHeads != 0 && numDeviceSectors / (numHeads * N_SEC_TRACK) > 1024; numHeads *= 2) {
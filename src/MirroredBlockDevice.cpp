@@ -0,0 +1,311 @@
+/****
+ * MirroredBlockDevice.cpp
+ *
+ * Copyright 2022 mikee47 <mike@sillyhouse.net>
+ *
+ * This file is part of the DiskStorage Library
+ *
+ * This library is free software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation, version 3 or later.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this library.
+ * If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****/
+
+#include "include/Storage/Disk/MirroredBlockDevice.h"
+#include "include/Storage/Disk/SectorBuffer.h"
+#include <debug_progmem.h>
+
+namespace Storage::Disk
+{
+namespace
+{
+// Maximum size of transfers used for resynchronisation
+constexpr size_t resyncBufferSize{16384};
+
+} // namespace
+
+void MirroredBlockDevice::Member::setDirty(uint32_t region, bool state)
+{
+	auto& b = dirty[region / 8];
+	uint8_t mask = 1 << (region % 8);
+	if(state == bool(b & mask)) {
+		return;
+	}
+	if(state) {
+		b |= mask;
+		++dirtyCount;
+	} else {
+		b &= ~mask;
+		--dirtyCount;
+	}
+}
+
+bool MirroredBlockDevice::addMember(BlockDevice& device, bool synced)
+{
+	auto devSectorSize = device.getSectorSize();
+	if(members.empty()) {
+		if(!isLog2(regionSize) || regionSize < devSectorSize) {
+			debug_e("[MIRROR] Invalid region size %u", regionSize);
+			return false;
+		}
+		if(!setSectorSize(devSectorSize)) {
+			return false;
+		}
+		regionSectors = regionSize >> sectorSizeShift;
+	} else if(devSectorSize != sectorSize) {
+		debug_e("[MIRROR] Sector size mismatch, %u != %u", devSectorSize, sectorSize);
+		return false;
+	}
+
+	for(auto& m : members) {
+		if(m.device == &device) {
+			return false;
+		}
+	}
+
+	// Members are identified by bit position in read exclusion masks
+	if(members.size() >= maxMembers) {
+		debug_e("[MIRROR] Too many members");
+		return false;
+	}
+
+	uint64_t devSectors = device.getSectorCount();
+	uint32_t regionCount = (devSectors + regionSectors - 1) / regionSectors;
+	size_t bitmapSize = (regionCount + 7) / 8;
+	std::unique_ptr<uint8_t[]> bitmap(new uint8_t[bitmapSize]{});
+	if(!bitmap) {
+		return false;
+	}
+
+	members.push_back(Member{&device, std::move(bitmap)});
+	sectorCount = members.size() == 1 ? devSectors : std::min(uint64_t(sectorCount), devSectors);
+
+	if(!synced) {
+		markAllDirty(members.back());
+	}
+
+	return true;
+}
+
+void MirroredBlockDevice::setOnline(unsigned index, bool online)
+{
+	if(index < members.size()) {
+		members[index].online = online;
+	}
+}
+
+bool MirroredBlockDevice::isClean(const Member& m, uint64_t sector, size_t count) const
+{
+	if(m.dirtyCount == 0) {
+		return true;
+	}
+	auto firstRegion = sector / regionSectors;
+	auto lastRegion = (sector + count - 1) / regionSectors;
+	for(auto region = firstRegion; region <= lastRegion; ++region) {
+		if(m.isDirty(region)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+void MirroredBlockDevice::markDirty(Member& m, uint64_t sector, size_t count)
+{
+	auto firstRegion = sector / regionSectors;
+	auto lastRegion = (sector + count - 1) / regionSectors;
+	for(auto region = firstRegion; region <= lastRegion; ++region) {
+		m.setDirty(region, true);
+	}
+}
+
+void MirroredBlockDevice::markAllDirty(Member& m)
+{
+	for(uint32_t region = 0; region < getRegionCount(); ++region) {
+		m.setDirty(region, true);
+	}
+}
+
+int MirroredBlockDevice::selectReader(uint64_t sector, size_t count, uint32_t excludeMask)
+{
+	int selected{-1};
+	uint64_t bestDistance{0};
+	const unsigned numMembers = members.size();
+	for(unsigned n = 0; n < numMembers; ++n) {
+		unsigned i = (readPolicy == ReadPolicy::roundRobin) ? (nextReader + n) % numMembers : n;
+		auto& m = members[i];
+		if(!m.online || (excludeMask & (1U << i)) || !isClean(m, sector, count)) {
+			continue;
+		}
+		if(readPolicy == ReadPolicy::roundRobin) {
+			nextReader = i + 1;
+			return i;
+		}
+		uint64_t distance = (sector > m.lastSector) ? sector - m.lastSector : m.lastSector - sector;
+		if(selected < 0 || distance < bestDistance) {
+			selected = i;
+			bestDistance = distance;
+		}
+	}
+	return selected;
+}
+
+bool MirroredBlockDevice::raw_sector_read(storage_size_t address, void* dst, size_t size)
+{
+	uint32_t tried{0};
+	int i;
+	while((i = selectReader(address, size, tried)) >= 0) {
+		auto& m = members[i];
+		if(m.device->read(storage_size_t(address) << sectorSizeShift, dst, size << sectorSizeShift)) {
+			m.lastSector = address + size;
+			return true;
+		}
+		// Failed read suggests bad media, so have this area rewritten on next resync
+		debug_w("[MIRROR] Read failed on member #%u", i);
+		markDirty(m, address, size);
+		tried |= 1U << i;
+	}
+
+	debug_e("[MIRROR] No usable member for read @ %llu", uint64_t(address));
+	return false;
+}
+
+bool MirroredBlockDevice::writeAll(uint64_t sector, const void* src, size_t count)
+{
+	unsigned good{0};
+	for(unsigned i = 0; i < members.size(); ++i) {
+		auto& m = members[i];
+		if(!m.online) {
+			markDirty(m, sector, count);
+			continue;
+		}
+		storage_size_t addr = storage_size_t(sector) << sectorSizeShift;
+		size_t len = count << sectorSizeShift;
+		bool ok = src ? m.device->write(addr, src, len) : m.device->erase_range(addr, len);
+		if(!ok) {
+			debug_w("[MIRROR] %s failed on member #%u", src ? "Write" : "Erase", i);
+			markDirty(m, sector, count);
+			continue;
+		}
+		m.lastSector = sector + count;
+		// A dirty region only becomes clean via resync, as other sectors within it may still be stale
+		if(isClean(m, sector, count)) {
+			++good;
+		}
+	}
+
+	return good != 0;
+}
+
+bool MirroredBlockDevice::raw_sector_write(storage_size_t address, const void* src, size_t size)
+{
+	return writeAll(address, src, size);
+}
+
+bool MirroredBlockDevice::raw_sector_erase_range(storage_size_t address, size_t size)
+{
+	return writeAll(address, nullptr, size);
+}
+
+bool MirroredBlockDevice::raw_sync()
+{
+	bool res{true};
+	unsigned synced{0};
+	for(unsigned i = 0; i < members.size(); ++i) {
+		auto& m = members[i];
+		if(!m.online) {
+			continue;
+		}
+		if(m.device->sync()) {
+			++synced;
+			continue;
+		}
+		debug_w("[MIRROR] Sync failed on member #%u", i);
+		markAllDirty(m);
+		res = false;
+	}
+	return res && synced != 0;
+}
+
+bool MirroredBlockDevice::raw_sector_is_allocated(storage_size_t address, storage_size_t size)
+{
+	int i = selectReader(address, size, 0);
+	if(i < 0) {
+		return true;
+	}
+	return members[i].device->isAllocated(address << sectorSizeShift, size << sectorSizeShift);
+}
+
+bool MirroredBlockDevice::resync(unsigned maxRegions)
+{
+	const uint32_t regionCount = getRegionCount();
+	SectorBuffer buffer;
+	unsigned copied{0};
+
+	for(unsigned i = 0; i < members.size(); ++i) {
+		auto& m = members[i];
+		if(!m.online) {
+			continue;
+		}
+		const uint32_t memberRegions = (m.device->getSectorCount() + regionSectors - 1) / regionSectors;
+		for(uint32_t region = 0; region < memberRegions && m.dirtyCount != 0; ++region) {
+			if(region >= regionCount) {
+				// Area beyond capacity of smallest member is unused
+				if(m.isDirty(region)) {
+					m.setDirty(region, false);
+				}
+				continue;
+			}
+			if(!m.isDirty(region)) {
+				continue;
+			}
+			if(maxRegions != 0 && copied >= maxRegions) {
+				return false;
+			}
+
+			uint64_t sector = uint64_t(region) * regionSectors;
+			size_t count = std::min(uint64_t(regionSectors), uint64_t(sectorCount) - sector);
+			int src = selectReader(sector, count, 1U << i);
+			if(src < 0) {
+				debug_e("[MIRROR] No clean source for region %u", region);
+				return false;
+			}
+
+			if(!buffer) {
+				auto bufferSectors = std::min(regionSectors, uint32_t(resyncBufferSize >> sectorSizeShift));
+				buffer = SectorBuffer(sectorSize, bufferSectors);
+				if(!buffer) {
+					return false;
+				}
+			}
+
+			auto& srcDev = *members[src].device;
+			while(count != 0) {
+				size_t n = std::min(count, size_t(buffer.sectors()));
+				storage_size_t addr = storage_size_t(sector) << sectorSizeShift;
+				size_t len = n << sectorSizeShift;
+				bool ok = srcDev.isAllocated(addr, len) ? srcDev.read(addr, buffer.get(), len) &&
+															  m.device->write(addr, buffer.get(), len)
+														: m.device->erase_range(addr, len);
+				if(!ok) {
+					debug_e("[MIRROR] Resync of region %u failed", region);
+					return false;
+				}
+				sector += n;
+				count -= n;
+			}
+
+			m.setDirty(region, false);
+			++copied;
+		}
+	}
+
+	return true;
+}
+
+} // namespace Storage::Disk
@@ -0,0 +1,372 @@
+/****
+ * OverlayDevice.cpp
+ *
+ * Copyright 2022 mikee47 <mike@sillyhouse.net>
+ *
+ * This file is part of the DiskStorage Library
+ *
+ * This library is free software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation, version 3 or later.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this library.
+ * If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****/
+
+#include "include/Storage/Disk/OverlayDevice.h"
+#include "include/Storage/Disk/SectorBuffer.h"
+#include "include/Storage/Disk/diskdefs.h"
+#include <debug_progmem.h>
+
+namespace Storage::Disk
+{
+namespace
+{
+// Size of buffer used for copying
+constexpr size_t copyBufferSize{32768};
+
+constexpr uint32_t mapMagic{0x4d4c564f}; // "OVLM"
+constexpr uint16_t mapVersion{1};
+
+/*
+ * Stored at start of map device, followed by `count` records
+ */
+struct MapHeader {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t sectorSize;
+	uint64_t sectorCount; ///< Size of overlay
+	uint64_t count;		  ///< Number of records
+	uint32_t crc;		  ///< CRC of records
+	uint32_t reserved;
+};
+
+static_assert(sizeof(MapHeader) == 32, "Bad MapHeader size");
+
+struct MapRecord {
+	uint64_t start;
+	uint64_t count;
+};
+
+/*
+ * Records never straddle map device sectors
+ */
+static_assert(sizeof(MapHeader) % sizeof(MapRecord) == 0, "Bad MapRecord size");
+
+uint64_t getMapLength(uint64_t count)
+{
+	return sizeof(MapHeader) + count * sizeof(MapRecord);
+}
+
+} // namespace
+
+OverlayDevice::OverlayDevice(const String& name, BlockDevice& base, BlockDevice& delta, BlockDevice* mapDevice)
+	: name(name), base(base), delta(delta), mapDevice(mapDevice)
+{
+	if(delta.getSectorSize() != base.getSectorSize() || delta.getSectorCount() < base.getSectorCount()) {
+		debug_e("[OVL] Delta device incompatible with base");
+		return;
+	}
+	if(!setSectorSize(base.getSectorSize())) {
+		return;
+	}
+	sectorCount = base.getSectorCount();
+	physicalSectorSize = base.getPhysicalSectorSize();
+	optimalIoSize = base.getOptimalIoSize();
+}
+
+bool OverlayDevice::loadMap()
+{
+	map.clear();
+	mapModified = false;
+	if(mapDevice == nullptr || sectorCount == 0) {
+		return false;
+	}
+
+	const uint16_t mapSectorSize = mapDevice->getSectorSize();
+	SectorBuffer buffer;
+	if(!buffer.allocate(mapSectorSize, std::max(copyBufferSize / mapSectorSize, size_t(1)))) {
+		return false;
+	}
+	if(!mapDevice->read(0, buffer.get(), mapSectorSize)) {
+		return false;
+	}
+	MapHeader header;
+	memcpy(&header, buffer.get(), sizeof(header));
+	if(header.magic != mapMagic || header.version != mapVersion || header.sectorSize != sectorSize ||
+	   header.sectorCount != sectorCount || getMapLength(header.count) > mapDevice->getSize()) {
+		debug_w("[OVL] No map found");
+		return false;
+	}
+
+	// Build a new map so a bad record doesn't leave a partial one behind
+	ExtentMap newMap;
+	uint32_t crc{0};
+	storage_size_t addr{0};
+	size_t pos{sizeof(header)};
+	size_t len{mapSectorSize};
+	for(auto remaining = header.count; remaining != 0; --remaining) {
+		if(pos == len) {
+			addr += len;
+			len = std::min(uint64_t(buffer.size()), align_up(remaining * sizeof(MapRecord), mapSectorSize));
+			if(!mapDevice->read(addr, buffer.get(), len)) {
+				return false;
+			}
+			pos = 0;
+		}
+		MapRecord rec;
+		memcpy(&rec, buffer.get() + pos, sizeof(rec));
+		pos += sizeof(rec);
+		crc = crc32(crc, &rec, sizeof(rec));
+		if(rec.count == 0 || rec.start >= sectorCount || rec.count > sectorCount - rec.start) {
+			debug_e("[OVL] Bad map record");
+			return false;
+		}
+		newMap.add(rec.start, rec.count);
+	}
+	if(crc != header.crc) {
+		debug_e("[OVL] Map CRC mismatch");
+		return false;
+	}
+
+	map = std::move(newMap);
+	debug_i("[OVL] %llu sectors in delta", map.totalSectors());
+	return true;
+}
+
+bool OverlayDevice::saveMap()
+{
+	MapHeader header{
+		.magic = mapMagic,
+		.version = mapVersion,
+		.sectorSize = sectorSize,
+		.sectorCount = sectorCount,
+		.count = map.count(),
+		.crc = 0,
+		.reserved = 0,
+	};
+	for(auto ext = map.find(0); ext; ext = map.find(ext.end())) {
+		MapRecord rec{ext.start, ext.count};
+		header.crc = crc32(header.crc, &rec, sizeof(rec));
+	}
+	if(getMapLength(header.count) > mapDevice->getSize()) {
+		debug_e("[OVL] Map device too small");
+		return false;
+	}
+
+	const uint16_t mapSectorSize = mapDevice->getSectorSize();
+	SectorBuffer buffer;
+	if(!buffer.allocate(mapSectorSize, std::max(copyBufferSize / mapSectorSize, size_t(1)))) {
+		return false;
+	}
+	memcpy(buffer.get(), &header, sizeof(header));
+	size_t pos{sizeof(header)};
+	storage_size_t addr{0};
+	auto ext = map.find(0);
+	for(;;) {
+		if(ext) {
+			MapRecord rec{ext.start, ext.count};
+			memcpy(buffer.get() + pos, &rec, sizeof(rec));
+			pos += sizeof(rec);
+			ext = map.find(ext.end());
+			if(ext && pos < buffer.size()) {
+				continue;
+			}
+		}
+		size_t len = align_up(pos, mapSectorSize);
+		memset(buffer.get() + pos, 0, len - pos);
+		if(!mapDevice->write(addr, buffer.get(), len)) {
+			return false;
+		}
+		if(!ext) {
+			return true;
+		}
+		addr += len;
+		pos = 0;
+	}
+}
+
+bool OverlayDevice::raw_sector_read(storage_size_t address, void* dst, size_t size)
+{
+	auto dstptr = static_cast<uint8_t*>(dst);
+	uint64_t sector = address;
+	const uint64_t endSector = sector + size;
+	while(sector < endSector) {
+		auto ext = map.find(sector);
+		uint64_t deltaStart = ext ? std::max(ext.start, sector) : endSector;
+		deltaStart = std::min(deltaStart, endSector);
+
+		auto& dev = (deltaStart > sector) ? base : delta;
+		uint64_t end = (deltaStart > sector) ? deltaStart : std::min(ext.end(), endSector);
+		size_t len = (end - sector) << sectorSizeShift;
+		if(!dev.read(storage_size_t(sector) << sectorSizeShift, dstptr, len)) {
+			return false;
+		}
+		dstptr += len;
+		sector = end;
+	}
+
+	return true;
+}
+
+bool OverlayDevice::raw_sector_write(storage_size_t address, const void* src, size_t size)
+{
+	if(!delta.write(storage_size_t(address) << sectorSizeShift, src, size << sectorSizeShift)) {
+		return false;
+	}
+	map.add(address, size);
+	mapModified = true;
+	return true;
+}
+
+bool OverlayDevice::raw_sector_erase_range(storage_size_t address, size_t size)
+{
+	// Erased sectors in the delta mask base content
+	if(!delta.erase_range(storage_size_t(address) << sectorSizeShift, storage_size_t(size) << sectorSizeShift)) {
+		return false;
+	}
+	map.add(address, size);
+	mapModified = true;
+	return true;
+}
+
+bool OverlayDevice::raw_sync()
+{
+	if(!delta.sync()) {
+		return false;
+	}
+	if(mapDevice == nullptr || !mapModified) {
+		return true;
+	}
+
+	// Map only refers to delta content which has reached the medium
+	if(!saveMap() || !mapDevice->sync()) {
+		debug_e("[OVL] Map save failed");
+		return false;
+	}
+	mapModified = false;
+	return true;
+}
+
+bool OverlayDevice::raw_sector_is_allocated(storage_size_t address, storage_size_t size)
+{
+	uint64_t sector = address;
+	const uint64_t endSector = sector + size;
+	while(sector < endSector) {
+		auto ext = map.find(sector);
+		uint64_t deltaStart = ext ? std::max(ext.start, sector) : endSector;
+		deltaStart = std::min(deltaStart, endSector);
+
+		bool allocated;
+		uint64_t end;
+		if(deltaStart > sector) {
+			end = deltaStart;
+			allocated = base.isAllocated(storage_size_t(sector) << sectorSizeShift,
+										 storage_size_t(end - sector) << sectorSizeShift);
+		} else {
+			end = std::min(ext.end(), endSector);
+			allocated = delta.isAllocated(storage_size_t(sector) << sectorSizeShift,
+										  storage_size_t(end - sector) << sectorSizeShift);
+		}
+		if(allocated) {
+			return true;
+		}
+		sector = end;
+	}
+
+	return false;
+}
+
+bool OverlayDevice::copy(BlockDevice& src, BlockDevice& dst, uint64_t sector, uint64_t count)
+{
+	SectorBuffer buffer(sectorSize, copyBufferSize >> sectorSizeShift);
+	if(!buffer) {
+		return false;
+	}
+
+	while(count != 0) {
+		auto n = std::min(count, uint64_t(buffer.sectors()));
+		storage_size_t addr = storage_size_t(sector) << sectorSizeShift;
+		size_t len = n << sectorSizeShift;
+		bool ok;
+		if(src.isAllocated(addr, len)) {
+			ok = src.read(addr, buffer.get(), len) && dst.write(addr, buffer.get(), len);
+		} else {
+			ok = !dst.isAllocated(addr, len) || dst.erase_range(addr, len);
+		}
+		if(!ok) {
+			return false;
+		}
+		sector += n;
+		count -= n;
+	}
+
+	return true;
+}
+
+bool OverlayDevice::commit()
+{
+	if(!flushBuffers()) {
+		return false;
+	}
+
+	for(auto ext = map.find(0); ext; ext = map.find(ext.end())) {
+		if(!copy(delta, base, ext.start, ext.count)) {
+			debug_e("[OVL] Commit failed");
+			return false;
+		}
+	}
+	if(!base.sync()) {
+		return false;
+	}
+
+	// Base is now up to date so delta content no longer required, but stored map must not refer to it
+	ExtentMap committed = std::move(map);
+	map.clear();
+	mapModified = true;
+	if(!raw_sync()) {
+		map = std::move(committed);
+		return false;
+	}
+	for(auto ext = committed.find(0); ext; ext = committed.find(ext.end())) {
+		delta.erase_range(storage_size_t(ext.start) << sectorSizeShift, storage_size_t(ext.count) << sectorSizeShift);
+	}
+	return delta.sync();
+}
+
+bool OverlayDevice::flatten(BlockDevice& target)
+{
+	if(target.getSectorSize() != sectorSize || target.getSectorCount() < sectorCount) {
+		return false;
+	}
+	if(!flushBuffers()) {
+		return false;
+	}
+
+	/*
+	 * Copy base content where not overridden, then delta extents.
+	 * Copying from the base device directly preserves its allocation information.
+	 */
+	uint64_t sector{0};
+	for(auto ext = map.find(0);; ext = map.find(ext.end())) {
+		uint64_t end = ext ? ext.start : uint64_t(sectorCount);
+		if(end > sector && !copy(base, target, sector, end - sector)) {
+			return false;
+		}
+		if(!ext) {
+			break;
+		}
+		if(!copy(delta, target, ext.start, ext.count)) {
+			return false;
+		}
+		sector = ext.end();
+	}
+
+	return target.sync();
+}
+
+} // namespace Storage::Disk
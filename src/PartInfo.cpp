@@ -19,7 +19,10 @@
 
 #include "include/Storage/Disk/PartInfo.h"
 #include "include/Storage/Disk/GPT.h"
+#include "include/Storage/Disk/BlockDevice.h"
+#include "include/Storage/Disk/SectorBuffer.h"
 #include <debug_progmem.h>
+#include <numeric>
 
 String toString(Storage::Disk::SysType type)
 {
@@ -35,6 +38,18 @@ String toString(Storage::Disk::SysType type)
 		return F("fat32");
 	case Type::exfat:
 		return F("exfat");
+	case Type::ntfs:
+		return F("ntfs");
+	case Type::ext2:
+		return F("ext2");
+	case Type::ext3:
+		return F("ext3");
+	case Type::ext4:
+		return F("ext4");
+	case Type::f2fs:
+		return F("f2fs");
+	case Type::littlefs:
+		return F("littlefs");
 	}
 
 	return nullptr;
@@ -42,6 +57,12 @@ String toString(Storage::Disk::SysType type)
 
 namespace
 {
+/*
+ * Upper limit for alignment derived from device. SDXC cards may have allocation units of up to 64 MiB.
+ * Some USB bridges report nonsense values so these are ignored.
+ */
+constexpr uint32_t maxDeviceAlignment{64 * 0x100000U};
+
 template <typename T, typename... Args> size_t tprintln(Print& p, String tag, const T& value, Args... args)
 {
 	size_t n{0};
@@ -96,9 +117,9 @@ size_t PartInfo::printTo(Print& p) const
 }
 
 Error validate(BasePartitionTable& table, storage_size_t firstAvailableBlock, storage_size_t totalAvailableBlocks,
-			   uint32_t blockSize)
+			   uint32_t blockSize, uint32_t alignment)
 {
-	if(firstAvailableBlock == 0 || blockSize == 0) {
+	if(firstAvailableBlock == 0 || blockSize == 0 || alignment == 0 || alignment % blockSize != 0) {
 		return Error::BadParam;
 	}
 
@@ -106,7 +127,7 @@ Error validate(BasePartitionTable& table, storage_size_t firstAvailableBlock, st
 	auto align = [&](storage_size_t value, uint32_t alignment) { return value - value % alignment; };
 	auto align_up = [&](storage_size_t value, uint32_t alignment) { return align(value + alignment - 1, alignment); };
 
-	const auto blockAlign = PARTITION_ALIGN / blockSize;
+	const auto blockAlign = alignment / blockSize;
 
 	const uint64_t minOffset = firstAvailableBlock * blockSize;
 	const uint64_t maxOffset = uint64_t(firstAvailableBlock + totalAvailableBlocks) * blockSize - 1;
@@ -126,11 +147,11 @@ Error validate(BasePartitionTable& table, storage_size_t firstAvailableBlock, st
 			part.size = blocks * blockSize;
 			totalBlocks += blocks;
 		} else {
-			if(!is_aligned(part.offset, PARTITION_ALIGN)) {
+			if(!is_aligned(part.offset, alignment)) {
 				debug_e("[DISK] Partition '%s' mis-aligned", part.name.c_str());
 				return Error::MisAligned;
 			}
-			totalBlocks += align_up(part.size, PARTITION_ALIGN);
+			totalBlocks += align_up(part.size, alignment) / blockSize;
 		}
 		if(part.offset != 0 && (part.offset < minOffset || part.offset > maxOffset)) {
 			debug_e("[DISK] Partition '%s' offset outside valid range (%llu <= %llu <= %llu", part.name.c_str(),
@@ -163,7 +184,7 @@ Error validate(BasePartitionTable& table, storage_size_t firstAvailableBlock, st
 			if(pr->offset == 0) {
 				continue;
 			}
-			endOffset = align_up(pr->offset + pr->size, PARTITION_ALIGN);
+			endOffset = align_up(pr->offset + pr->size, alignment);
 
 			if(j + 1 < list.count()) {
 				auto avail = list[j + 1]->offset - endOffset;
@@ -193,4 +214,55 @@ Error validate(BasePartitionTable& table, storage_size_t firstAvailableBlock, st
 	return Error::Success;
 }
 
+uint32_t getPartitionAlignment(const BlockDevice& device)
+{
+	const uint32_t ioSize = device.getOptimalIoSize();
+	if(ioSize == 0 || ioSize % device.getSectorSize() != 0) {
+		return PARTITION_ALIGN;
+	}
+
+	const uint64_t alignment = std::lcm(uint64_t(PARTITION_ALIGN), uint64_t(ioSize));
+	if(alignment > maxDeviceAlignment) {
+		debug_w("[DISK] Ignoring optimal I/O size %u for '%s'", ioSize, device.getName().c_str());
+		return PARTITION_ALIGN;
+	}
+
+	return alignment;
+}
+
+Error zeroPartitionStart(BlockDevice& device, const Partition::Info& part, uint32_t size, SectorBuffer& buffer)
+{
+	uint64_t offset{0};
+	while(offset < size) {
+		auto err = zeroPartitionStart(device, part, size, buffer, offset);
+		if(!!err) {
+			return err;
+		}
+	}
+	return Error::Success;
+}
+
+Error zeroPartitionStart(BlockDevice& device, const Partition::Info& part, uint32_t size, SectorBuffer& buffer,
+						 uint64_t& offset)
+{
+	const uint32_t sectorMask = device.getSectorSize() - 1;
+	const uint64_t zeroSize = (uint64_t(size) + sectorMask) & ~uint64_t(sectorMask);
+	const uint64_t length = std::min(zeroSize, uint64_t(part.size));
+	if(offset < length && device.isAllocated(part.offset + offset, length - offset)) {
+		// Buffer may have been used for something else since the last call
+		auto chunkSize = std::min(uint64_t(buffer.size()), length - offset);
+		memset(buffer.get(), 0, chunkSize);
+		if(!device.write(part.offset + offset, buffer.get(), chunkSize)) {
+			return Error::WriteFailure;
+		}
+		offset += chunkSize;
+		if(offset < length) {
+			return Error::Success;
+		}
+	}
+
+	offset = zeroSize;
+	return Error::Success;
+}
+
 } // namespace Storage::Disk
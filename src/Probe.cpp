@@ -0,0 +1,407 @@
+/****
+ * Probe.cpp
+ *
+ * Copyright 2022 mikee47 <mike@sillyhouse.net>
+ *
+ * This file is part of the DiskStorage Library
+ *
+ * This library is free software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation, version 3 or later.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this library.
+ * If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****/
+
+#include "include/Storage/Disk/Probe.h"
+#include "include/Storage/Disk/GPT.h"
+#include "include/Storage/Disk/diskdefs.h"
+#include <debug_progmem.h>
+
+namespace Storage::Disk
+{
+namespace
+{
+#define MAX_FAT12 0xFF5 // Max FAT12 clusters (differs from specs, but right for real DOS/Windows behavior)
+
+#define FSTYPE_NTFS 0x202020205346544EULL // "NTFS    " 4E 54 46 53 20 20 20 20
+
+#define EXT_SUPERBLOCK_OFFSET 1024
+#define EXT_SUPER_MAGIC 0xEF53
+#define EXT_FEATURE_COMPAT_HAS_JOURNAL 0x0004
+#define EXT_FEATURE_INCOMPAT_JOURNAL_DEV 0x0008
+#define EXT4_FEATURE_INCOMPAT_MASK 0x02c0	// EXTENTS | 64BIT | FLEX_BG
+#define EXT4_FEATURE_INCOMPAT_64BIT 0x0080
+#define EXT4_FEATURE_RO_COMPAT_MASK 0x0478 // HUGE_FILE | GDT_CSUM | DIR_NLINK | EXTRA_ISIZE | METADATA_CSUM
+
+#define F2FS_SUPERBLOCK_OFFSET 1024
+#define F2FS_SUPER_MAGIC 0xF2F52010
+
+#define LFS_MAGIC_OFFSET 8
+
+/*
+ * Leading part of NTFS boot sector
+ */
+struct __attribute__((packed)) ntfs_boot_sector_t {
+	uint8_t jmp_boot[3];
+	uint64_t oem_id;
+	uint16_t sector_size;
+	uint8_t sec_per_clus;
+	uint8_t unused[26];
+	uint64_t total_sectors;
+};
+
+/*
+ * Leading part of ext2/3/4 superblock
+ */
+struct ext_super_block_t {
+	uint32_t s_inodes_count;
+	uint32_t s_blocks_count;
+	uint32_t s_r_blocks_count;
+	uint32_t s_free_blocks_count;
+	uint32_t s_free_inodes_count;
+	uint32_t s_first_data_block;
+	uint32_t s_log_block_size;
+	uint32_t s_log_cluster_size;
+	uint32_t s_blocks_per_group;
+	uint32_t s_clusters_per_group;
+	uint32_t s_inodes_per_group;
+	uint32_t s_mtime;
+	uint32_t s_wtime;
+	uint16_t s_mnt_count;
+	uint16_t s_max_mnt_count;
+	uint16_t s_magic;
+	uint16_t s_state;
+	uint16_t s_errors;
+	uint16_t s_minor_rev_level;
+	uint32_t s_lastcheck;
+	uint32_t s_checkinterval;
+	uint32_t s_creator_os;
+	uint32_t s_rev_level;
+	uint16_t s_def_resuid;
+	uint16_t s_def_resgid;
+	uint32_t s_first_ino;
+	uint16_t s_inode_size;
+	uint16_t s_block_group_nr;
+	uint32_t s_feature_compat;
+	uint32_t s_feature_incompat;
+	uint32_t s_feature_ro_compat;
+	uint8_t s_uuid[16];
+	char s_volume_name[16];
+};
+
+static_assert(offsetof(ext_super_block_t, s_volume_name) == 120, "Bad ext superblock");
+
+#define EXT_BLOCKS_COUNT_HI_OFFSET 0x150
+
+/*
+ * Leading part of F2FS superblock
+ */
+struct f2fs_super_block_t {
+	uint32_t magic;
+	uint16_t major_ver;
+	uint16_t minor_ver;
+	uint32_t log_sectorsize;
+	uint32_t log_sectors_per_block;
+	uint32_t log_blocksize;
+	uint32_t log_blocks_per_seg;
+	uint32_t segs_per_sec;
+	uint32_t secs_per_zone;
+	uint32_t checksum_offset;
+	uint32_t block_count[2]; // Unaligned 64-bit value
+	uint32_t section_count;
+	uint32_t segment_count;
+	uint32_t segment_count_ckpt;
+	uint32_t segment_count_sit;
+	uint32_t segment_count_nat;
+	uint32_t segment_count_ssa;
+	uint32_t segment_count_main;
+	uint32_t segment0_blkaddr;
+	uint32_t cp_blkaddr;
+	uint32_t sit_blkaddr;
+	uint32_t nat_blkaddr;
+	uint32_t ssa_blkaddr;
+	uint32_t main_blkaddr;
+	uint32_t root_ino;
+	uint32_t node_ino;
+	uint32_t meta_ino;
+	uint8_t uuid[16];
+	uint16_t volume_name[64]; // Actually 512 characters
+};
+
+static_assert(offsetof(f2fs_super_block_t, volume_name) == 124, "Bad F2FS superblock");
+
+/*
+ * LittleFS superblock entry, following magic
+ */
+struct lfs_superblock_t {
+	uint32_t tag;
+	uint32_t version;
+	uint32_t block_size;
+	uint32_t block_count;
+};
+
+String getLabel(const char* s, unsigned length)
+{
+	unsigned n{0};
+	while(n < length && s[n] != '\0') {
+		++n;
+	}
+	while(n > 0 && s[n - 1] == 0x20) {
+		--n;
+	}
+	return String(s, n);
+}
+
+void setFat(PartInfo& part, SysType systype)
+{
+	part.type = Partition::Type::data;
+	part.subtype = uint8_t(Partition::SubType::Data::fat);
+	part.systype = systype;
+}
+
+bool probeExfat(const ProbeWindow& window, PartInfo& part)
+{
+	auto exfat = window.at<EXFAT::boot_sector_t>(0);
+	if(exfat == nullptr || exfat->signature != MSDOS_MBR_SIGNATURE || exfat->fs_type != FSTYPE_EXFAT) {
+		return false;
+	}
+	setFat(part, SysType::exfat);
+	part.size = exfat->vol_length << exfat->sect_size_bits;
+	return true;
+}
+
+bool probeFat(const ProbeWindow& window, PartInfo& part)
+{
+	auto fat = window.at<FAT::fat_boot_sector_t>(0);
+	if(fat == nullptr) {
+		return false;
+	}
+
+	// Valid JumpBoot code? (short jump, near jump or near call)
+	auto b = fat->jmp_boot[0];
+	if(b != 0xEB && b != 0xE9 && b != 0xE8) {
+		return false;
+	}
+
+	if(fat->signature == MSDOS_MBR_SIGNATURE && fat->fat32.fs_type == FSTYPE_FAT32) {
+		setFat(part, SysType::fat32);
+		part.name = getLabel(fat->fat32.vol_label, MSDOS_NAME);
+		part.size = storage_size_t(fat->sectors ?: fat->total_sect) * fat->sector_size;
+		return true;
+	}
+
+	// FAT volumes formatted with early MS-DOS lack signature/fs_type
+	auto w = fat->sector_size;
+	b = fat->sec_per_clus;
+	if((w & (w - 1)) == 0 && w >= 512 && w <= 4096			  // Properness of sector size (512-4096 and 2^n)
+	   && b != 0 && (b & (b - 1)) == 0						  // Properness of cluster size (2^n)
+	   && fat->reserved != 0								  // Properness of reserved sectors (MNBZ)
+	   && fat->num_fats - 1 <= 1							  // Properness of FATs (1 or 2)
+	   && fat->dir_entries != 0								  // Properness of root dir entries (MNBZ)
+	   && (fat->sectors >= 128 || fat->total_sect >= 0x10000) // Properness of volume sectors (>=128)
+	   && fat->fat_length != 0) {							  // Properness of FAT size (MNBZ)
+		part.size = storage_size_t(fat->sectors ?: fat->total_sect) * fat->sector_size;
+		auto numClusters = part.size / (fat->sector_size * fat->sec_per_clus);
+		setFat(part, (numClusters <= MAX_FAT12) ? SysType::fat12 : SysType::fat16);
+		part.name = getLabel(fat->fat16.vol_label, MSDOS_NAME);
+		return true;
+	}
+
+	return false;
+}
+
+bool probeNtfs(const ProbeWindow& window, PartInfo& part)
+{
+	auto ntfs = window.at<ntfs_boot_sector_t>(0);
+	auto signature = window.at<uint16_t>(510);
+	if(ntfs == nullptr || signature == nullptr || *signature != MSDOS_MBR_SIGNATURE || ntfs->oem_id != FSTYPE_NTFS) {
+		return false;
+	}
+	auto w = ntfs->sector_size;
+	if((w & (w - 1)) != 0 || w < 256 || w > 4096 || ntfs->sec_per_clus == 0) {
+		return false;
+	}
+	part.systype = SysType::ntfs;
+	part.size = ntfs->total_sectors * w;
+	return true;
+}
+
+bool probeExt(const ProbeWindow& window, PartInfo& part)
+{
+	auto sb = window.at<ext_super_block_t>(EXT_SUPERBLOCK_OFFSET);
+	if(sb == nullptr || sb->s_magic != EXT_SUPER_MAGIC || sb->s_log_block_size > 6 || sb->s_blocks_count == 0) {
+		return false;
+	}
+	if(sb->s_feature_incompat & EXT_FEATURE_INCOMPAT_JOURNAL_DEV) {
+		// External journal, not a filing system
+		return false;
+	}
+
+	uint64_t blockCount = sb->s_blocks_count;
+	if(sb->s_feature_incompat & EXT4_FEATURE_INCOMPAT_64BIT) {
+		auto hi = window.at<uint32_t>(EXT_SUPERBLOCK_OFFSET + EXT_BLOCKS_COUNT_HI_OFFSET);
+		if(hi != nullptr) {
+			blockCount |= uint64_t(*hi) << 32;
+		}
+	}
+
+	if((sb->s_feature_incompat & EXT4_FEATURE_INCOMPAT_MASK) || (sb->s_feature_ro_compat & EXT4_FEATURE_RO_COMPAT_MASK)) {
+		part.systype = SysType::ext4;
+	} else if(sb->s_feature_compat & EXT_FEATURE_COMPAT_HAS_JOURNAL) {
+		part.systype = SysType::ext3;
+	} else {
+		part.systype = SysType::ext2;
+	}
+	part.size = blockCount << (10 + sb->s_log_block_size);
+	part.name = getLabel(sb->s_volume_name, sizeof(sb->s_volume_name));
+	return true;
+}
+
+bool probeF2fs(const ProbeWindow& window, PartInfo& part)
+{
+	auto sb = window.at<f2fs_super_block_t>(F2FS_SUPERBLOCK_OFFSET);
+	if(sb == nullptr || sb->magic != F2FS_SUPER_MAGIC || sb->log_blocksize < 9 || sb->log_blocksize > 16) {
+		return false;
+	}
+	uint64_t blockCount = sb->block_count[0] | uint64_t(sb->block_count[1]) << 32;
+	part.systype = SysType::f2fs;
+	part.size = blockCount << sb->log_blocksize;
+
+	char label[ARRAY_SIZE(sb->volume_name)];
+	unsigned n;
+	for(n = 0; n < ARRAY_SIZE(label) && sb->volume_name[n] != 0; ++n) {
+		label[n] = sb->volume_name[n];
+	}
+	part.name = String(label, n);
+	return true;
+}
+
+/*
+ * Superblock is stored in a metadata pair occupying blocks 0 and 1.
+ * Only block 0 is checked as the location of block 1 depends on the block size.
+ */
+bool probeLittlefs(const ProbeWindow& window, PartInfo& part)
+{
+	auto magic = window.at<char[8]>(LFS_MAGIC_OFFSET);
+	if(magic == nullptr || memcmp(*magic, "littlefs", 8) != 0) {
+		return false;
+	}
+	part.type = Partition::Type::data;
+	part.subtype = uint8_t(Partition::SubType::Data::littlefs);
+	part.systype = SysType::littlefs;
+	auto sb = window.at<lfs_superblock_t>(LFS_MAGIC_OFFSET + 8);
+	if(sb != nullptr && sb->block_size != 0 && sb->block_count != 0) {
+		part.size = storage_size_t(sb->block_size) * sb->block_count;
+	}
+	return true;
+}
+
+#define MAX_PROBES 16
+
+/*
+ * exFAT and NTFS are checked before FAT as the FAT probe includes a heuristic test
+ */
+Probe probes[MAX_PROBES]{
+	{SysType::exfat, 512, probeExfat},
+	{SysType::ntfs, 512, probeNtfs},
+	{SysType::fat32, 512, probeFat},
+	{SysType::ext4, EXT_SUPERBLOCK_OFFSET + EXT_BLOCKS_COUNT_HI_OFFSET + sizeof(uint32_t), probeExt},
+	{SysType::f2fs, F2FS_SUPERBLOCK_OFFSET + sizeof(f2fs_super_block_t), probeF2fs},
+	{SysType::littlefs, LFS_MAGIC_OFFSET + 8 + sizeof(lfs_superblock_t), probeLittlefs},
+};
+unsigned probeCount{6};
+
+/*
+ * Probes are registered against a single type, so map related types
+ */
+SysTypes getProbeTypes(const Probe& probe)
+{
+	switch(probe.systype) {
+	case SysType::fat12:
+	case SysType::fat16:
+	case SysType::fat32:
+		return SysType::fat12 | SysType::fat16 | SysType::fat32;
+	case SysType::ext2:
+	case SysType::ext3:
+	case SysType::ext4:
+		return SysType::ext2 | SysType::ext3 | SysType::ext4;
+	default:
+		return probe.systype;
+	}
+}
+
+bool intersects(SysTypes a, SysTypes b)
+{
+	return (a & b).any();
+}
+
+} // namespace
+
+bool registerProbe(const Probe& probe)
+{
+	if(probeCount >= MAX_PROBES || probe.callback == nullptr || probe.windowSize > maxProbeWindowSize) {
+		return false;
+	}
+	probes[probeCount++] = probe;
+	return true;
+}
+
+uint32_t getProbeWindowSize()
+{
+	uint32_t size{0};
+	for(unsigned i = 0; i < probeCount; ++i) {
+		size = std::max(size, probes[i].windowSize);
+	}
+	return size;
+}
+
+bool identify(const ProbeWindow& window, PartInfo& part, SysTypes candidates, SysTypes hints)
+{
+	// Hinted probes first, then the rest
+	for(bool hinted : {true, false}) {
+		for(unsigned i = 0; i < probeCount; ++i) {
+			auto& probe = probes[i];
+			auto types = getProbeTypes(probe);
+			if(intersects(types, hints) != hinted || !intersects(types, candidates)) {
+				continue;
+			}
+			if(probe.callback(window, part)) {
+				debug_d("[DD] Found %s @ 0x%llx", toString(part.systype).c_str(), uint64_t(window.offset));
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+SysTypes getProbeHints(const DiskPart& part)
+{
+	if(part.typeGuid == GPT::PARTITION_BASIC_DATA_GUID) {
+		return fatTypes | SysType::ntfs;
+	}
+	if(part.typeGuid == GPT::PARTITION_LINUX_DATA_GUID) {
+		return SysType::ext2 | SysType::ext3 | SysType::ext4 | SysType::f2fs;
+	}
+
+	switch(part.sysind) {
+	case SI_FAT12:
+	case SI_FAT16:
+	case SI_FAT16B:
+	case SI_FAT32X:
+		return fatTypes;
+	case SI_IFS:
+		return SysType::exfat | SysType::ntfs;
+	case SI_LINUX:
+		return SysType::ext2 | SysType::ext3 | SysType::ext4 | SysType::f2fs;
+	default:
+		return {};
+	}
+}
+
+} // namespace Storage::Disk
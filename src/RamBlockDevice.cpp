@@ -0,0 +1,139 @@
+/****
+ * RamBlockDevice.cpp
+ *
+ * Copyright 2022 mikee47 <mike@sillyhouse.net>
+ *
+ * This file is part of the DiskStorage Library
+ *
+ * This library is free software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation, version 3 or later.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this library.
+ * If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****/
+
+#include "include/Storage/Disk/RamBlockDevice.h"
+#include "include/Storage/Disk/diskdefs.h"
+#include <debug_progmem.h>
+
+namespace Storage::Disk
+{
+RamBlockDevice::RamBlockDevice(const String& name, storage_size_t size, uint16_t sectorSize, size_t chunkSize)
+	: name(name)
+{
+	if(!setSectorSize(sectorSize)) {
+		return;
+	}
+
+	chunkSize = std::max(chunkSize, size_t(sectorSize));
+	chunkShift = getSizeBits(chunkSize);
+	if(!isLog2(chunkSize)) {
+		++chunkShift;
+	}
+	this->chunkSize = 1U << chunkShift;
+	sectorCount = size >> sectorSizeShift;
+}
+
+bool RamBlockDevice::raw_sector_read(storage_size_t address, void* dst, size_t size)
+{
+	addLatency(LatencyModel::Operation::read, address, size);
+
+	auto dstptr = static_cast<uint8_t*>(dst);
+	uint64_t offset = uint64_t(address) << sectorSizeShift;
+	size_t len = size << sectorSizeShift;
+	while(len != 0) {
+		auto chunkOffset = offset & (chunkSize - 1);
+		auto count = std::min(len, size_t(chunkSize - chunkOffset));
+		auto it = chunks.find(offset >> chunkShift);
+		if(it == chunks.end()) {
+			memset(dstptr, 0, count);
+		} else {
+			memcpy(dstptr, &it->second[chunkOffset], count);
+		}
+		dstptr += count;
+		offset += count;
+		len -= count;
+	}
+
+	return true;
+}
+
+bool RamBlockDevice::raw_sector_write(storage_size_t address, const void* src, size_t size)
+{
+	addLatency(LatencyModel::Operation::write, address, size);
+
+	auto srcptr = static_cast<const uint8_t*>(src);
+	uint64_t offset = uint64_t(address) << sectorSizeShift;
+	size_t len = size << sectorSizeShift;
+	while(len != 0) {
+		auto chunkOffset = offset & (chunkSize - 1);
+		auto count = std::min(len, size_t(chunkSize - chunkOffset));
+		auto chunkIndex = offset >> chunkShift;
+		auto it = chunks.find(chunkIndex);
+		if(it != chunks.end()) {
+			memcpy(&it->second[chunkOffset], srcptr, count);
+		} else if(!isZeroFilled(srcptr, count)) {
+			// Unallocated chunks already read as zero, so only allocate when necessary
+			auto chunk = new(std::nothrow) uint8_t[chunkSize]{};
+			if(chunk == nullptr) {
+				debug_e("[RAM] Out of memory");
+				return false;
+			}
+			memcpy(&chunk[chunkOffset], srcptr, count);
+			chunks[chunkIndex].reset(chunk);
+		}
+		srcptr += count;
+		offset += count;
+		len -= count;
+	}
+
+	return true;
+}
+
+bool RamBlockDevice::raw_sector_erase_range(storage_size_t address, size_t size)
+{
+	addLatency(LatencyModel::Operation::erase, address, size);
+
+	uint64_t offset = uint64_t(address) << sectorSizeShift;
+	uint64_t len = uint64_t(size) << sectorSizeShift;
+	while(len != 0) {
+		auto chunkOffset = offset & (chunkSize - 1);
+		auto count = std::min(len, uint64_t(chunkSize - chunkOffset));
+		auto it = chunks.find(offset >> chunkShift);
+		if(it != chunks.end()) {
+			if(count == chunkSize) {
+				chunks.erase(it);
+			} else {
+				memset(&it->second[chunkOffset], 0, count);
+			}
+		}
+		offset += count;
+		len -= count;
+	}
+
+	return true;
+}
+
+bool RamBlockDevice::raw_sync()
+{
+	addLatency(LatencyModel::Operation::sync, 0, 0);
+	return true;
+}
+
+bool RamBlockDevice::raw_sector_is_allocated(storage_size_t address, storage_size_t size)
+{
+	if(size == 0) {
+		return false;
+	}
+	uint64_t firstChunk = (uint64_t(address) << sectorSizeShift) >> chunkShift;
+	uint64_t lastChunk = ((uint64_t(address) + size - 1) << sectorSizeShift) >> chunkShift;
+	auto it = chunks.lower_bound(firstChunk);
+	return it != chunks.end() && it->first <= lastChunk;
+}
+
+} // namespace Storage::Disk
@@ -0,0 +1,253 @@
+/****
+ * ScanCache.cpp
+ *
+ * Copyright 2022 mikee47 <mike@sillyhouse.net>
+ *
+ * This file is part of the DiskStorage Library
+ *
+ * This library is free software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation, version 3 or later.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this library.
+ * If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****/
+
+#include "include/Storage/Disk/ScanCache.h"
+#include "include/Storage/Disk/GPT.h"
+#include "include/Storage/Disk/SectorBuffer.h"
+#include "include/Storage/Disk/diskdefs.h"
+#include <debug_progmem.h>
+
+namespace Storage::Disk
+{
+namespace
+{
+constexpr uint32_t cacheMagic{0x43505344}; // "DSPC"
+constexpr uint16_t cacheVersion{1};
+
+/*
+ * Identifies disk contents
+ */
+struct CacheKey {
+	Uuid id;			  ///< GPT disk GUID, or MBR disk signature
+	uint64_t sectorCount; ///< Size of device
+	uint32_t crc;		  ///< GPT header CRC, or CRC of MBR sector
+	uint16_t sectorSize;
+	uint16_t reserved;
+
+	bool operator==(const CacheKey& other) const
+	{
+		return id == other.id && sectorCount == other.sectorCount && crc == other.crc &&
+			   sectorSize == other.sectorSize;
+	}
+};
+
+struct CacheHeader {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t count;  ///< Number of entries
+	uint32_t length; ///< Size of cache data including this header
+	uint32_t crc;	///< CRC of entries
+	CacheKey key;
+};
+
+/*
+ * Entries are stored unaligned, each followed by the partition name
+ */
+struct CacheEntry {
+	uint64_t offset;
+	uint64_t size;
+	Uuid typeGuid;
+	Uuid uniqueGuid;
+	Partition::Type type;
+	uint8_t subtype;
+	SysType systype;
+	uint8_t sysind;
+	uint8_t nameLength;
+	uint8_t reserved[3]; // No implicit padding, so content is repeatable
+};
+
+static_assert(sizeof(CacheEntry) == 56, "Bad CacheEntry size");
+
+bool readKey(Device& device, CacheKey& key)
+{
+	const uint16_t sectorSize = device.getSectorSize();
+	if(!isValidSectorSize(sectorSize)) {
+		return false;
+	}
+	SectorBuffer buffer(sectorSize, 1);
+	if(!buffer || !device.read(0, buffer.get(), sectorSize)) {
+		return false;
+	}
+
+	key = CacheKey{};
+	key.sectorSize = sectorSize;
+	key.sectorCount = device.getSize() >> getSizeBits(sectorSize);
+
+	auto& mbr = buffer.as<legacy_mbr_t>();
+	if(mbr.signature == MSDOS_MBR_SIGNATURE && mbr.partition_record[0].os_type == EFI_PMBR_OSTYPE_EFI_GPT) {
+		// Header CRC covers the entry array CRC, so changes to any partition are detected
+		if(!device.read(GPT_PRIMARY_PARTITION_TABLE_LBA * sectorSize, buffer.get(), sectorSize)) {
+			return false;
+		}
+		auto& gpt = buffer.as<gpt_header_t>();
+		if(!GPT::verifyHeader(gpt)) {
+			return false;
+		}
+		key.id = gpt.disk_guid;
+		key.crc = gpt.header_crc32;
+	} else {
+		key.id.time_low = mbr.unique_mbr_signature;
+		key.crc = crc32(buffer.get(), sectorSize);
+	}
+
+	return true;
+}
+
+} // namespace
+
+bool ScanCache::load(Device& device)
+{
+	if(bufferSize < sizeof(CacheHeader)) {
+		return false;
+	}
+	CacheHeader header;
+	memcpy(&header, buffer, sizeof(header));
+	if(header.magic != cacheMagic || header.version != cacheVersion || header.length < sizeof(header) ||
+	   header.length > bufferSize) {
+		return false;
+	}
+	if(crc32(&buffer[sizeof(header)], header.length - sizeof(header)) != header.crc) {
+		debug_w("[DD] Scan cache corrupt");
+		return false;
+	}
+
+	CacheKey key;
+	if(!readKey(device, key) || !(key == header.key)) {
+		debug_d("[DD] Scan cache out of date");
+		return false;
+	}
+
+	auto& pt = device.editablePartitions();
+	pt.clear();
+
+	auto ptr = &buffer[sizeof(header)];
+	auto end = &buffer[header.length];
+	for(unsigned i = 0; i < header.count; ++i) {
+		CacheEntry entry;
+		if(ptr + sizeof(entry) > end) {
+			pt.clear();
+			return false;
+		}
+		memcpy(&entry, ptr, sizeof(entry));
+		ptr += sizeof(entry);
+		if(ptr + entry.nameLength > end) {
+			pt.clear();
+			return false;
+		}
+		auto part = new PartInfo(String(reinterpret_cast<const char*>(ptr), entry.nameLength),
+								 Partition::FullType{entry.type, entry.subtype}, entry.offset, entry.size);
+		ptr += entry.nameLength;
+		part->typeGuid = entry.typeGuid;
+		part->uniqueGuid = entry.uniqueGuid;
+		part->systype = entry.systype;
+		part->sysind = SysIndicator(entry.sysind);
+		pt.add(part);
+	}
+
+	debug_d("[DD] Loaded %u partitions from scan cache", header.count);
+	return true;
+}
+
+bool ScanCache::save(Device& device)
+{
+	if(bufferSize < sizeof(CacheHeader)) {
+		return false;
+	}
+
+	CacheHeader oldHeader;
+	memcpy(&oldHeader, buffer, sizeof(oldHeader));
+
+	CacheHeader header{
+		.magic = cacheMagic,
+		.version = cacheVersion,
+	};
+	if(!readKey(device, header.key)) {
+		invalidate();
+		return false;
+	}
+
+	auto ptr = &buffer[sizeof(header)];
+	auto end = &buffer[bufferSize];
+	for(auto& info : device.editablePartitions()) {
+		auto dp = info.diskpart();
+		if(dp == nullptr) {
+			invalidate();
+			return false;
+		}
+		CacheEntry entry{
+			.offset = info.offset,
+			.size = info.size,
+			.typeGuid = dp->typeGuid,
+			.uniqueGuid = dp->uniqueGuid,
+			.type = info.type,
+			.subtype = info.subtype,
+			.systype = dp->systype,
+			.sysind = uint8_t(dp->sysind),
+			.nameLength = uint8_t(std::min(info.name.length(), size_t(255))),
+		};
+		if(ptr + sizeof(entry) + entry.nameLength > end) {
+			debug_w("[DD] Scan cache too small");
+			invalidate();
+			return false;
+		}
+		memcpy(ptr, &entry, sizeof(entry));
+		ptr += sizeof(entry);
+		memcpy(ptr, info.name.c_str(), entry.nameLength);
+		ptr += entry.nameLength;
+		++header.count;
+	}
+
+	header.length = ptr - buffer;
+	header.crc = crc32(&buffer[sizeof(header)], header.length - sizeof(header));
+	memcpy(buffer, &header, sizeof(header));
+
+	// Header covers all content so is enough to detect changes
+	if(memcmp(&header, &oldHeader, sizeof(header)) != 0) {
+		modified = true;
+	}
+	return true;
+}
+
+void ScanCache::invalidate()
+{
+	if(bufferSize < sizeof(CacheHeader)) {
+		return;
+	}
+	uint32_t magic;
+	memcpy(&magic, buffer, sizeof(magic));
+	if(magic != 0) {
+		memset(buffer, 0, sizeof(CacheHeader));
+		modified = true;
+	}
+}
+
+size_t ScanCache::getUsedSize() const
+{
+	if(bufferSize < sizeof(CacheHeader)) {
+		return 0;
+	}
+	CacheHeader header;
+	memcpy(&header, buffer, sizeof(header));
+	if(header.magic != cacheMagic || header.length > bufferSize) {
+		return sizeof(CacheHeader);
+	}
+	return header.length;
+}
+
+} // namespace Storage::Disk
@@ -19,23 +19,27 @@
  *
  ****/
 
+#include "include/Storage/Disk.h"
 #include "include/Storage/Disk/Scanner.h"
 #include "include/Storage/Disk/GPT.h"
+#include "include/Storage/Disk/Probe.h"
 #include "include/Storage/Disk/diskdefs.h"
 #include <debug_progmem.h>
+#include <algorithm>
 
 namespace Storage::Disk
 {
 namespace
 {
-#define MAX_FAT12 0xFF5 // Max FAT12 clusters (differs from specs, but right for real DOS/Windows behavior)
+// Limit on number of EBRs followed in an extended partition
+constexpr unsigned maxEbrChainLength{128};
 
-String getLabel(const char* s, unsigned length)
+// Limit on memory used to read GPT partition entries, enough for a standard 128-entry array
+constexpr uint32_t maxEntryChunkSize{16384};
+
+bool isExtendedPartition(uint8_t osType)
 {
-	while(length > 0 && s[length - 1] == 0x20) {
-		--length;
-	}
-	return String(s, length);
+	return osType == OSTYPE_EXTENDED || osType == OSTYPE_EXTENDED_LBA || osType == OSTYPE_EXTENDED_LINUX;
 }
 
 // Convert unicode to OEM string
@@ -54,264 +58,556 @@ String unicode_to_oem(const uint16_t* str, size_t length)
 	return String(buf, i);
 }
 
-bool verifyGptHeader(gpt_header_t& gpt)
+/*
+ * Read data from start of a volume for identification, limited to end of device
+ */
+bool readWindow(Device& device, SectorBuffer& buffer, uint64_t lba, ProbeWindow& window)
 {
-	/* Check signature, version (1.0) and length (92) */
-	if(gpt.signature != GPT_HEADER_SIGNATURE) {
-		debug_e("[GPT] Bad signature");
+	const uint16_t sectorSize = device.getSectorSize();
+	const uint8_t sectorSizeShift = getSizeBits(sectorSize);
+	const uint64_t sectorCount = device.getSize() >> sectorSizeShift;
+	if(lba >= sectorCount) {
 		return false;
 	}
-	if(gpt.revision != GPT_HEADER_REVISION_V1) {
-		debug_e("[GPT] Bad revision");
+	size_t count = std::min(uint64_t(buffer.sectors()), sectorCount - lba);
+	storage_size_t offset = storage_size_t(lba) << sectorSizeShift;
+	if(!device.read(offset, buffer.get(), count << sectorSizeShift)) {
 		return false;
 	}
-	if(gpt.header_size < GPT_HEADER_SIZE) {
-		debug_e("[GPT] Bad size %u", gpt.header_size);
-		return false;
+	window = ProbeWindow{buffer.get(), count << sectorSizeShift, offset, sectorSize};
+	return true;
+}
+
+/*
+ * Buffer large enough for all registered probes
+ */
+SectorBuffer createWindowBuffer(uint16_t sectorSize)
+{
+	auto sectors = std::max(getBlockCount(getProbeWindowSize(), sectorSize), 1U);
+	return SectorBuffer(sectorSize, sectors);
+}
+
+} // namespace
+
+Scanner::Scanner(Device& device, bool identifyVolumes) : device(device), identifyVolumes(identifyVolumes)
+{
+}
+
+Scanner::~Scanner()
+{
+}
+
+unsigned Scanner::scanMbrEntries()
+{
+	auto& mbr = buffer.as<legacy_mbr_t>();
+	unsigned n{0};
+	for(unsigned i = 0; i < ARRAY_SIZE(mbr.partition_record); ++i) {
+		auto& rec = mbr.partition_record[i];
+		if(rec.starting_lba == 0 || rec.size_in_lba == 0) {
+			continue;
+		}
+		mbrEntries[n++] = rec;
 	}
+	return n;
+}
+
+bool Scanner::readSectors(void* dst, uint64_t sector, size_t count)
+{
+	return device.read(storage_size_t(sector) << sectorSizeShift, dst, count << sectorSizeShift);
+}
 
-	uint32_t crc32_saved = gpt.header_crc32;
-	gpt.header_crc32 = 0;
-	uint32_t bcc = crc32(&gpt, gpt.header_size);
-	gpt.header_crc32 = crc32_saved;
-	if(bcc != crc32_saved) {
-		debug_e("[GPT] bcc 0x%08x, ~bcc 0x%08x, crc32 0x%08x", bcc, ~bcc, crc32_saved);
+bool Scanner::readGptEntries(const gpt_header_t& gpt)
+{
+	numPartitionEntries = gpt.num_partition_entries;
+	entrySize = gpt.sizeof_partition_entry;
+	entryLba = gpt.partition_entry_lba;
+	entryArrayCrc = gpt.partition_entry_array_crc32;
+	entryArraySectors = getBlockCount(numPartitionEntries * entrySize, sectorSize);
+	if(entryLba + entryArraySectors > device.getSize() >> sectorSizeShift) {
+		debug_e("[GPT] Entry array exceeds device");
 		return false;
 	}
-	if(gpt.sizeof_partition_entry != sizeof(gpt_entry_t)) {
-		debug_e("[GPT] Bad sizeof_partition_entry %u", gpt.sizeof_partition_entry);
-		return false;
+
+	// Read in chunks of bounded size, reduced if memory is short. Each chunk holds a whole number of entries.
+	const uint32_t minChunkSectors = std::max(entrySize >> sectorSizeShift, 1U);
+	entryChunkSectors = std::min(std::max(maxEntryChunkSize >> sectorSizeShift, minChunkSectors), entryArraySectors);
+	entryChunkSectors &= ~(minChunkSectors - 1);
+	entryBuffer.reset();
+	for(; entryChunkSectors >= minChunkSectors; entryChunkSectors /= 2) {
+		entryBuffer = SectorBuffer(sectorSize, entryChunkSectors);
+		if(entryBuffer) {
+			break;
+		}
 	}
-	if(gpt.num_partition_entries > 128) {
-		debug_e("[GPT] Bad num_partition_entries %u", gpt.num_partition_entries);
+	if(!entryBuffer) {
 		return false;
 	}
 
+	partitionIndex = 0;
+	entryCrc = 0;
+	pending.clear();
+	state = State::GPTEntries;
 	return true;
 }
 
-PartInfo* identify(Device& device, const SectorBuffer& buffer, storage_size_t offset)
+/*
+ * Entries are read once, checking the CRC and collecting partitions as we go.
+ * Nothing is returned until the whole array has been verified.
+ */
+bool Scanner::readGptChunk()
 {
-	auto& fat = buffer.as<const FAT::fat_boot_sector_t>();
-	auto& exfat = buffer.as<const EXFAT::boot_sector_t>();
-
-	if(exfat.signature == MSDOS_MBR_SIGNATURE && exfat.fs_type == FSTYPE_EXFAT) {
-		auto part =
-			new PartInfo(nullptr, Partition::SubType::Data::fat, offset, exfat.vol_length << exfat.sect_size_bits, 0);
-		part->systype = SysType::exfat;
-		debug_d("[DD] Found ExFAT @ 0x%llx", offset);
-		return part;
+	uint32_t offset = (uint64_t(partitionIndex) * entrySize) >> sectorSizeShift;
+	auto count = std::min(entryChunkSectors, entryArraySectors - offset);
+	if(!readSectors(entryBuffer.get(), entryLba + offset, count)) {
+		debug_e("[GPT] Entry array read failed");
+		return gptFailed();
 	}
+	auto n = std::min(numPartitionEntries - partitionIndex, (count << sectorSizeShift) / entrySize);
+	entryCrc = crc32(entryCrc, entryBuffer.get(), n * entrySize);
 
-	// Valid JumpBoot code? (short jump, near jump or near call)
-	auto b = fat.jmp_boot[0];
-	if(b == 0xEB || b == 0xE9 || b == 0xE8) {
-		if(fat.signature == MSDOS_MBR_SIGNATURE && fat.fat32.fs_type == FSTYPE_FAT32) {
-			auto part = new PartInfo(getLabel(fat.fat32.vol_label, MSDOS_NAME), Partition::SubType::Data::fat, offset,
-									 (fat.sectors ?: fat.total_sect) * fat.sector_size, 0);
-			part->systype = SysType::fat32;
-			debug_d("[DD] Found FAT32 @ 0x%luu", offset);
-			return part;
+	for(unsigned i = 0; i < n; ++i) {
+		auto& entry = *reinterpret_cast<const gpt_entry_t*>(&entryBuffer[i * entrySize]);
+		if(!entry.partition_type_guid) {
+			continue;
 		}
 
-		// FAT volumes formatted with early MS-DOS lack signature/fs_type
-		auto w = fat.sector_size;
-		b = fat.sec_per_clus;
-		if((w & (w - 1)) == 0 && w >= 512 && w <= 4096			// Properness of sector size (512-4096 and 2^n)
-		   && b != 0 && (b & (b - 1)) == 0						// Properness of cluster size (2^n)
-		   && fat.reserved != 0									// Properness of reserved sectors (MNBZ)
-		   && fat.num_fats - 1 <= 1								// Properness of FATs (1 or 2)
-		   && fat.dir_entries != 0								// Properness of root dir entries (MNBZ)
-		   && (fat.sectors >= 128 || fat.total_sect >= 0x10000) // Properness of volume sectors (>=128)
-		   && fat.fat_length != 0) {							// Properness of FAT size (MNBZ)
-			auto part = new PartInfo(getLabel(fat.fat16.vol_label, MSDOS_NAME), Partition::SubType::Data::fat, offset,
-									 (fat.sectors ?: fat.total_sect) * fat.sector_size, 0);
-			auto numClusters = part->size / (fat.sector_size * fat.sec_per_clus);
-			part->systype = (numClusters <= MAX_FAT12) ? SysType::fat12 : SysType::fat16;
-			debug_d("[DD] Found FAT @ 0x%luu", offset);
-			return part;
+		storage_size_t offset = entry.starting_lba << sectorSizeShift;
+		storage_size_t size = (1 + entry.ending_lba - entry.starting_lba) << sectorSizeShift;
+		auto fulltype = GPT::SmingTypeGuid::match(entry.partition_type_guid);
+		auto part = new(std::nothrow) PartInfo{nullptr, fulltype, offset, size};
+		if(part == nullptr) {
+			pending.clear();
+			state = State::error;
+			return false;
+		}
+		part->typeGuid = entry.partition_type_guid;
+		part->uniqueGuid = entry.unique_partition_guid;
+		part->name = unicode_to_oem(entry.partition_name, ARRAY_SIZE(entry.partition_name));
+		if(part->name.length() == 0 && part->uniqueGuid) {
+			part->name = part->uniqueGuid;
 		}
+		pending.add(part);
 	}
+	partitionIndex += n;
 
-	return nullptr;
+	if(partitionIndex < numPartitionEntries) {
+		return true;
+	}
+	if(entryCrc != entryArrayCrc) {
+		debug_e("[GPT] Entry array crc 0x%08x, expected 0x%08x", entryCrc, entryArrayCrc);
+		return gptFailed();
+	}
+	entryBuffer.reset();
+	state = State::GPT;
+	return true;
 }
 
-} // namespace
+bool Scanner::gptFailed()
+{
+	pending.clear();
+	if(!backupGpt) {
+		// Primary damaged, try the backup in the last sector
+		backupGpt = true;
+		uint64_t lastLba = (device.getSize() >> sectorSizeShift) - 1;
+		debug_w("[DD] Primary GPT invalid, trying backup @ LBA %llu", lastLba);
+		if(loadGpt(lastLba)) {
+			return true;
+		}
+	}
+	debug_e("[DD] GPT invalid");
+	state = State::error;
+	return false;
+}
+
+bool Scanner::loadGpt(uint64_t lba)
+{
+	if(!readSectors(buffer.get(), lba, 1)) {
+		debug_e("[DD] GPT header read failed");
+		return false;
+	}
+	auto& gpt = buffer.as<gpt_header_t>();
+	if(!GPT::verifyHeader(gpt)) {
+		return false;
+	}
+	if(gpt.my_lba != lba) {
+		debug_e("[DD] GPT header @ LBA %llu has my_lba %llu", lba, uint64_t(gpt.my_lba));
+		return false;
+	}
+	if(!readGptEntries(gpt)) {
+		debug_e("[DD] GPT partition table invalid");
+		return false;
+	}
+	return true;
+}
 
-Scanner::Scanner(Device& device) : device(device)
+std::unique_ptr<PartInfo> Scanner::next()
 {
+	std::unique_ptr<PartInfo> part;
+	while(!part && step(part)) {
+	}
+	return part;
 }
 
-Scanner::~Scanner()
+bool Scanner::step(std::unique_ptr<PartInfo>& part)
 {
+	switch(state) {
+	case State::idle:
+		return start(part);
+	case State::MBR:
+		part = nextMbrPartition();
+		return bool(part);
+	case State::GPTEntries:
+		return readGptChunk();
+	case State::GPT:
+		part = nextGptPartition();
+		return bool(part);
+	case State::error:
+	case State::done:
+		return false;
+	}
+
+	assert(false);
+	return false;
 }
 
-unsigned Scanner::scanMbrEntries(uint32_t baseLba)
+bool Scanner::start(std::unique_ptr<PartInfo>& part)
 {
+	sectorSize = device.getSectorSize();
+	if(!isValidSectorSize(sectorSize)) {
+		debug_e("[DD] Invalid sector size %u", sectorSize);
+		state = State::error;
+		return false;
+	}
+	sectorSizeShift = getSizeBits(sectorSize);
+	buffer = createWindowBuffer(sectorSize);
+	if(!buffer) {
+		state = State::error;
+		return false;
+	}
+
+	// Load start of disk and check it
+	ProbeWindow window;
+	if(!readWindow(device, buffer, 0, window)) {
+		state = State::error;
+		return false;
+	}
+
+	// Partition tables share boot signature with some filing systems
 	auto& mbr = buffer.as<legacy_mbr_t>();
-	unsigned n{0};
-	for(unsigned i = 0; i < ARRAY_SIZE(mbr.partition_record); ++i) {
-		auto& rec = mbr.partition_record[i];
-		if(rec.starting_lba == 0 || rec.size_in_lba == 0) {
-			continue;
+	bool bootSignature = (mbr.signature == MSDOS_MBR_SIGNATURE);
+
+	part.reset(new PartInfo{});
+	part->size = device.getSize();
+	if(identify(window, *part, bootSignature ? bootSectorTypes : allSysTypes)) {
+		state = State::done;
+		return true;
+	}
+	part.reset();
+
+	/* Sector 0 is not a VBR or forced partition number wants a partition */
+
+	if(!bootSignature) {
+		state = State::done;
+		return false;
+	}
+
+	if(mbr.partition_record[0].os_type == EFI_PMBR_OSTYPE_EFI_GPT) {
+		return loadGpt(GPT_PRIMARY_PARTITION_TABLE_LBA) || gptFailed();
+	}
+
+	mbrEntries.reset(new gpt_mbr_record_t[4]);
+	numPartitionEntries = scanMbrEntries();
+	state = State::MBR;
+	return true;
+}
+
+std::unique_ptr<PartInfo> Scanner::nextGptPartition()
+{
+	while(!pending.isEmpty()) {
+		std::unique_ptr<PartInfo> part(pending.pop());
+		if(part->type == Partition::Type::invalid && identifyVolumes) {
+			ProbeWindow window;
+			if(!readWindow(device, buffer, part->offset >> sectorSizeShift, window)) {
+				continue;
+			}
+			// Partition name comes from table, not volume label
+			PartInfo vol;
+			if(identify(window, vol, allSysTypes, getProbeHints(*part))) {
+				part->type = vol.type;
+				part->subtype = vol.subtype;
+				part->systype = vol.systype;
+				if(vol.size != 0) {
+					part->size = vol.size;
+				}
+			}
 		}
-		mbrEntries[n] = rec;
-		mbrEntries[n].starting_lba += baseLba;
-		++n;
+		return part;
 	}
-	return n;
+
+	state = State::done;
+	return nullptr;
 }
 
-std::unique_ptr<PartInfo> Scanner::next()
+std::unique_ptr<PartInfo> Scanner::nextMbrPartition()
 {
-	auto READ_SECTORS = [this](void* dst, storage_size_t sector, size_t count) {
-		return device.read(sector << sectorSizeShift, dst, count << sectorSizeShift);
-	};
-
-	if(state == State::idle) {
-#if DISK_MAX_SECTOR_SIZE != DISK_MIN_SECTOR_SIZE
-		sectorSize = device.getSectorSize();
-		if(sectorSize > DISK_MAX_SECTOR_SIZE || sectorSize < DISK_MIN_SECTOR_SIZE || !isLog2(sectorSize)) {
-			debug_e("[DD] Invalid sector size %u", sectorSize);
-			state = State::error;
-			return nullptr;
+	for(;;) {
+		// Logical partitions are returned in chain order before any remaining primary partitions
+		if(ebrLba != 0) {
+			gpt_mbr_record_t entry;
+			if(readEbr(entry)) {
+				auto part = createMbrPartition(entry);
+				if(part) {
+					return part;
+				}
+			}
+			continue;
 		}
-#else
-		sectorSize = DISK_MAX_SECTOR_SIZE;
-#endif
-		sectorSizeShift = getSizeBits(sectorSize);
-		buffer = SectorBuffer(sectorSize, 1);
-		if(!buffer) {
+
+		if(partitionIndex >= numPartitionEntries) {
+			state = State::done;
 			return nullptr;
 		}
 
-		// Load sector 0 and check it
-		if(!READ_SECTORS(buffer.get(), 0, 1)) {
-			state = State::error;
-			return nullptr;
+		auto& entry = mbrEntries[partitionIndex++];
+		if(isExtendedPartition(entry.os_type)) {
+			if(extendedPartition) {
+				debug_w("[DD] Ignoring additional extended partition @ LBA %u", entry.starting_lba);
+				continue;
+			}
+			extendedPartition = true;
+			extendedBase = entry.starting_lba;
+			extendedSize = entry.size_in_lba;
+			ebrLba = extendedBase;
+			ebrHistory.reset(new(std::nothrow) uint32_t[maxEbrChainLength]);
+			ebrCount = 0;
+			if(!ebrHistory) {
+				ebrLba = 0;
+			}
+			continue;
 		}
 
-		auto part = identify(device, buffer, 0);
+		auto part = createMbrPartition(entry);
 		if(part) {
-			state = State::done;
-			return std::unique_ptr<PartInfo>(part);
+			return part;
 		}
+	}
+}
 
-		/* Sector 0 is not an FAT VBR or forced partition number wants a partition */
+bool Scanner::readEbr(gpt_mbr_record_t& entry)
+{
+	auto lba = ebrLba;
+	ebrLba = 0;
 
-		// GPT protective MBR?
-		auto& mbr = buffer.as<legacy_mbr_t>();
+	if(ebrCount == maxEbrChainLength) {
+		debug_w("[DD] EBR chain exceeds %u entries", maxEbrChainLength);
+		return false;
+	}
+	for(unsigned i = 0; i < ebrCount; ++i) {
+		if(ebrHistory[i] == lba) {
+			debug_w("[DD] EBR chain loops @ LBA %u", lba);
+			return false;
+		}
+	}
+	ebrHistory[ebrCount++] = lba;
 
-		if(mbr.signature != MSDOS_MBR_SIGNATURE) {
+	if(!readSectors(buffer.get(), lba, 1)) {
+		debug_e("[DD] EBR read failed @ LBA %u", lba);
+		return false;
+	}
+	auto& ebr = buffer.as<legacy_mbr_t>();
+	if(ebr.signature != MSDOS_MBR_SIGNATURE) {
+		debug_w("[DD] Bad EBR signature @ LBA %u", lba);
+		return false;
+	}
+
+	// Link to next EBR is relative to start of extended partition
+	auto& link = ebr.partition_record[1];
+	if(isExtendedPartition(link.os_type) && link.starting_lba != 0) {
+		uint64_t next = uint64_t(extendedBase) + link.starting_lba;
+		if(link.starting_lba < extendedSize && next <= UINT32_MAX) {
+			ebrLba = next;
+		} else {
+			debug_w("[DD] EBR link @ LBA %u out of range", lba);
+		}
+	}
+
+	// Logical partition is relative to this EBR
+	entry = ebr.partition_record[0];
+	if(entry.os_type == 0 || entry.starting_lba == 0 || entry.size_in_lba == 0) {
+		return false;
+	}
+	// Check before updating entry as 32-bit sum may overflow
+	uint64_t start = uint64_t(entry.starting_lba) + lba;
+	if(start + entry.size_in_lba > uint64_t(extendedBase) + extendedSize) {
+		debug_w("[DD] Logical partition @ LBA %llu exceeds extended partition", start);
+		return false;
+	}
+	entry.starting_lba = start;
+	return true;
+}
+
+std::unique_ptr<PartInfo> Scanner::createMbrPartition(const gpt_mbr_record_t& entry)
+{
+	std::unique_ptr<PartInfo> part(new PartInfo{});
+	part->offset = storage_size_t(entry.starting_lba) << sectorSizeShift;
+	part->size = storage_size_t(entry.size_in_lba) << sectorSizeShift;
+	part->sysind = SysIndicator(entry.os_type);
+	if(identifyVolumes) {
+		ProbeWindow window;
+		if(!readWindow(device, buffer, entry.starting_lba, window)) {
 			return nullptr;
 		}
+		identify(window, *part, allSysTypes, getProbeHints(*part));
+	}
+	++mbrPartID;
+	part->name = "mbr" + String(mbrPartID);
+	if(part->systype == SysType::unknown) {
+		part->systype = getSysTypeFromIndicator(part->sysind);
+	}
+	if(part->type == Partition::Type::invalid && fatTypes[part->systype]) {
+		part->type = Partition::Type::data;
+		part->subtype = uint8_t(Partition::SubType::Data::fat);
+	}
+	return part;
+}
 
-		if(mbr.partition_record[0].os_type == EFI_PMBR_OSTYPE_EFI_GPT) {
-			// Load GPT header sector
-			if(!READ_SECTORS(buffer.get(), GPT_PRIMARY_PARTITION_TABLE_LBA, 1)) {
-				debug_e("[DD] GPT header read failed");
-				state = State::error;
-				return nullptr;
-			}
-			auto& gpt = buffer.as<gpt_header_t>();
-			if(!verifyGptHeader(gpt)) {
-				debug_e("[DD] GPT invalid");
-				state = State::error;
-				return nullptr;
-			}
+bool ScanTask::step()
+{
+	if(!started) {
+		device.editablePartitions().clear();
+		started = true;
+	}
 
-			// Scan partition table
-			numPartitionEntries = gpt.num_partition_entries;
-			sector = gpt.partition_entry_lba;
-			partitionIndex = 0;
-			entryBuffer = SectorBuffer(sectorSize, 1);
-			if(!entryBuffer) {
-				state = State::error;
-				return nullptr;
-			}
-			state = State::GPT;
-		} else {
-			mbrEntries.reset(new gpt_mbr_record_t[4]);
-			numPartitionEntries = scanMbrEntries(0);
-			state = State::MBR;
+	std::unique_ptr<PartInfo> part;
+	if(!scanner.step(part)) {
+		// Finished
+		return scanner ? false : setError(Error::BadPartitionTable);
+	}
+
+	if(part) {
+		device.editablePartitions().add(part.release());
+	}
+	setProgress(scanner.getEntryIndex(), scanner.getEntryCount());
+	return true;
+}
+
+MultiScanTask::MultiScanTask(Device* const devices[], unsigned count, bool identifyVolumes)
+	: devices(devices), count(count)
+{
+	scans.reset(new(std::nothrow) Scan[count]);
+	if(!scans) {
+		return;
+	}
+	for(unsigned i = 0; i < count; ++i) {
+		scans[i].scanner.reset(new(std::nothrow) Scanner(*devices[i], identifyVolumes));
+		if(!scans[i].scanner) {
+			scans.reset();
+			return;
 		}
 	}
+}
 
-	while(partitionIndex < numPartitionEntries) {
-		if(state == State::MBR) {
-			auto& entry = mbrEntries[partitionIndex++];
-			if(!READ_SECTORS(buffer.get(), entry.starting_lba, 1)) {
-				continue;
-			}
-			if(entry.os_type == OSTYPE_EXTENDED) {
-				numPartitionEntries = scanMbrEntries(entry.starting_lba);
-				partitionIndex = 0;
-				continue;
-			}
-			++mbrPartID;
-			storage_size_t offset = entry.starting_lba << sectorSizeShift;
-			auto part = identify(device, buffer, offset);
-			if(part == nullptr) {
-				part = new PartInfo{};
-				part->offset = offset;
-				part->size = entry.size_in_lba << sectorSizeShift;
-			}
-			part->name = "mbr" + String(mbrPartID);
-			part->sysind = SysIndicator(entry.os_type);
-			part->systype = getSysTypeFromIndicator(part->sysind);
-			if(part->type == Partition::Type::invalid && fatTypes[part->systype]) {
-				part->type = Partition::Type::data;
-				part->subtype = uint8_t(Partition::SubType::Data::fat);
-			}
-			return std::unique_ptr<PartInfo>(part);
+bool MultiScanTask::step()
+{
+	if(!scans) {
+		return setError(Error::NoMem);
+	}
+	if(finishedCount == count) {
+		return false;
+	}
+
+	if(!started) {
+		for(unsigned i = 0; i < count; ++i) {
+			devices[i]->editablePartitions().clear();
 		}
+		started = true;
+	}
 
-		if(state == State::GPT) {
-			auto entriesPerSector = sectorSize / sizeof(gpt_entry_t);
-			if(partitionIndex % entriesPerSector == 0) {
-				if(!READ_SECTORS(buffer.get(), sector++, 1)) {
-					state = State::error;
-					return nullptr;
-				}
-			}
+	while(!scans[current].scanner) {
+		current = (current + 1) % count;
+	}
+	auto& scan = scans[current];
+	auto& device = *devices[current];
+	current = (current + 1) % count;
 
-			auto entries = buffer.as<gpt_entry_t[]>();
-			auto& entry = entries[partitionIndex % entriesPerSector];
-			++partitionIndex;
-			if(!entry.partition_type_guid) {
-				continue;
-			}
+	std::unique_ptr<PartInfo> part;
+	if(scan.scanner->step(part)) {
+		if(part) {
+			device.editablePartitions().add(part.release());
+		}
+	} else {
+		scan.result = bool(*scan.scanner);
+		if(scan.result) {
+			++successCount;
+		}
+		scan.scanner.reset();
+		++finishedCount;
+	}
 
-			PartInfo* part{nullptr};
-			storage_size_t offset = entry.starting_lba << sectorSizeShift;
-			storage_size_t size = (1 + entry.ending_lba - entry.starting_lba) << sectorSizeShift;
+	setProgress(finishedCount, count);
+	return finishedCount < count;
+}
 
-			auto fulltype = GPT::SmingTypeGuid::match(entry.partition_type_guid);
-			if(fulltype) {
-				part = new PartInfo{nullptr, fulltype, offset, size};
-			} else {
-				if(!READ_SECTORS(entryBuffer.get(), entry.starting_lba, 1)) {
-					continue;
-				}
-				part = identify(device, entryBuffer, offset);
-				if(part == nullptr) {
-					part = new PartInfo{nullptr, Partition::FullType{}, offset, size};
-				}
-			}
+bool identifyPartitions(Device& device)
+{
+	const uint16_t sectorSize = device.getSectorSize();
+	if(!isValidSectorSize(sectorSize)) {
+		return false;
+	}
 
-			part->typeGuid = entry.partition_type_guid;
-			part->uniqueGuid = entry.unique_partition_guid;
-			part->name = unicode_to_oem(entry.partition_name, ARRAY_SIZE(entry.partition_name));
-			return std::unique_ptr<PartInfo>(part);
+	// Partitions with neither a known type nor a filing system indicator need probing
+	auto& pt = device.editablePartitions();
+	unsigned count{0};
+	for(auto& info : pt) {
+		auto dp = info.diskpart();
+		if(dp != nullptr && dp->systype == SysType::unknown && info.type == Partition::Type::invalid) {
+			++count;
 		}
+	}
+	if(count == 0) {
+		return true;
+	}
 
-		assert(false);
-		state = State::error;
-		return nullptr;
+	std::unique_ptr<PartInfo*[]> list(new(std::nothrow) PartInfo*[count]);
+	auto buffer = createWindowBuffer(sectorSize);
+	if(!list || !buffer) {
+		return false;
+	}
+	unsigned n{0};
+	for(auto& info : pt) {
+		auto dp = info.diskpart();
+		if(dp != nullptr && dp->systype == SysType::unknown && info.type == Partition::Type::invalid) {
+			// Only PartInfo provides DiskPart
+			list[n++] = static_cast<PartInfo*>(&info);
+		}
 	}
 
-	state = State::done;
-	return nullptr;
+	// Visit in disk order to minimise seeking
+	std::sort(&list[0], &list[count], [](auto a, auto b) { return a->offset < b->offset; });
+
+	const uint8_t sectorSizeShift = getSizeBits(sectorSize);
+	bool success{true};
+	for(unsigned i = 0; i < count; ++i) {
+		auto part = list[i];
+		ProbeWindow window;
+		if(!readWindow(device, buffer, part->offset >> sectorSizeShift, window)) {
+			success = false;
+			continue;
+		}
+		// Partition name comes from table, not volume label
+		PartInfo vol;
+		if(!identify(window, vol, allSysTypes, getProbeHints(*part))) {
+			continue;
+		}
+		part->type = vol.type;
+		part->subtype = vol.subtype;
+		part->systype = vol.systype;
+		if(vol.size != 0) {
+			part->size = vol.size;
+		}
+	}
+
+	return success;
 }
 
 } // namespace Storage::Disk
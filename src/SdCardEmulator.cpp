@@ -0,0 +1,200 @@
+/****
+ * SdCardEmulator.cpp
+ *
+ * Copyright 2022 mikee47 <mike@sillyhouse.net>
+ *
+ * This file is part of the DiskStorage Library
+ *
+ * This library is free software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation, version 3 or later.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this library.
+ * If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****/
+
+#include "include/Storage/Disk/SdCardEmulator.h"
+
+namespace Storage::Disk
+{
+namespace
+{
+SdCardModel::Config withSectorSize(SdCardModel::Config config, uint16_t sectorSize)
+{
+	config.sectorSize = sectorSize;
+	return config;
+}
+
+} // namespace
+
+uint32_t SdCardModel::getLatency(Operation op, uint64_t sector, size_t count)
+{
+	uint64_t startByte = sector * config.sectorSize;
+	uint64_t endByte = startByte + uint64_t(count) * config.sectorSize;
+
+	switch(op) {
+	case Operation::read:
+		++stats.reads;
+		return config.commandOverhead + config.readPerSector * count;
+	case Operation::write:
+		++stats.writes;
+		return config.commandOverhead + writeCost(startByte, endByte);
+	case Operation::erase:
+		++stats.erases;
+		return config.commandOverhead + eraseCost(startByte, endByte);
+	case Operation::sync:
+		return 0;
+	}
+
+	return 0;
+}
+
+uint32_t SdCardModel::writeCost(uint64_t startByte, uint64_t endByte)
+{
+	if(endByte <= startByte) {
+		return 0;
+	}
+
+	uint32_t time{0};
+
+	auto firstPage = startByte / config.pageSize;
+	auto lastPage = (endByte - 1) / config.pageSize;
+	time += (1 + lastPage - firstPage) * config.programPerPage;
+
+	// Partial pages must be read and re-programmed
+	unsigned partialPages{0};
+	if(startByte % config.pageSize != 0) {
+		++partialPages;
+	}
+	if(endByte % config.pageSize != 0 && (lastPage != firstPage || partialPages == 0)) {
+		++partialPages;
+	}
+	if(partialPages != 0) {
+		++stats.partialPageWrites;
+		time += partialPages * config.partialPagePenalty;
+	}
+
+	// Account for state of each erase block touched
+	const auto pagesPerBlock = config.eraseBlockSize / config.pageSize;
+	auto firstBlock = startByte / config.eraseBlockSize;
+	auto lastBlock = (endByte - 1) / config.eraseBlockSize;
+	for(auto block = firstBlock; block <= lastBlock; ++block) {
+		auto& state = blocks[block];
+		uint64_t blockFirstPage = block * pagesPerBlock;
+		uint32_t startPage = std::max(firstPage, blockFirstPage) - blockFirstPage;
+		uint32_t endPage = std::min(lastPage + 1, blockFirstPage + pagesPerBlock) - blockFirstPage;
+
+		if(state.erased) {
+			++stats.firstWrites;
+			time += config.firstWritePenalty;
+			state.erased = false;
+		}
+
+		// Re-writing an area already programmed forces the card to copy the block
+		if(startPage < state.writePointer) {
+			++stats.blockCopies;
+			time += config.blockCopyPenalty;
+		}
+
+		state.writePointer = std::max(state.writePointer, endPage);
+	}
+
+	return time;
+}
+
+uint32_t SdCardModel::eraseCost(uint64_t startByte, uint64_t endByte)
+{
+	if(endByte <= startByte) {
+		return 0;
+	}
+
+	uint32_t time{0};
+	auto firstBlock = startByte / config.eraseBlockSize;
+	auto lastBlock = (endByte - 1) / config.eraseBlockSize;
+	for(auto block = firstBlock; block <= lastBlock; ++block) {
+		time += config.erasePerBlock;
+		uint64_t blockStart = block * config.eraseBlockSize;
+		if(startByte <= blockStart && endByte >= blockStart + config.eraseBlockSize) {
+			blocks.erase(block);
+			continue;
+		}
+		// Partial erase requires remaining data to be preserved
+		++stats.blockCopies;
+		time += config.blockCopyPenalty;
+	}
+
+	return time;
+}
+
+SdCardEmulator::SdCardEmulator(const String& name, BlockDevice& backing, const SdCardModel::Config& config)
+	: name(name), backing(backing), model(withSectorSize(config, backing.getSectorSize()))
+{
+	if(!setSectorSize(backing.getSectorSize())) {
+		return;
+	}
+	sectorCount = backing.getSectorCount();
+	// Partitions should be aligned to allocation units
+	optimalIoSize = config.eraseBlockSize;
+}
+
+bool SdCardEmulator::injectFault(uint32_t interval, uint32_t& counter, uint64_t sector, size_t count)
+{
+	bool fail{false};
+	if(interval != 0 && ++counter >= interval) {
+		counter = 0;
+		fail = true;
+	}
+	if(faults.badSectorCount != 0 && sector < faults.badSector + faults.badSectorCount &&
+	   sector + count > faults.badSector) {
+		fail = true;
+	}
+	if(fail) {
+		++faultCount;
+	}
+	return fail;
+}
+
+bool SdCardEmulator::raw_sector_read(storage_size_t address, void* dst, size_t size)
+{
+	addLatency(LatencyModel::Operation::read, address, size);
+	if(injectFault(faults.readInterval, readCount, address, size)) {
+		return false;
+	}
+	return backing.read(storage_size_t(address) << sectorSizeShift, dst, size << sectorSizeShift);
+}
+
+bool SdCardEmulator::raw_sector_write(storage_size_t address, const void* src, size_t size)
+{
+	addLatency(LatencyModel::Operation::write, address, size);
+	if(injectFault(faults.writeInterval, writeCount, address, size)) {
+		return false;
+	}
+	return backing.write(storage_size_t(address) << sectorSizeShift, src, size << sectorSizeShift);
+}
+
+bool SdCardEmulator::raw_sector_erase_range(storage_size_t address, size_t size)
+{
+	addLatency(LatencyModel::Operation::erase, address, size);
+	return backing.erase_range(storage_size_t(address) << sectorSizeShift, storage_size_t(size) << sectorSizeShift);
+}
+
+bool SdCardEmulator::raw_sync()
+{
+	addLatency(LatencyModel::Operation::sync, 0, 0);
+	if(faults.syncFails) {
+		++faultCount;
+		return false;
+	}
+	return backing.sync();
+}
+
+bool SdCardEmulator::raw_sector_is_allocated(storage_size_t address, storage_size_t size)
+{
+	return backing.isAllocated(address << sectorSizeShift, size << sectorSizeShift);
+}
+
+} // namespace Storage::Disk
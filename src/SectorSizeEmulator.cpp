@@ -0,0 +1,131 @@
+/****
+ * SectorSizeEmulator.cpp
+ *
+ * Copyright 2022 mikee47 <mike@sillyhouse.net>
+ *
+ * This file is part of the DiskStorage Library
+ *
+ * This library is free software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation, version 3 or later.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this library.
+ * If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****/
+
+#include "include/Storage/Disk/SectorSizeEmulator.h"
+#include "include/Storage/Disk/diskdefs.h"
+#include <debug_progmem.h>
+
+namespace Storage::Disk
+{
+SectorSizeEmulator::SectorSizeEmulator(const String& name, BlockDevice& physical, uint16_t logicalSectorSize,
+									   unsigned numBuffers)
+	: name(name), physical(physical)
+{
+	auto physSize = physical.getSectorSize();
+	if(logicalSectorSize > physSize || !setSectorSize(logicalSectorSize)) {
+		debug_e("[512E] Cannot emulate %u-byte sectors on %u-byte device", logicalSectorSize, physSize);
+		return;
+	}
+	if(!physical.allocateBuffers(std::max(numBuffers, 1U))) {
+		debug_e("[512E] Buffer allocation failed");
+		return;
+	}
+
+	physicalSectorSize = physSize;
+	optimalIoSize = physical.getOptimalIoSize() ?: physSize;
+	sectorCount = physical.getSectorCount() << (getSizeBits(physSize) - sectorSizeShift);
+}
+
+unsigned SectorSizeEmulator::getPartialSectors(uint64_t offset, uint64_t length) const
+{
+	const uint32_t mask = physicalSectorSize - 1;
+	auto endOffset = offset + length;
+	bool head = (offset & mask) != 0;
+	bool tail = (endOffset & mask) != 0;
+	if(!head && !tail) {
+		return 0;
+	}
+	// Transfer contained within a single physical sector
+	if((offset & ~uint64_t(mask)) == ((endOffset - 1) & ~uint64_t(mask))) {
+		return 1;
+	}
+	return unsigned(head) + unsigned(tail);
+}
+
+bool SectorSizeEmulator::raw_sector_read(storage_size_t address, void* dst, size_t size)
+{
+	uint64_t offset = uint64_t(address) << sectorSizeShift;
+	size_t length = size << sectorSizeShift;
+	++stats.reads;
+	if(getPartialSectors(offset, length) != 0) {
+		++stats.misalignedReads;
+	}
+	return physical.read(offset, dst, length);
+}
+
+bool SectorSizeEmulator::raw_sector_write(storage_size_t address, const void* src, size_t size)
+{
+	uint64_t offset = uint64_t(address) << sectorSizeShift;
+	size_t length = size << sectorSizeShift;
+	++stats.writes;
+	auto partial = getPartialSectors(offset, length);
+	if(partial != 0) {
+		++stats.misalignedWrites;
+		stats.rmwSectors += partial;
+	}
+	return physical.write(offset, src, length);
+}
+
+bool SectorSizeEmulator::raw_sector_erase_range(storage_size_t address, size_t size)
+{
+	const uint32_t mask = physicalSectorSize - 1;
+	uint64_t offset = uint64_t(address) << sectorSizeShift;
+	uint64_t endOffset = offset + (uint64_t(size) << sectorSizeShift);
+	auto partial = getPartialSectors(offset, endOffset - offset);
+	if(partial != 0) {
+		++stats.misalignedWrites;
+		stats.rmwSectors += partial;
+	}
+
+	// Partial physical sectors must be zeroed individually
+	auto zero = [&](uint64_t start, uint64_t end) -> bool {
+		uint8_t buffer[DISK_MIN_SECTOR_SIZE]{};
+		while(start < end) {
+			auto len = std::min(end - start, uint64_t(sizeof(buffer)));
+			if(!physical.write(start, buffer, len)) {
+				return false;
+			}
+			start += len;
+		}
+		return true;
+	};
+
+	uint64_t alignedStart = align_up(offset, physicalSectorSize);
+	uint64_t alignedEnd = endOffset & ~uint64_t(mask);
+	if(alignedStart >= alignedEnd) {
+		return zero(offset, endOffset);
+	}
+	return zero(offset, alignedStart) && physical.erase_range(alignedStart, alignedEnd - alignedStart) &&
+		   zero(alignedEnd, endOffset);
+}
+
+bool SectorSizeEmulator::raw_sync()
+{
+	return physical.sync();
+}
+
+bool SectorSizeEmulator::raw_sector_is_allocated(storage_size_t address, storage_size_t size)
+{
+	const uint32_t mask = physicalSectorSize - 1;
+	uint64_t offset = (uint64_t(address) << sectorSizeShift) & ~uint64_t(mask);
+	uint64_t endOffset = align_up((uint64_t(address) + size) << sectorSizeShift, physicalSectorSize);
+	return physical.isAllocated(offset, endOffset - offset);
+}
+
+} // namespace Storage::Disk
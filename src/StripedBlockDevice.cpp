@@ -0,0 +1,300 @@
+/****
+ * StripedBlockDevice.cpp
+ *
+ * Copyright 2022 mikee47 <mike@sillyhouse.net>
+ *
+ * This file is part of the DiskStorage Library
+ *
+ * This library is free software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation, version 3 or later.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this library.
+ * If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****/
+
+#include "include/Storage/Disk/StripedBlockDevice.h"
+#include <debug_progmem.h>
+
+#ifdef ARCH_HOST
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#endif
+
+namespace Storage::Disk
+{
+#ifdef ARCH_HOST
+/*
+ * Persistent threads so that transfers don't pay the cost of thread creation.
+ * The calling thread runs job 0, worker N runs job N + 1.
+ */
+class StripedBlockDevice::WorkerPool
+{
+public:
+	using Job = std::function<bool(unsigned index)>;
+
+	WorkerPool(unsigned numThreads)
+	{
+		for(unsigned i = 0; i < numThreads; ++i) {
+			threads.emplace_back([this, i]() { worker(i + 1); });
+		}
+	}
+
+	~WorkerPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		startSignal.notify_all();
+		for(auto& t : threads) {
+			t.join();
+		}
+	}
+
+	size_t size() const
+	{
+		return threads.size();
+	}
+
+	/**
+	 * @brief Run job for indices 0 to count - 1 in parallel
+	 * @param count Must not exceed size() + 1
+	 * @retval bool true if all jobs succeeded
+	 */
+	bool run(unsigned count, const Job& job)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			currentJob = &job;
+			jobCount = count;
+			pending = count - 1;
+			success = true;
+			++generation;
+		}
+		startSignal.notify_all();
+
+		bool ok = job(0);
+
+		std::unique_lock<std::mutex> lock(mutex);
+		doneSignal.wait(lock, [this]() { return pending == 0; });
+		currentJob = nullptr;
+		return ok && success;
+	}
+
+private:
+	void worker(unsigned index)
+	{
+		unsigned seen{0};
+		std::unique_lock<std::mutex> lock(mutex);
+		for(;;) {
+			startSignal.wait(lock, [&]() { return stopping || generation != seen; });
+			if(stopping) {
+				return;
+			}
+			seen = generation;
+			if(index >= jobCount) {
+				continue;
+			}
+			auto job = currentJob;
+			lock.unlock();
+			bool ok = (*job)(index);
+			lock.lock();
+			if(!ok) {
+				success = false;
+			}
+			if(--pending == 0) {
+				doneSignal.notify_one();
+			}
+		}
+	}
+
+	std::vector<std::thread> threads;
+	std::mutex mutex;
+	std::condition_variable startSignal;
+	std::condition_variable doneSignal;
+	const Job* currentJob{nullptr};
+	unsigned jobCount{0};
+	unsigned pending{0};
+	unsigned generation{0};
+	bool success{true};
+	bool stopping{false};
+};
+#endif
+
+StripedBlockDevice::StripedBlockDevice(const String& name, uint32_t stripeSize) : name(name), stripeSize(stripeSize)
+{
+}
+
+StripedBlockDevice::~StripedBlockDevice() = default;
+
+bool StripedBlockDevice::addMember(BlockDevice& device)
+{
+	auto devSectorSize = device.getSectorSize();
+	if(members.empty()) {
+		if(!isLog2(stripeSize) || stripeSize < devSectorSize) {
+			debug_e("[STRIPE] Invalid stripe size %u", stripeSize);
+			return false;
+		}
+		if(!setSectorSize(devSectorSize)) {
+			return false;
+		}
+		stripeSectors = stripeSize >> sectorSizeShift;
+	} else if(devSectorSize != sectorSize) {
+		debug_e("[STRIPE] Sector size mismatch, %u != %u", devSectorSize, sectorSize);
+		return false;
+	}
+
+	for(auto dev : members) {
+		if(dev == &device) {
+			return false;
+		}
+	}
+
+	members.push_back(&device);
+
+	// Usable capacity is a whole number of stripes on the smallest member
+	uint64_t minSectors = device.getSectorCount();
+	for(auto dev : members) {
+		minSectors = std::min(minSectors, uint64_t(dev->getSectorCount()));
+	}
+	minSectors -= minSectors % stripeSectors;
+	sectorCount = minSectors * members.size();
+	optimalIoSize = stripeSize * members.size();
+
+	return true;
+}
+
+/*
+ * Logical sector S is in stripe S / stripeSectors.
+ * Stripes are allocated to members in turn, so member = stripe % N and the member stripe is stripe / N.
+ */
+bool StripedBlockDevice::memberTransfer(unsigned memberIndex, Operation op, uint64_t sector, uint8_t* buffer,
+										size_t count)
+{
+	auto& dev = *members[memberIndex];
+	const auto numMembers = members.size();
+
+	while(count != 0) {
+		uint64_t stripe = sector / stripeSectors;
+		uint32_t offset = sector % stripeSectors;
+		size_t n = std::min(count, size_t(stripeSectors - offset));
+		if(stripe % numMembers == memberIndex) {
+			storage_size_t addr = ((stripe / numMembers) * stripeSectors + offset) << sectorSizeShift;
+			size_t len = n << sectorSizeShift;
+			bool ok;
+			switch(op) {
+			case Operation::read:
+				ok = dev.read(addr, buffer, len);
+				break;
+			case Operation::write:
+				ok = dev.write(addr, buffer, len);
+				break;
+			case Operation::erase:
+				ok = dev.erase_range(addr, len);
+				break;
+			default:
+				ok = false;
+			}
+			if(!ok) {
+				return false;
+			}
+		}
+		sector += n;
+		count -= n;
+		if(buffer != nullptr) {
+			buffer += n << sectorSizeShift;
+		}
+	}
+
+	return true;
+}
+
+bool StripedBlockDevice::transfer(Operation op, uint64_t sector, uint8_t* buffer, size_t count)
+{
+	const unsigned numMembers = members.size();
+	if(numMembers == 0 || stripeSectors == 0) {
+		return false;
+	}
+
+	// Number of members actually involved in this request
+	uint64_t firstStripe = sector / stripeSectors;
+	uint64_t lastStripe = (sector + count - 1) / stripeSectors;
+	unsigned activeMembers = std::min(uint64_t(numMembers), 1 + lastStripe - firstStripe);
+
+#ifdef ARCH_HOST
+	if(activeMembers > 1) {
+		if(!workers || workers->size() != numMembers - 1) {
+			workers.reset(new WorkerPool(numMembers - 1));
+		}
+		return workers->run(activeMembers, [&](unsigned i) {
+			unsigned memberIndex = (firstStripe + i) % numMembers;
+			return memberTransfer(memberIndex, op, sector, buffer, count);
+		});
+	}
+#endif
+
+	for(unsigned i = 0; i < activeMembers; ++i) {
+		unsigned memberIndex = (firstStripe + i) % numMembers;
+		if(!memberTransfer(memberIndex, op, sector, buffer, count)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool StripedBlockDevice::raw_sector_read(storage_size_t address, void* dst, size_t size)
+{
+	return transfer(Operation::read, address, static_cast<uint8_t*>(dst), size);
+}
+
+bool StripedBlockDevice::raw_sector_write(storage_size_t address, const void* src, size_t size)
+{
+	// Buffer is not modified for write operations
+	return transfer(Operation::write, address, const_cast<uint8_t*>(static_cast<const uint8_t*>(src)), size);
+}
+
+bool StripedBlockDevice::raw_sector_erase_range(storage_size_t address, size_t size)
+{
+	return transfer(Operation::erase, address, nullptr, size);
+}
+
+bool StripedBlockDevice::raw_sync()
+{
+	bool res{true};
+	for(auto dev : members) {
+		res &= dev->sync();
+	}
+	return res;
+}
+
+bool StripedBlockDevice::raw_sector_is_allocated(storage_size_t address, storage_size_t size)
+{
+	const auto numMembers = members.size();
+	if(numMembers == 0 || stripeSectors == 0) {
+		return false;
+	}
+	uint64_t sector = address;
+	while(size != 0) {
+		uint64_t stripe = sector / stripeSectors;
+		uint32_t offset = sector % stripeSectors;
+		auto n = std::min(size, storage_size_t(stripeSectors - offset));
+		auto& dev = *members[stripe % numMembers];
+		storage_size_t addr = ((stripe / numMembers) * stripeSectors + offset) << sectorSizeShift;
+		if(dev.isAllocated(addr, n << sectorSizeShift)) {
+			return true;
+		}
+		sector += n;
+		size -= n;
+	}
+	return false;
+}
+
+} // namespace Storage::Disk
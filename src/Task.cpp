@@ -0,0 +1,86 @@
+/****
+ * Task.cpp
+ *
+ * Copyright 2022 mikee47 <mike@sillyhouse.net>
+ *
+ * This file is part of the DiskStorage Library
+ *
+ * This library is free software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation, version 3 or later.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this library.
+ * If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****/
+
+#include <Storage/Disk/Task.h>
+#include <Platform/System.h>
+
+namespace Storage::Disk
+{
+Error Task::run()
+{
+	if(state != State::idle) {
+		return Error::BadParam;
+	}
+
+	state = State::running;
+	while(!cancelled && step()) {
+	}
+	complete();
+	return error;
+}
+
+bool Task::start(CompleteDelegate onComplete, ProgressDelegate onProgress)
+{
+	if(state != State::idle) {
+		return false;
+	}
+
+	if(!System.queueCallback(TaskDelegate(&Task::service, this))) {
+		return false;
+	}
+
+	this->onComplete = onComplete;
+	this->onProgress = onProgress;
+	state = State::running;
+	return true;
+}
+
+void Task::service()
+{
+	if(cancelled || !step()) {
+		complete();
+		return;
+	}
+
+	if(onProgress) {
+		onProgress(*this, progress, progressTotal);
+	}
+
+	if(!System.queueCallback(TaskDelegate(&Task::service, this))) {
+		// Task queue is full
+		error = Error::NoMem;
+		complete();
+	}
+}
+
+void Task::complete()
+{
+	if(cancelled && !error) {
+		error = Error::Cancelled;
+	}
+	state = State::complete;
+
+	// Task may be destroyed by callback
+	auto callback = onComplete;
+	if(callback) {
+		callback(*this, error);
+	}
+}
+
+} // namespace Storage::Disk
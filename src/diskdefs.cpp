@@ -19,29 +19,51 @@
 
 #include <Storage/Disk/diskdefs.h>
 #include <debug_progmem.h>
+#include <cstring>
 
 namespace Storage
 {
 namespace Disk
 {
-uint32_t crc32_byte(uint32_t crc, uint8_t d)
+bool isZeroFilled(const void* data, size_t length)
 {
-	crc ^= d;
-	for(unsigned i = 0; i < 8; ++i) {
-		uint32_t mask = -(crc & 1);
-		crc = (crc >> 1) ^ (0xEDB88320 & mask);
+	auto ptr = static_cast<const uint8_t*>(data);
+
+	// Bring pointer to word alignment
+	while(length != 0 && (uintptr_t(ptr) & (sizeof(uint32_t) - 1)) != 0) {
+		if(*ptr++ != 0) {
+			return false;
+		}
+		--length;
+	}
+
+	/*
+	 * OR-reduce blocks of 64 bytes: no branches in the inner loop so the compiler can vectorise it.
+	 * Sectors are generally either entirely zero or contain data near the start, so check each
+	 * block before moving on to the next.
+	 */
+	constexpr size_t blockWords{16};
+	while(length >= blockWords * sizeof(uint32_t)) {
+		uint32_t acc{0};
+		for(unsigned i = 0; i < blockWords; ++i) {
+			uint32_t word;
+			memcpy(&word, &ptr[i * sizeof(uint32_t)], sizeof(word));
+			acc |= word;
+		}
+		if(acc != 0) {
+			return false;
+		}
+		ptr += blockWords * sizeof(uint32_t);
+		length -= blockWords * sizeof(uint32_t);
 	}
-	return crc;
-}
 
-uint32_t crc32(uint32_t bcc, const void* data, size_t length)
-{
-	bcc = ~bcc;
-	auto ptr = static_cast<const uint8_t*>(data);
 	while(length-- != 0) {
-		bcc = crc32_byte(bcc, *ptr++);
+		if(*ptr++ != 0) {
+			return false;
+		}
 	}
-	return ~bcc;
+
+	return true;
 }
 
 } // namespace Disk
@@ -2,13 +2,58 @@
 
 #include "Disk/MBR.h"
 #include "Disk/GPT.h"
+#include "Disk/ScanCache.h"
+#include "Disk/Scanner.h"
 
 #ifdef ARCH_HOST
 #include <Storage/Disk/HostFileDevice.h>
+#include <Storage/Disk/ChunkedImageDevice.h>
 #endif
 
 namespace Storage::Disk
 {
-bool scanPartitions(Device& device);
+/**
+ * @brief Populate device partition table
+ * @param device
+ * @param identifyVolumes If false, only the partition table is read.
+ * Partitions which cannot be classified from their table entry have `systype` of `SysType::unknown`.
+ * @retval bool true on success
+ */
+bool scanPartitions(Device& device, bool identifyVolumes = true);
+
+/**
+ * @brief Populate partition tables for several devices
+ * @param devices Devices to scan
+ * @param count Number of devices
+ * @param results Optional array to receive the result for each device
+ * @param identifyVolumes See `scanPartitions(Device&, bool)`
+ * @retval unsigned Number of devices successfully scanned
+ *
+ * On Host builds devices are scanned concurrently using a pool of threads,
+ * so the total time is close to that of the slowest device.
+ * Devices must therefore be independent of one another.
+ * On other architectures the scans are interleaved, reading one partition from each device in turn.
+ * Use `MultiScanTask` to perform this from the task queue without blocking the application.
+ */
+unsigned scanPartitions(Device* const devices[], unsigned count, bool results[] = nullptr,
+						bool identifyVolumes = true);
+
+/**
+ * @brief Identify volumes for partitions whose type is not yet known
+ * @param device
+ * @retval bool false if any reads failed
+ *
+ * Completes a scan made without volume identification.
+ * The first sector of each such partition is read, in ascending order of position on disk.
+ */
+bool identifyPartitions(Device& device);
+
+/**
+ * @brief Populate device partition table, using cached results if the disk is unchanged
+ * @param device
+ * @param cache Updated following a full scan. Check `ScanCache::isModified()` to see if it needs persisting.
+ * @retval bool true on success
+ */
+bool scanPartitions(Device& device, ScanCache& cache);
 
 } // namespace Storage::Disk
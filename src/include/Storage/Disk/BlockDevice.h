@@ -42,6 +42,11 @@ public:
 		return sectorSize;
 	}
 
+	uint16_t getSectorSize() const override
+	{
+		return sectorSize;
+	}
+
 	storage_size_t getSize() const override
 	{
 		return sectorCount << sectorSizeShift;
@@ -54,6 +59,37 @@ public:
 
 	bool sync() override;
 
+	/**
+	 * @brief Get size of physical sectors
+	 * @retval size_t Generally the same as `getSectorSize()`, but may be larger (e.g. 512e disks)
+	 */
+	size_t getPhysicalSectorSize() const
+	{
+		return physicalSectorSize ?: sectorSize;
+	}
+
+	/**
+	 * @brief Get preferred transfer size as reported by the device
+	 * @retval size_t Size in bytes, 0 if unknown
+	 *
+	 * Transfers and partitions aligned to this value will generally perform best.
+	 */
+	size_t getOptimalIoSize() const
+	{
+		return optimalIoSize;
+	}
+
+	/**
+	 * @brief Determine whether a region of the device contains any data
+	 * @param address Start of region, must be sector-aligned
+	 * @param size Size of region in bytes, must be sector-aligned
+	 * @retval bool false if region is known to be entirely unallocated (i.e. reads as zeroes)
+	 *
+	 * Allows scanners, verifiers and copy tools to skip over empty regions of sparse media.
+	 * Devices which cannot provide this information always return true.
+	 */
+	bool isAllocated(storage_size_t address, storage_size_t size);
+
 	/**
 	 * @brief Set number of sector buffers to use
 	 * @param numBuffers Number of buffers to allocate 1,2,4,8,etc. Pass 0 to deallocate/disable buffering.
@@ -90,11 +126,42 @@ protected:
 	virtual bool raw_sector_erase_range(storage_size_t address, size_t size) = 0;
 	virtual bool raw_sync() = 0;
 
+	/**
+	 * @brief Determine if any sector in the given range contains data
+	 * @note Default implementation assumes all sectors are allocated
+	 */
+	virtual bool raw_sector_is_allocated(storage_size_t address, storage_size_t size)
+	{
+		return true;
+	}
+
 	bool flushBuffer(Buffer& buf);
 	bool flushBuffers();
 
+	/**
+	 * @brief Write out any buffers holding unwritten data for a range of sectors
+	 */
+	bool flushBuffers(storage_size_t sector, storage_size_t count);
+
+	/**
+	 * @brief Discard any buffers for a range of sectors, including unwritten data
+	 */
+	void invalidateBuffers(storage_size_t sector, storage_size_t count);
+
+	/**
+	 * @brief Set the logical sector size for this device
+	 * @param size Sector size in bytes, see `isValidSectorSize()`
+	 * @retval bool false if size is not supported, or existing buffers could not be flushed
+	 *
+	 * Called by inherited classes during initialisation, instead of setting `sectorSize` directly.
+	 * Any existing buffers are re-allocated to match.
+	 */
+	bool setSectorSize(size_t size);
+
 	std::unique_ptr<BufferList> buffers;
 	uint64_t sectorCount{0};
+	uint32_t optimalIoSize{0};		///< Preferred transfer size in bytes, 0 if unknown
+	uint16_t physicalSectorSize{0}; ///< 0 if same as sectorSize
 	uint16_t sectorSize{defaultSectorSize};
 	uint8_t sectorSizeShift{getSizeBits(defaultSectorSize)};
 };
@@ -0,0 +1,142 @@
+/****
+ * ChunkedImageDevice.h
+ *
+ * Copyright 2022 mikee47 <mike@sillyhouse.net>
+ *
+ * This file is part of the DiskStorage Library
+ *
+ * This library is free software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation, version 3 or later.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this library.
+ * If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****/
+
+#pragma once
+
+#include "BlockDevice.h"
+#include <WString.h>
+#include <memory>
+
+namespace Storage::Disk
+{
+/**
+ * @brief Block device stored as a compressed, chunked image file
+ *
+ * The disk is divided into fixed-size chunks, each compressed individually using LZ4.
+ * The file contains a header, an index with one entry per chunk, then the chunk data.
+ * Chunks which contain only zeroes are not stored at all.
+ *
+ * Modified chunks are appended to the end of the file and their index entry updated,
+ * so the space used by the previous version becomes garbage. Use `compact()` offline to reclaim it.
+ *
+ * Recently used chunks are held decompressed in memory. Changes are written out when
+ * evicted from this cache or on `sync()`.
+ */
+class ChunkedImageDevice : public BlockDevice
+{
+public:
+	static constexpr size_t defaultChunkSize{0x10000};
+	static constexpr unsigned defaultCacheChunks{4};
+
+	struct Stats {
+		uint64_t fileSize;	///< Current size of image file
+		uint64_t dataSize;	///< Total size of stored chunk data
+		uint32_t chunkCount;  ///< Number of chunks in the disk
+		uint32_t storedCount; ///< Number of non-zero chunks
+	};
+
+	/**
+	 * @brief Create a new image file
+	 * @param name Name of device
+	 * @param filename Path to file, will be overwritten
+	 * @param size Size of disk in bytes
+	 * @param chunkSize Size of each chunk in bytes, a power of 2 and multiple of the sector size
+	 */
+	ChunkedImageDevice(const String& name, const String& filename, storage_size_t size,
+					   size_t chunkSize = defaultChunkSize);
+
+	/**
+	 * @brief Open an existing image file
+	 * @param name Name of device
+	 * @param filename Path to file
+	 */
+	ChunkedImageDevice(const String& name, const String& filename);
+
+	~ChunkedImageDevice();
+
+	String getName() const override
+	{
+		return name.c_str();
+	}
+
+	Type getType() const override
+	{
+		return Type::file;
+	}
+
+	size_t getChunkSize() const
+	{
+		return chunkSize;
+	}
+
+	/**
+	 * @brief Set number of decompressed chunks to keep in memory
+	 * @param numChunks Number of chunks, minimum 1
+	 * @retval bool false on memory allocation error, or if failed to write out existing chunks
+	 */
+	bool setCacheSize(unsigned numChunks);
+
+	/**
+	 * @brief Get information about space used by image
+	 * @note Excludes unsaved chunks in the cache
+	 */
+	Stats getStats() const;
+
+	/**
+	 * @brief Rewrite an image file discarding unused chunk data
+	 * @param filename Path to image, which must not be open
+	 * @retval bool
+	 */
+	static bool compact(const String& filename);
+
+protected:
+	bool raw_sector_read(storage_size_t address, void* dst, size_t size) override;
+	bool raw_sector_write(storage_size_t address, const void* src, size_t size) override;
+	bool raw_sector_erase_range(storage_size_t address, size_t size) override;
+	bool raw_sync() override;
+	bool raw_sector_is_allocated(storage_size_t address, storage_size_t size) override;
+
+private:
+	struct Header;
+	struct IndexEntry;
+	struct CacheEntry;
+
+	static bool readImage(int file, Header& header, std::unique_ptr<IndexEntry[]>& index);
+
+	bool init();
+	CacheEntry* findChunk(uint32_t chunk);
+	CacheEntry* loadChunk(uint32_t chunk, bool overwrite);
+	bool flushChunk(CacheEntry& entry);
+	bool readChunk(uint32_t chunk, uint8_t* buffer);
+	bool writeIndexEntry(uint32_t chunk);
+
+	CString name;
+	std::unique_ptr<IndexEntry[]> index;
+	std::unique_ptr<CacheEntry[]> cache;
+	std::unique_ptr<uint8_t[]> compressBuffer;
+	uint64_t fileSize{0};
+	uint32_t chunkCount{0};
+	uint32_t chunkSize{0};
+	uint32_t useCounter{0};
+	unsigned cacheCount{0};
+	int file{-1};
+	uint8_t chunkShift{0}; ///< Sectors per chunk, log2
+};
+
+} // namespace Storage::Disk
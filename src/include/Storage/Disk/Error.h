@@ -32,7 +32,9 @@ namespace Storage::Disk
 	XX(NoMem, "Memory allocation failed")                                                                              \
 	XX(ReadFailure, "Media read failed")                                                                               \
 	XX(WriteFailure, "Media write failed")                                                                             \
-	XX(EraseFailure, "Media erase failed")
+	XX(EraseFailure, "Media erase failed")                                                                             \
+	XX(BadPartitionTable, "Partition table is corrupt")                                                                \
+	XX(Cancelled, "Operation cancelled")
 
 enum class Error {
 #define XX(tag, ...) tag,
@@ -0,0 +1,100 @@
+/****
+ * ExtentMap.h
+ *
+ * Copyright 2022 mikee47 <mike@sillyhouse.net>
+ *
+ * This file is part of the DiskStorage Library
+ *
+ * This library is free software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation, version 3 or later.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this library.
+ * If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****/
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <map>
+
+namespace Storage::Disk
+{
+/**
+ * @brief Tracks ranges of allocated sectors
+ *
+ * Used to describe which areas of a sparse device actually contain data.
+ * Adjacent and overlapping ranges are merged so the map stays as small as possible.
+ */
+class ExtentMap
+{
+public:
+	struct Extent {
+		uint64_t start{0};
+		uint64_t count{0};
+
+		uint64_t end() const
+		{
+			return start + count;
+		}
+
+		explicit operator bool() const
+		{
+			return count != 0;
+		}
+	};
+
+	void clear()
+	{
+		map.clear();
+	}
+
+	/**
+	 * @brief Mark a range of sectors as allocated
+	 */
+	void add(uint64_t start, uint64_t count);
+
+	/**
+	 * @brief Mark a range of sectors as unallocated
+	 */
+	void remove(uint64_t start, uint64_t count);
+
+	/**
+	 * @brief Determine if any part of the given range is allocated
+	 */
+	bool intersects(uint64_t start, uint64_t count) const;
+
+	/**
+	 * @brief Determine if the given range is entirely allocated
+	 */
+	bool contains(uint64_t start, uint64_t count) const;
+
+	/**
+	 * @brief Find the first allocated extent which ends after the given sector
+	 * @retval Extent Invalid (zero-length) if there are no further extents
+	 */
+	Extent find(uint64_t sector) const;
+
+	/**
+	 * @brief Get number of distinct extents
+	 */
+	size_t count() const
+	{
+		return map.size();
+	}
+
+	/**
+	 * @brief Get total number of allocated sectors
+	 */
+	uint64_t totalSectors() const;
+
+private:
+	std::map<uint64_t, uint64_t> map; ///< start -> end (exclusive)
+};
+
+} // namespace Storage::Disk
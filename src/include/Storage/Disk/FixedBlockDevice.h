@@ -0,0 +1,293 @@
+/****
+ * FixedBlockDevice.h
+ *
+ * Copyright 2022 mikee47 <mike@sillyhouse.net>
+ *
+ * This file is part of the DiskStorage Library
+ *
+ * This library is free software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation, version 3 or later.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this library.
+ * If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****/
+
+#pragma once
+
+#include "BlockDevice.h"
+#include "diskdefs.h"
+#include <array>
+#include <utility>
+
+namespace Storage::Disk
+{
+/**
+ * @brief Block device with sector size and buffering fixed at compile time
+ * @tparam SectorSize Size of sectors in bytes
+ * @tparam Backend Class providing sector access, called directly (not virtual)
+ * @tparam NumBuffers Number of sector buffers, a power of 2. Use 0 for unbuffered (sector-aligned) access only.
+ *
+ * Use where the sector size of a device is known in advance, such as an SD card driver,
+ * to avoid the runtime geometry calculations and virtual calls made for each sector by `BlockDevice`.
+ * Sector buffers are contained within the object rather than allocated from the heap.
+ *
+ * Backend must provide these methods. Sector and count values are in units of `SectorSize`:
+ *
+ * 	String getName() const;
+ * 	Device::Type getType() const;
+ * 	uint64_t getSectorCount() const;
+ * 	bool read(uint64_t sector, void* dst, size_t count);
+ * 	bool write(uint64_t sector, const void* src, size_t count);
+ * 	bool erase(uint64_t sector, size_t count);
+ * 	bool sync();
+ *
+ * Optionally, `bool isAllocated(uint64_t sector, uint64_t count)` may also be provided.
+ */
+template <uint16_t SectorSize, class Backend, unsigned NumBuffers = 4> class FixedBlockDevice : public BlockDevice
+{
+public:
+	static_assert(SectorSize >= DISK_MIN_SECTOR_SIZE && SectorSize <= DISK_MAX_SECTOR_SIZE && isLog2(SectorSize),
+				  "Invalid sector size");
+	static_assert(NumBuffers == 0 || isLog2(NumBuffers), "NumBuffers must be a power of 2");
+
+	static constexpr uint16_t fixedSectorSize{SectorSize};
+	static constexpr uint8_t fixedSectorSizeShift{getSizeBits(SectorSize)};
+	static constexpr uint32_t sectorMask{SectorSize - 1};
+
+	/**
+	 * @brief Construct device
+	 * @param args Passed to Backend constructor
+	 */
+	template <typename... Args> FixedBlockDevice(Args&&... args) : backend(std::forward<Args>(args)...)
+	{
+		sectorSize = SectorSize;
+		sectorSizeShift = fixedSectorSizeShift;
+		sectorCount = backend.getSectorCount();
+	}
+
+	Backend& getBackend()
+	{
+		return backend;
+	}
+
+	String getName() const override
+	{
+		return backend.getName();
+	}
+
+	Type getType() const override
+	{
+		return backend.getType();
+	}
+
+	size_t getBlockSize() const override
+	{
+		return SectorSize;
+	}
+
+	uint16_t getSectorSize() const override
+	{
+		return SectorSize;
+	}
+
+	storage_size_t getSize() const override
+	{
+		return sectorCount << fixedSectorSizeShift;
+	}
+
+	bool read(storage_size_t address, void* dst, size_t size) override
+	{
+		auto dstptr = static_cast<uint8_t*>(dst);
+		uint64_t sector = address >> fixedSectorSizeShift;
+		if(((address | size) & sectorMask) == 0) {
+			// Pick up any unwritten data
+			if(!flushRange(sector, size >> fixedSectorSizeShift)) {
+				return false;
+			}
+			return backend.read(sector, dstptr, size >> fixedSectorSizeShift);
+		}
+		if constexpr(NumBuffers == 0) {
+			return false;
+		} else {
+			uint32_t offset = address & sectorMask;
+			while(size != 0) {
+				size_t chunkSize = std::min(size, size_t(SectorSize - offset));
+				auto slot = getSlot(sector, true);
+				if(slot == nullptr) {
+					return false;
+				}
+				memcpy(dstptr, &slot->data[offset], chunkSize);
+				dstptr += chunkSize;
+				size -= chunkSize;
+				++sector;
+				offset = 0;
+			}
+			return true;
+		}
+	}
+
+	bool write(storage_size_t address, const void* src, size_t size) override
+	{
+		auto srcptr = static_cast<const uint8_t*>(src);
+		uint64_t sector = address >> fixedSectorSizeShift;
+		if(((address | size) & sectorMask) == 0) {
+			// Whole sectors bypass buffers, so discard any stale copies
+			invalidateRange(sector, size >> fixedSectorSizeShift);
+			return backend.write(sector, srcptr, size >> fixedSectorSizeShift);
+		}
+		if constexpr(NumBuffers == 0) {
+			return false;
+		} else {
+			uint32_t offset = address & sectorMask;
+			while(size != 0) {
+				size_t chunkSize = std::min(size, size_t(SectorSize - offset));
+				auto slot = getSlot(sector, offset != 0 || chunkSize != SectorSize);
+				if(slot == nullptr) {
+					return false;
+				}
+				memcpy(&slot->data[offset], srcptr, chunkSize);
+				slot->dirty = true;
+				srcptr += chunkSize;
+				size -= chunkSize;
+				++sector;
+				offset = 0;
+			}
+			return true;
+		}
+	}
+
+	bool erase_range(storage_size_t address, storage_size_t size) override
+	{
+		if(((address | size) & sectorMask) != 0) {
+			return false;
+		}
+		uint64_t sector = address >> fixedSectorSizeShift;
+		uint64_t count = size >> fixedSectorSizeShift;
+		invalidateRange(sector, count);
+		return backend.erase(sector, count);
+	}
+
+	bool sync() override
+	{
+		return flushRange(0, sectorCount) && backend.sync();
+	}
+
+protected:
+	/*
+	 * Only used by BlockDevice methods which are not overridden here
+	 */
+	bool raw_sector_read(storage_size_t address, void* dst, size_t size) override
+	{
+		return backend.read(address, dst, size);
+	}
+
+	bool raw_sector_write(storage_size_t address, const void* src, size_t size) override
+	{
+		return backend.write(address, src, size);
+	}
+
+	bool raw_sector_erase_range(storage_size_t address, size_t size) override
+	{
+		return backend.erase(address, size);
+	}
+
+	bool raw_sync() override
+	{
+		return backend.sync();
+	}
+
+	bool raw_sector_is_allocated(storage_size_t address, storage_size_t size) override
+	{
+		for(auto& slot : slots) {
+			if(slot.dirty && slot.sector >= address && slot.sector < address + size) {
+				return true;
+			}
+		}
+		if constexpr(hasIsAllocated<Backend>(0)) {
+			return backend.isAllocated(address, size);
+		}
+		return true;
+	}
+
+private:
+	struct Slot {
+		static constexpr uint64_t invalid{~0ULL};
+
+		uint64_t sector{invalid};
+		bool dirty{false};
+		uint8_t data[SectorSize];
+	};
+
+	template <class T> static constexpr auto hasIsAllocated(int) -> decltype(&T::isAllocated, true)
+	{
+		return true;
+	}
+
+	template <class T> static constexpr bool hasIsAllocated(...)
+	{
+		return false;
+	}
+
+	bool flushSlot(Slot& slot)
+	{
+		if(!slot.dirty) {
+			return true;
+		}
+		if(!backend.write(slot.sector, slot.data, 1)) {
+			return false;
+		}
+		slot.dirty = false;
+		return true;
+	}
+
+	/**
+	 * @brief Get buffer for a sector
+	 * @param load false if entire sector is about to be overwritten
+	 */
+	Slot* getSlot(uint64_t sector, bool load)
+	{
+		auto& slot = slots[sector & (NumBuffers - 1)];
+		if(slot.sector == sector) {
+			return &slot;
+		}
+		if(!flushSlot(slot)) {
+			return nullptr;
+		}
+		slot.sector = Slot::invalid;
+		if(load && !backend.read(sector, slot.data, 1)) {
+			return nullptr;
+		}
+		slot.sector = sector;
+		return &slot;
+	}
+
+	bool flushRange(uint64_t sector, uint64_t count)
+	{
+		for(auto& slot : slots) {
+			if(slot.sector >= sector && slot.sector < sector + count && !flushSlot(slot)) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	void invalidateRange(uint64_t sector, uint64_t count)
+	{
+		for(auto& slot : slots) {
+			if(slot.sector >= sector && slot.sector < sector + count) {
+				slot.sector = Slot::invalid;
+				slot.dirty = false;
+			}
+		}
+	}
+
+	Backend backend;
+	std::array<Slot, NumBuffers> slots;
+};
+
+} // namespace Storage::Disk
@@ -22,9 +22,15 @@
 #include "PartInfo.h"
 #include "Error.h"
 #include "BlockDevice.h"
+#include "SectorBuffer.h"
+#include "Task.h"
+#include <vector>
 
 namespace Storage::Disk
 {
+struct gpt_header_t;
+struct gpt_entry_t;
+
 namespace GPT
 {
 #define EFI_PARTITION_TYPE_GUID_MAP(XX)                                                                                \
@@ -138,14 +144,223 @@ public:
  */
 String getTypeName(const Uuid& typeGuid);
 
+/**
+ * @brief Check signature, revision, size and CRC of a GPT header
+ * @param header
+ * @retval bool true if header is valid
+ */
+bool verifyHeader(gpt_header_t& header);
+
+/**
+ * @brief Restore a damaged GPT header or partition table from the other copy
+ * @param device
+ * @retval Error Success if both copies are valid on return
+ *
+ * The primary header and entry array follow the protective MBR at the start of the disk.
+ * A backup copy of both is kept at the end of the disk.
+ * If either copy is damaged, for example by an interrupted write, it is rewritten from the other.
+ * Only those sectors which are actually damaged are written.
+ *
+ * @see `Scanner::usedBackupGpt()`
+ */
+Error repair(BlockDevice& device);
+
+/**
+ * @brief Options for creating a GPT
+ */
+struct FormatOptions : public Disk::FormatOptions {
+	/**
+	 * @brief Number of entries in partition entry array
+	 *
+	 * At least 16 KBytes is reserved for the array regardless of this value.
+	 */
+	uint32_t numEntries{128};
+	/**
+	 * @brief Size of each partition entry, must be 128 multiplied by a power of 2
+	 */
+	uint32_t entrySize{128};
+};
+
+/**
+ * @brief Partition a device using the GPT scheme, in stages
+ *
+ * Each step discards part of the device, clears part of the start of one partition, writes a chunk of the
+ * partition entry array (to both primary and backup tables), a GPT header or the protective MBR. Chunks are up to 64 KBytes, or smaller if memory is short,
+ * so a standard 16 KByte array is written using one transfer for each copy.
+ * Discards cover up to 64 MBytes per step.
+ * On success the device partition table is populated from `table`, which is left empty.
+ *
+ * @see `Storage::Disk::formatDisk()`
+ */
+class Formatter : public Task
+{
+public:
+	/**
+	 * @brief Constructor
+	 * @param device
+	 * @param table Partitions to create. Must remain valid until task completes.
+	 * @param diskGuid
+	 * @param options
+	 */
+	Formatter(BlockDevice& device, PartitionTable& table, const Uuid& diskGuid = {},
+			  const FormatOptions& options = {});
+
+protected:
+	bool step() override;
+
+private:
+	enum class Stage {
+		init,
+		discard,
+		zeroPartitions,
+		entries,
+		backupHeader,
+		primaryHeader,
+		protectiveMbr,
+		done,
+	};
+
+	Error init();
+	bool writeSectors(uint64_t sector, const void* buff, size_t count);
+	bool writeEntries();
+	bool writeHeader(bool backup);
+
+	BlockDevice& device;
+	PartitionTable& table;
+	Uuid diskGuid;
+	FormatOptions options;
+	SectorBuffer workBuffer;
+	std::unique_ptr<PartInfo*[]> parts; // Ordered list of partitions in table
+	uint64_t driveSectors{0};
+	uint64_t backupPartitionTableSector{0};
+	uint64_t discardSector{0}; // Next sector to discard
+	uint64_t zeroOffset{0};	// Position in partition being cleared
+	uint32_t numPartitionTableSectors{0};
+	uint32_t entryArraySize{0}; // Bytes covered by checksum
+	uint32_t entrySector{0};	// Next sector of entry array to write
+	uint32_t chunkSectors{0};	// Size of workBuffer
+	uint32_t discardSectors{0}; // Sectors discarded per step
+	uint32_t bcc{0};			// Cumulative partition entry checksum
+	uint32_t progressTotal{0};
+	unsigned partCount{0};
+	unsigned zeroIndex{0}; // Next partition to clear
+	uint16_t sectorSize{0};
+	uint8_t sectorSizeShift{0};
+	Stage stage{};
+};
+
+/**
+ * @brief Change individual entries in the partition table of an existing GPT disk
+ *
+ * Only those entry array sectors containing modified entries are written, together with both headers.
+ * Checksums for each sector of the array are obtained by `load()` and combined to give the array checksum,
+ * so unchanged sectors are not read again.
+ *
+ * Changes are written to the primary entry array as they are made, but do not take effect until `commit()`.
+ * Until then `Scanner` will use the backup table.
+ * To abandon changes, call `GPT::repair()` to restore the primary table from the backup.
+ *
+ * Call `scanPartitions()` to update the device partition table after committing changes.
+ */
+class Editor
+{
+public:
+	Editor(BlockDevice& device) : device(device)
+	{
+	}
+
+	/**
+	 * @brief Read existing partition table
+	 * @retval Error `BadPartitionTable` if either copy is invalid: see `GPT::repair()`
+	 */
+	Error load();
+
+	/**
+	 * @brief Add a partition
+	 * @param part Partition to create, with size in bytes.
+	 * If offset is 0 the partition is placed in the first suitable free space, and the offset updated.
+	 * A unique GUID is generated if not provided. If type GUID is not set, `PARTITION_BASIC_DATA_GUID` is used.
+	 * @param alignment Alignment in bytes for calculated position. If 0, `getPartitionAlignment()` is used.
+	 * @retval Error
+	 */
+	Error add(PartInfo& part, uint32_t alignment = 0);
+
+	/**
+	 * @brief Remove a partition
+	 * @param uniqueGuid Identifies partition to remove
+	 * @retval Error
+	 */
+	Error remove(const Uuid& uniqueGuid);
+
+	/**
+	 * @brief Change size of a partition
+	 * @param uniqueGuid Identifies partition
+	 * @param size New size in bytes. Partition start is unchanged.
+	 * @retval Error
+	 */
+	Error resize(const Uuid& uniqueGuid, storage_size_t size);
+
+	/**
+	 * @brief Write changes to both primary and backup tables
+	 * @retval Error
+	 *
+	 * The primary table is completed first so that an interruption leaves one valid copy.
+	 */
+	Error commit();
+
+	/**
+	 * @brief Get number of partitions in table
+	 */
+	unsigned count() const
+	{
+		return entries.size();
+	}
+
+private:
+	// Partition entry in use
+	struct Entry {
+		uint64_t firstLba;
+		uint64_t lastLba;
+		Uuid uniqueGuid;
+		uint32_t index;
+	};
+
+	Entry* find(const Uuid& uniqueGuid);
+	bool isFree(uint64_t firstLba, uint64_t lastLba, const Entry* exclude) const;
+	bool readSectors(uint64_t sector, void* dst, size_t count);
+	bool writeSectors(uint64_t sector, const void* src, size_t count);
+	uint32_t getBlockLength(uint32_t block) const;
+	gpt_entry_t* readEntry(uint32_t index);
+	Error writeEntry(uint32_t index);
+	bool writeHeader(unsigned copy);
+
+	BlockDevice& device;
+	SectorBuffer headers[2];				// Primary and backup
+	SectorBuffer workBuffer;				// One block of entries
+	std::unique_ptr<uint32_t[]> blockCrc;	// CRC of each block in entry array
+	std::unique_ptr<bool[]> dirty;			// Blocks changed since last commit
+	std::vector<Entry> entries;				// Partitions in use
+	uint32_t numEntries{0};
+	uint32_t entrySize{0};
+	uint32_t entryArraySize{0};
+	uint32_t numBlocks{0};
+	uint32_t blockSectors{0};				// Sectors per block, enough for at least one entry
+	uint32_t entriesPerBlock{0};
+	uint8_t sectorSizeShift{0};
+	bool modified{false};
+};
+
 } // namespace GPT
 
 /**
  * @brief Partition a device using the GPT scheme
  * @param device
  * @param table Partitions to create
+ * @param diskGuid Identifier for disk, generated if not provided
+ * @param options Partition entry array geometry and device preparation
  * @retval Error
  */
-Error formatDisk(BlockDevice& device, GPT::PartitionTable& table, const Uuid& diskGuid = {});
+Error formatDisk(BlockDevice& device, GPT::PartitionTable& table, const Uuid& diskGuid = {},
+				 const GPT::FormatOptions& options = {});
 
 } // namespace Storage::Disk
@@ -11,11 +11,24 @@
 #pragma once
 
 #include "BlockDevice.h"
+#include "ExtentMap.h"
 
 namespace Storage::Disk
 {
 /**
  * @brief Create custom storage device using backing file
+ *
+ * On Linux, raw block devices (e.g. `/dev/sdb`, `/dev/mmcblk0`, `/dev/loop0`) may also be opened.
+ * The device geometry (size, logical/physical sector size and optimal I/O size) is then obtained from the kernel,
+ * and erase operations are passed to the device as zero-out requests (discarding where the device supports it).
+ * This requires appropriate access permissions on the device node.
+ *
+ * Backing files are sparse. On first access a map of allocated regions is built
+ * (using SEEK_DATA/SEEK_HOLE where supported) and kept up to date on writes and erases.
+ * Reads from unallocated regions are satisfied directly from this map without accessing the file.
+ *
+ * Optionally, sectors containing only zeroes may be converted into holes instead of being
+ * written (see `setZeroDetect`) so that images remain sparse.
  */
 class HostFileDevice : public BlockDevice
 {
@@ -25,6 +38,7 @@ public:
 	 * @param name Name of device
 	 * @param filename Path to file
 	 * @param size Size of device in bytes
+	 * @note If filename refers to a block device then it is never resized: `size` just limits the usable area.
 	 */
 	HostFileDevice(const String& name, const String& filename, storage_size_t size);
 
@@ -46,9 +60,40 @@ public:
 
 	Type getType() const override
 	{
-		return Type::file;
+		return blockDevice ? Type::disk : Type::file;
+	}
+
+	/**
+	 * @brief Enable/disable zero-sector detection
+	 * @param enable true to punch holes instead of writing zero-filled sectors
+	 *
+	 * When enabled, each sector written is checked and any runs of all-zero sectors are
+	 * de-allocated from the backing file rather than written.
+	 * This keeps images sparse during formatting or wiping operations.
+	 * Has no effect on raw block devices.
+	 */
+	void setZeroDetect(bool enable)
+	{
+		zeroDetect = enable;
 	}
 
+	bool getZeroDetect() const
+	{
+		return zeroDetect;
+	}
+
+	/**
+	 * @brief Create an independent copy of an image file using a reflink
+	 * @param source Existing image file
+	 * @param dest File to create (will be truncated if it exists)
+	 * @retval bool false if the filesystem does not support reflinks, in which case nothing is created
+	 *
+	 * On filesystems such as btrfs and XFS this shares data blocks between the files,
+	 * so completes almost instantly regardless of image size.
+	 * If this fails, use an `OverlayDevice` instead.
+	 */
+	static bool clone(const String& source, const String& dest);
+
 protected:
 	bool raw_sector_read(storage_size_t address, void* dst, size_t size) override;
 	bool raw_sector_write(storage_size_t address, const void* src, size_t size) override;
@@ -57,10 +102,21 @@ protected:
 	{
 		return true;
 	}
+	bool raw_sector_is_allocated(storage_size_t address, storage_size_t size) override;
 
 private:
+	void initBlockDevice(storage_size_t maxSize);
+	void loadExtents();
+	bool readData(uint64_t sector, void* dst, size_t count);
+	bool writeData(uint64_t sector, const void* src, size_t count);
+	bool punchHole(uint64_t sector, size_t count);
+
 	CString name;
+	ExtentMap extents;
 	int file{-1};
+	bool blockDevice{false};
+	bool extentsLoaded{false};
+	bool zeroDetect{false};
 };
 
 } // namespace Storage::Disk
@@ -0,0 +1,95 @@
+/****
+ * LatencyModel.h
+ *
+ * Copyright 2022 mikee47 <mike@sillyhouse.net>
+ *
+ * This file is part of the DiskStorage Library
+ *
+ * This library is free software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation, version 3 or later.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this library.
+ * If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****/
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+namespace Storage::Disk
+{
+/**
+ * @brief Interface for simulating device access times
+ *
+ * Emulated devices call this for each low-level operation and accumulate the result,
+ * so benchmarks can be run deterministically without real hardware.
+ */
+class LatencyModel
+{
+public:
+	enum class Operation {
+		read,
+		write,
+		erase,
+		sync,
+	};
+
+	virtual ~LatencyModel()
+	{
+	}
+
+	/**
+	 * @brief Obtain simulated time for an operation
+	 * @param op Operation being performed
+	 * @param sector First sector
+	 * @param count Number of sectors
+	 * @retval uint32_t Time in microseconds
+	 */
+	virtual uint32_t getLatency(Operation op, uint64_t sector, size_t count) = 0;
+};
+
+/**
+ * @brief Latency model using fixed per-command and per-sector costs
+ */
+class SimpleLatencyModel : public LatencyModel
+{
+public:
+	struct Cost {
+		uint32_t setup;		///< Fixed cost per command (us)
+		uint32_t perSector; ///< Transfer cost per sector (us)
+	};
+
+	struct Timings {
+		Cost read;
+		Cost write;
+		Cost erase;
+		uint32_t sync; ///< Cost of flushing device caches (us)
+	};
+
+	/**
+	 * @brief Approximate timings for a typical class 10 SD card using 512-byte sectors
+	 */
+	static constexpr Timings sdCard{
+		.read = {500, 25},
+		.write = {1000, 50},
+		.erase = {2000, 1},
+		.sync = 0,
+	};
+
+	SimpleLatencyModel(const Timings& timings) : timings(timings)
+	{
+	}
+
+	uint32_t getLatency(Operation op, uint64_t sector, size_t count) override;
+
+private:
+	Timings timings;
+};
+
+} // namespace Storage::Disk
@@ -0,0 +1,61 @@
+/****
+ * Lz4.h
+ *
+ * Copyright 2022 mikee47 <mike@sillyhouse.net>
+ *
+ * This file is part of the DiskStorage Library
+ *
+ * This library is free software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation, version 3 or later.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this library.
+ * If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****/
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+/**
+ * @brief Minimal codec for the LZ4 block format
+ *
+ * Output is compatible with the reference implementation (`LZ4_decompress_safe`, `lz4 -B`)
+ * so images may be inspected with standard tools. Only single blocks are handled, without frame headers.
+ */
+namespace Storage::Disk::LZ4
+{
+/**
+ * @brief Get worst-case compressed size
+ */
+constexpr size_t compressBound(size_t size)
+{
+	return size + size / 255 + 16;
+}
+
+/**
+ * @brief Compress a block of data
+ * @param src Data to compress
+ * @param srcSize Number of bytes in src
+ * @param dst Output buffer
+ * @param dstCapacity Size of output buffer
+ * @retval size_t Size of compressed data, 0 if it does not fit in dst
+ */
+size_t compress(const void* src, size_t srcSize, void* dst, size_t dstCapacity);
+
+/**
+ * @brief Decompress a block of data
+ * @param src Compressed data
+ * @param srcSize Number of bytes in src
+ * @param dst Output buffer
+ * @param dstCapacity Size of output buffer
+ * @retval int Size of decompressed data, negative if input is malformed or output buffer too small
+ */
+int decompress(const void* src, size_t srcSize, void* dst, size_t dstCapacity);
+
+} // namespace Storage::Disk::LZ4
@@ -61,8 +61,9 @@ public:
  * @brief Partition a device using the MBR scheme
  * @param device
  * @param table Partitions to create
+ * @param options Device preparation
  * @retval Error
  */
-Error formatDisk(BlockDevice& device, MBR::PartitionTable& table);
+Error formatDisk(BlockDevice& device, MBR::PartitionTable& table, const FormatOptions& options = {});
 
 } // namespace Storage::Disk
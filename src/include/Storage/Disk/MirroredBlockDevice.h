@@ -0,0 +1,166 @@
+/****
+ * MirroredBlockDevice.h
+ *
+ * Copyright 2022 mikee47 <mike@sillyhouse.net>
+ *
+ * This file is part of the DiskStorage Library
+ *
+ * This library is free software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation, version 3 or later.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this library.
+ * If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****/
+
+#pragma once
+
+#include "BlockDevice.h"
+#include <vector>
+
+namespace Storage::Disk
+{
+/**
+ * @brief Block device which keeps identical copies of data on several member devices (RAID-1)
+ *
+ * Writes go to all members. Reads are distributed between members according to the `ReadPolicy`.
+ *
+ * Each member has a bitmap of dirty regions which is updated whenever a write to that member fails,
+ * or is skipped because the member is offline. Dirty regions are never used to satisfy reads,
+ * and can be brought up to date by calling `resync()`.
+ *
+ * All members must have the same sector size. Capacity is determined by the smallest member.
+ * Member devices must remain valid for the lifetime of this device.
+ */
+class MirroredBlockDevice : public BlockDevice
+{
+public:
+	enum class ReadPolicy {
+		nearest,	///< Use member whose last access was closest to the requested sector (minimises seeks)
+		roundRobin, ///< Use each member in turn
+	};
+
+	/**
+	 * @brief Construct a mirrored device
+	 * @param name Name of device
+	 * @param regionSize Granularity of dirty region tracking in bytes, must be a power of 2
+	 */
+	MirroredBlockDevice(const String& name, uint32_t regionSize = 0x100000U) : name(name), regionSize(regionSize)
+	{
+	}
+
+	/**
+	 * @brief Maximum number of member devices
+	 */
+	static constexpr unsigned maxMembers{32};
+
+	/**
+	 * @brief Add a member device
+	 * @param device
+	 * @param synced true if device already contains a copy of the data, otherwise it is marked entirely dirty
+	 * @retval bool false if device is incompatible or already present, or there are already `maxMembers`
+	 */
+	bool addMember(BlockDevice& device, bool synced = true);
+
+	size_t getMemberCount() const
+	{
+		return members.size();
+	}
+
+	/**
+	 * @brief Take a member offline or bring it back online
+	 *
+	 * Offline members receive no I/O. Regions written whilst a member is offline are marked dirty.
+	 */
+	void setOnline(unsigned index, bool online);
+
+	bool isOnline(unsigned index) const
+	{
+		return index < members.size() && members[index].online;
+	}
+
+	/**
+	 * @brief Get number of regions on a member which require resynchronisation
+	 */
+	uint32_t getDirtyRegionCount(unsigned index) const
+	{
+		return index < members.size() ? members[index].dirtyCount : 0;
+	}
+
+	/**
+	 * @brief Copy dirty regions from up-to-date members
+	 * @param maxRegions Limit number of regions copied in this call, 0 for no limit
+	 * @retval bool true if all online members are now fully synchronised
+	 *
+	 * Limiting the number of regions allows resynchronisation to proceed in the background.
+	 */
+	bool resync(unsigned maxRegions = 0);
+
+	void setReadPolicy(ReadPolicy policy)
+	{
+		readPolicy = policy;
+	}
+
+	String getName() const override
+	{
+		return name.c_str();
+	}
+
+	Type getType() const override
+	{
+		return Type::disk;
+	}
+
+protected:
+	bool raw_sector_read(storage_size_t address, void* dst, size_t size) override;
+	bool raw_sector_write(storage_size_t address, const void* src, size_t size) override;
+	bool raw_sector_erase_range(storage_size_t address, size_t size) override;
+	/**
+	 * @brief Sync all online members
+	 * @retval bool true only if every online member succeeded
+	 *
+	 * Members which fail are marked entirely dirty, since it is not known which writes were lost.
+	 */
+	bool raw_sync() override;
+	bool raw_sector_is_allocated(storage_size_t address, storage_size_t size) override;
+
+private:
+	struct Member {
+		BlockDevice* device;
+		std::unique_ptr<uint8_t[]> dirty; ///< One bit per region
+		uint64_t lastSector{0};
+		uint32_t dirtyCount{0};
+		bool online{true};
+
+		bool isDirty(uint32_t region) const
+		{
+			return dirty[region / 8] & (1 << (region % 8));
+		}
+
+		void setDirty(uint32_t region, bool state);
+	};
+
+	uint32_t getRegionCount() const
+	{
+		return (sectorCount + regionSectors - 1) / regionSectors;
+	}
+
+	bool isClean(const Member& m, uint64_t sector, size_t count) const;
+	void markDirty(Member& m, uint64_t sector, size_t count);
+	void markAllDirty(Member& m);
+	int selectReader(uint64_t sector, size_t count, uint32_t excludeMask);
+	bool writeAll(uint64_t sector, const void* src, size_t count);
+
+	CString name;
+	std::vector<Member> members;
+	uint32_t regionSize;
+	uint32_t regionSectors{0};
+	unsigned nextReader{0};
+	ReadPolicy readPolicy{ReadPolicy::nearest};
+};
+
+} // namespace Storage::Disk
@@ -0,0 +1,117 @@
+/****
+ * OverlayDevice.h
+ *
+ * Copyright 2022 mikee47 <mike@sillyhouse.net>
+ *
+ * This file is part of the DiskStorage Library
+ *
+ * This library is free software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation, version 3 or later.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this library.
+ * If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****/
+
+#pragma once
+
+#include "BlockDevice.h"
+#include "ExtentMap.h"
+
+namespace Storage::Disk
+{
+/**
+ * @brief Copy-on-write block device layered over a read-only base device
+ *
+ * Reads come from the base device unless the sector has been modified.
+ * Writes and erases go to a separate delta device at the same location, and are recorded in a sector map.
+ * The delta device should be sparse (e.g. a new `HostFileDevice` or `RamBlockDevice`) so that it only
+ * consumes space for modified sectors. This allows a large 'golden' image to be cloned instantly.
+ *
+ * On Host builds, `HostFileDevice::clone()` should be tried first as filesystems supporting reflinks
+ * can produce an independent copy of the image at similar cost.
+ *
+ * To resume a session, the sector map must be kept on a separate map device (e.g. a small file or partition).
+ * It is written there on each `sync()`, once the delta content it refers to has been synced.
+ * Without a map device changes in the delta are only accessible until this device is destroyed,
+ * unless written to the base with `commit()` or elsewhere with `flatten()`.
+ *
+ * Base, delta and map devices must remain valid for the lifetime of this device.
+ */
+class OverlayDevice : public BlockDevice
+{
+public:
+	/**
+	 * @brief Construct an overlay
+	 * @param name Name of device
+	 * @param base Device providing initial content, never written to except by `commit()`
+	 * @param delta Device to receive modifications, must be at least as large as base and have the same sector size
+	 * @param mapDevice Optional device to persist the sector map
+	 */
+	OverlayDevice(const String& name, BlockDevice& base, BlockDevice& delta, BlockDevice* mapDevice = nullptr);
+
+	/**
+	 * @brief Restore sector map saved by a previous session
+	 * @retval bool false if there is no map device or it does not contain a valid map for this device
+	 *
+	 * The map is empty on failure. For a new delta device this is expected and the overlay may be used as normal.
+	 */
+	bool loadMap();
+
+	/**
+	 * @brief Write all modified sectors to the base device then discard them from the delta
+	 * @retval bool false on error, in which case map is retained and commit may be re-attempted
+	 */
+	bool commit();
+
+	/**
+	 * @brief Write complete (merged) content to another device
+	 * @param target Must be at least as large as this device, with the same sector size
+	 * @retval bool
+	 *
+	 * Unallocated regions are skipped, or erased if the target has data there.
+	 */
+	bool flatten(BlockDevice& target);
+
+	/**
+	 * @brief Get the map of sectors held in the delta device
+	 */
+	const ExtentMap& getMap() const
+	{
+		return map;
+	}
+
+	String getName() const override
+	{
+		return name.c_str();
+	}
+
+	Type getType() const override
+	{
+		return base.getType();
+	}
+
+protected:
+	bool raw_sector_read(storage_size_t address, void* dst, size_t size) override;
+	bool raw_sector_write(storage_size_t address, const void* src, size_t size) override;
+	bool raw_sector_erase_range(storage_size_t address, size_t size) override;
+	bool raw_sync() override;
+	bool raw_sector_is_allocated(storage_size_t address, storage_size_t size) override;
+
+private:
+	bool copy(BlockDevice& src, BlockDevice& dst, uint64_t sector, uint64_t count);
+	bool saveMap();
+
+	CString name;
+	BlockDevice& base;
+	BlockDevice& delta;
+	BlockDevice* mapDevice;
+	ExtentMap map;
+	bool mapModified{false};
+};
+
+} // namespace Storage::Disk
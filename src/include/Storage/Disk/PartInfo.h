@@ -25,12 +25,17 @@
 
 namespace Storage::Disk
 {
+class BlockDevice;
+class SectorBuffer;
+
 /*
  * While not a native feature of file systems, operating systems should also aim to align partitions correctly,
  * which avoids excessive read-modify-write cycles.
  * A typical practice for personal computers is to have each partition aligned to start at a 1 MiB (= 1,048,576 bytes) mark,
  * which covers all common SSD page and block size scenarios, as it is divisible by all commonly used sizes
  * - 1 MiB, 512 KiB, 128 KiB, 4 KiB, and 512 B.
+ *
+ * This is the default, but devices with larger erase blocks may require more: see `getPartitionAlignment()`.
  */
 constexpr uint32_t PARTITION_ALIGN{0x100000U};
 
@@ -43,9 +48,15 @@ enum class SysType : uint8_t {
 	fat16,
 	fat32,
 	exfat,
+	ntfs,
+	ext2,
+	ext3,
+	ext4,
+	f2fs,
+	littlefs,
 };
 
-using SysTypes = BitSet<uint8_t, SysType>;
+using SysTypes = BitSet<uint16_t, SysType>;
 
 static constexpr SysTypes fatTypes = SysType::fat12 | SysType::fat16 | SysType::fat32 | SysType::exfat;
 
@@ -60,6 +71,7 @@ enum SysIndicator {
 	SI_IFS = 0x07,
 	SI_EXFAT = 0x07,
 	SI_FAT32X = 0x0c, ///< FAT32 with LBA
+	SI_LINUX = 0x83,  ///< Any native Linux filing system
 };
 
 inline SysType getSysTypeFromIndicator(SysIndicator si)
@@ -134,6 +146,7 @@ class BasePartitionTable : public PartInfo::OwnedList
  * @param firstAvailableBlock First block number which may be allocated to a partition
  * @param totalAvailableBlocks Number of blocks available for partition allocation
  * @param blockSize Size of a block
+ * @param alignment Partition alignment in bytes, a multiple of blockSize
  * @retval Error
  *
  * For each partition:
@@ -144,7 +157,64 @@ class BasePartitionTable : public PartInfo::OwnedList
  * On success, partition entries are ordered by position.
  */
 Error validate(BasePartitionTable& table, storage_size_t firstAvailableBlock, storage_size_t totalAvailableBlocks,
-			   uint32_t blockSize);
+			   uint32_t blockSize, uint32_t alignment = PARTITION_ALIGN);
+
+/**
+ * @brief Get recommended partition alignment for a device
+ * @param device
+ * @retval uint32_t Alignment in bytes
+ *
+ * SD cards, for example, have allocation units of 4 MiB or more and perform an internal read-modify-write
+ * of the whole unit for any partial update. The device's optimal I/O size, if reported,
+ * is combined with `PARTITION_ALIGN` so partitions start on an allocation unit boundary.
+ *
+ * Filing system formatters may also use this value to align their data areas within a partition.
+ */
+uint32_t getPartitionAlignment(const BlockDevice& device);
+
+/**
+ * @brief Device preparation options for `formatDisk()`, common to all partitioning schemes
+ */
+struct FormatOptions {
+	/**
+	 * @brief Discard entire device contents using `erase_range()` before writing partition table
+	 */
+	bool discard{false};
+	/**
+	 * @brief Number of bytes to zero at the start of each partition
+	 *
+	 * Removes any stale filing system signatures. Rounded up to whole sectors and limited to partition size.
+	 */
+	uint32_t zeroSize{0};
+	/**
+	 * @brief Partition alignment in bytes, a multiple of the sector size
+	 *
+	 * If 0, `getPartitionAlignment()` is used.
+	 */
+	uint32_t alignment{0};
+};
+
+/**
+ * @brief Zero the start of a partition, as specified by `FormatOptions::zeroSize`
+ * @param device
+ * @param part Partition to clear
+ * @param size Number of bytes to zero
+ * @param buffer Working buffer, determines largest transfer size. Contents are overwritten.
+ * @retval Error
+ *
+ * Nothing is written if the device reports the area as unallocated, since it already reads as zeroes.
+ */
+Error zeroPartitionStart(BlockDevice& device, const Partition::Info& part, uint32_t size, SectorBuffer& buffer);
+
+/**
+ * @brief Zero the next chunk at the start of a partition
+ * @param offset Position within partition, 0 to begin. Updated on success, and no less than `size` when finished.
+ * @retval Error
+ *
+ * Writes at most one buffer, so large areas may be cleared over several calls.
+ */
+Error zeroPartitionStart(BlockDevice& device, const Partition::Info& part, uint32_t size, SectorBuffer& buffer,
+						 uint64_t& offset);
 
 } // namespace Storage::Disk
 
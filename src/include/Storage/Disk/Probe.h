@@ -0,0 +1,113 @@
+/****
+ * Probe.h
+ *
+ * Copyright 2022 mikee47 <mike@sillyhouse.net>
+ *
+ * This file is part of the DiskStorage Library
+ *
+ * This library is free software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation, version 3 or later.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this library.
+ * If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****/
+
+#pragma once
+
+#include "PartInfo.h"
+
+namespace Storage::Disk
+{
+/**
+ * @brief Data read from the start of a volume for identification
+ */
+struct ProbeWindow {
+	const uint8_t* data;   ///< Start of volume
+	size_t length;		   ///< Number of bytes available
+	storage_size_t offset; ///< Location of volume on device
+	uint16_t sectorSize;   ///< Device sector size
+
+	/**
+	 * @brief Get pointer to data at given position
+	 * @retval T* nullptr if data is not within window
+	 * @note Data may be unaligned
+	 */
+	template <typename T> const T* at(size_t pos) const
+	{
+		return (pos + sizeof(T) <= length) ? reinterpret_cast<const T*>(&data[pos]) : nullptr;
+	}
+};
+
+/**
+ * @brief Volume identification function
+ * @param window Data from start of volume
+ * @param part Partition to update if volume is recognised
+ * @retval bool true if volume recognised
+ *
+ * On success, a probe sets `part.systype` and if known, `part.type` and `part.subtype`.
+ * The volume size and label (`part.size` and `part.name`) are also updated where available.
+ */
+using ProbeCallback = bool (*)(const ProbeWindow& window, PartInfo& part);
+
+/**
+ * @brief Describes a filing system probe
+ */
+struct Probe {
+	SysType systype;		///< Volume type recognised by this probe, used to order probes by hint
+	uint32_t windowSize;	///< Number of bytes examined from start of volume
+	ProbeCallback callback; ///< Identification function
+};
+
+/**
+ * @brief Maximum window size read for volume identification
+ */
+constexpr uint32_t maxProbeWindowSize{0x10000};
+
+/**
+ * @brief Add a probe to the registry
+ * @retval bool false if registry is full or window size exceeds `maxProbeWindowSize`
+ *
+ * FAT, exFAT, NTFS, ext2/3/4, F2FS and LittleFS probes are built in.
+ */
+bool registerProbe(const Probe& probe);
+
+/**
+ * @brief Get number of bytes which must be read to run all registered probes
+ */
+uint32_t getProbeWindowSize();
+
+/**
+ * @brief Identify a volume using registered probes
+ * @param window Data read from start of volume, generally `getProbeWindowSize()` bytes
+ * @param part Updated with results
+ * @param candidates Only run probes for these types
+ * @param hints Run probes for these types first
+ * @retval bool true if volume recognised
+ *
+ * All probes are run against the same data, so no further reads are required.
+ */
+bool identify(const ProbeWindow& window, PartInfo& part, SysTypes candidates, SysTypes hints = 0);
+
+/**
+ * @brief Get candidate types for a partition from its GPT type or MBR indicator
+ */
+SysTypes getProbeHints(const DiskPart& part);
+
+/**
+ * @brief Volume types which may be found in sector 0 of a disk with a boot signature
+ *
+ * Partition tables share the signature so only boot sector filing systems are considered.
+ */
+static constexpr SysTypes bootSectorTypes = fatTypes | SysType::ntfs;
+
+/**
+ * @brief All volume types
+ */
+static constexpr SysTypes allSysTypes{uint16_t(~0U)};
+
+} // namespace Storage::Disk
@@ -0,0 +1,117 @@
+/****
+ * RamBlockDevice.h
+ *
+ * Copyright 2022 mikee47 <mike@sillyhouse.net>
+ *
+ * This file is part of the DiskStorage Library
+ *
+ * This library is free software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation, version 3 or later.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this library.
+ * If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****/
+
+#pragma once
+
+#include "BlockDevice.h"
+#include "LatencyModel.h"
+
+namespace Storage::Disk
+{
+/**
+ * @brief Block device using sparse RAM storage
+ *
+ * Memory is allocated in fixed-size chunks only when first written to,
+ * so large devices can be emulated provided they are mostly empty.
+ * Unwritten areas read as zeroes.
+ *
+ * Intended for testing and benchmarking. A `LatencyModel` may be attached to accumulate
+ * simulated access times, giving deterministic results independent of the host system.
+ */
+class RamBlockDevice : public BlockDevice
+{
+public:
+	/**
+	 * @brief Construct a RAM device
+	 * @param name Name of device
+	 * @param size Size of device in bytes
+	 * @param sectorSize Size of a sector, must be a power of 2
+	 * @param chunkSize Allocation unit in bytes, rounded up to a multiple of sectorSize
+	 *
+	 * If parameters are invalid then the device will have zero size.
+	 */
+	RamBlockDevice(const String& name, storage_size_t size, uint16_t sectorSize = defaultSectorSize,
+				   size_t chunkSize = 4096);
+
+	String getName() const override
+	{
+		return name.c_str();
+	}
+
+	Type getType() const override
+	{
+		return Type::sysmem;
+	}
+
+	/**
+	 * @brief Set model to use for simulating access times
+	 * @param model Pass nullptr to disable
+	 * @note Model is not owned and must remain valid for the lifetime of this device
+	 */
+	void setLatencyModel(LatencyModel* model)
+	{
+		latencyModel = model;
+	}
+
+	/**
+	 * @brief Get total simulated time spent in device operations
+	 * @retval uint64_t Time in microseconds
+	 */
+	uint64_t getElapsedTime() const
+	{
+		return elapsedTime;
+	}
+
+	void resetElapsedTime()
+	{
+		elapsedTime = 0;
+	}
+
+	/**
+	 * @brief Get amount of memory currently allocated for storage
+	 */
+	size_t getAllocatedSize() const
+	{
+		return chunks.size() * chunkSize;
+	}
+
+protected:
+	bool raw_sector_read(storage_size_t address, void* dst, size_t size) override;
+	bool raw_sector_write(storage_size_t address, const void* src, size_t size) override;
+	bool raw_sector_erase_range(storage_size_t address, size_t size) override;
+	bool raw_sync() override;
+	bool raw_sector_is_allocated(storage_size_t address, storage_size_t size) override;
+
+private:
+	void addLatency(LatencyModel::Operation op, uint64_t sector, size_t count)
+	{
+		if(latencyModel != nullptr) {
+			elapsedTime += latencyModel->getLatency(op, sector, count);
+		}
+	}
+
+	CString name;
+	std::map<uint64_t, std::unique_ptr<uint8_t[]>> chunks;
+	LatencyModel* latencyModel{nullptr};
+	uint64_t elapsedTime{0};
+	uint32_t chunkSize{0};
+	uint8_t chunkShift{0};
+};
+
+} // namespace Storage::Disk
@@ -0,0 +1,92 @@
+/****
+ * ScanCache.h
+ *
+ * Copyright 2022 mikee47 <mike@sillyhouse.net>
+ *
+ * This file is part of the DiskStorage Library
+ *
+ * This library is free software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation, version 3 or later.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this library.
+ * If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****/
+
+#pragma once
+
+#include <Storage/Device.h>
+
+namespace Storage::Disk
+{
+/**
+ * @brief Keeps the results of a partition scan in an application-supplied buffer
+ *
+ * Scanning a disk reads the partition table plus the first sector of most partitions.
+ * Where this is on the critical startup path, results may be stored (e.g. in RTC memory or a key-value slot)
+ * and re-used on the next boot if the disk has not changed.
+ *
+ * Cache contents are keyed on the GPT disk GUID and header CRC, or for MBR disks the disk signature
+ * and a CRC of the boot sector, so checking them requires only one or two sector reads.
+ * The device size and sector size are also checked.
+ *
+ * Volume information obtained by probing partitions is also cached.
+ * If a partition is re-formatted without changing the partition table, call `invalidate()`.
+ *
+ * Disks with MBR extended partitions, or with a damaged primary GPT, are not cached.
+ *
+ * @see `Storage::Disk::scanPartitions(Device&, ScanCache&)`
+ */
+class ScanCache
+{
+public:
+	/**
+	 * @brief Construct cache
+	 * @param buffer Contents from a previous session, or zeroes
+	 * @param bufferSize Size of buffer in bytes
+	 */
+	ScanCache(void* buffer, size_t bufferSize) : buffer(static_cast<uint8_t*>(buffer)), bufferSize(bufferSize)
+	{
+	}
+
+	/**
+	 * @brief Populate device partition table from cache
+	 * @retval bool true on success, false if cache is empty or does not match the disk
+	 */
+	bool load(Device& device);
+
+	/**
+	 * @brief Store current device partition table in cache
+	 * @retval bool false if the buffer is too small or the disk cannot be identified
+	 */
+	bool save(Device& device);
+
+	/**
+	 * @brief Discard cache contents
+	 */
+	void invalidate();
+
+	/**
+	 * @brief Determine whether the buffer contents have changed and should be persisted
+	 */
+	bool isModified() const
+	{
+		return modified;
+	}
+
+	/**
+	 * @brief Get number of bytes in buffer which need to be persisted
+	 */
+	size_t getUsedSize() const;
+
+private:
+	uint8_t* buffer;
+	size_t bufferSize;
+	bool modified{false};
+};
+
+} // namespace Storage::Disk
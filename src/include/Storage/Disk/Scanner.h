@@ -22,12 +22,15 @@
 #include <Storage/Device.h>
 #include "PartInfo.h"
 #include "SectorBuffer.h"
+#include "Task.h"
 
 namespace Storage
 {
 namespace Disk
 {
 struct gpt_mbr_record_t;
+struct gpt_header_t;
+struct gpt_entry_t;
 
 /**
  * @brief Class to iterate through disk partition tables
@@ -37,7 +40,13 @@ struct gpt_mbr_record_t;
 class Scanner
 {
 public:
-	Scanner(Device& device);
+	/**
+	 * @brief Constructor
+	 * @param device Device to scan
+	 * @param identifyVolumes If true, the first sector of each partition is read to identify the filing system.
+	 * If false, only the partition table is read. `Storage::Disk::identifyPartitions()` may be used later.
+	 */
+	Scanner(Device& device, bool identifyVolumes = true);
 	~Scanner();
 
 	/**
@@ -45,33 +54,188 @@ public:
 	 */
 	std::unique_ptr<PartInfo> next();
 
+	/**
+	 * @brief Perform a bounded amount of work towards the next partition entry
+	 * @param part Set if a partition was found
+	 * @retval bool false when scan is complete or has failed
+	 *
+	 * Each call reads at most one chunk of the GPT entry array, or one partition table sector
+	 * and one volume window. GPT entries are returned only once the whole array has been verified.
+	 */
+	bool step(std::unique_ptr<PartInfo>& part);
+
 	explicit operator bool() const
 	{
 		return state != State::error;
 	}
 
+	/**
+	 * @brief Determine whether partitions were read from the backup GPT
+	 *
+	 * This happens if the primary GPT is damaged.
+	 * Call `GPT::repair()` to restore it.
+	 */
+	bool usedBackupGpt() const
+	{
+		return backupGpt;
+	}
+
+	/**
+	 * @brief Determine whether an MBR extended partition was found
+	 *
+	 * Logical partitions are located by following the chain of Extended Boot Records (EBRs).
+	 * Only the first extended partition is used.
+	 */
+	bool hasExtendedPartition() const
+	{
+		return extendedPartition;
+	}
+
+	/**
+	 * @brief Get index of next partition table entry to be read
+	 */
+	uint32_t getEntryIndex() const
+	{
+		return partitionIndex;
+	}
+
+	/**
+	 * @brief Get number of entries in the partition table being read
+	 *
+	 * For MBR disks this is the number of primary partitions, including any extended partition.
+	 */
+	uint32_t getEntryCount() const
+	{
+		return numPartitionEntries;
+	}
+
 private:
 	enum class State {
 		idle,
-		MBR, ///< Master Boot Record
-		GPT, ///< GUID Partition Table
+		MBR,		///< Master Boot Record
+		GPTEntries, ///< Reading and verifying GUID Partition Table entries
+		GPT,		///< GUID Partition Table
 		error,
 		done,
 	};
 
-	unsigned scanMbrEntries(uint32_t baseLba);
+	bool start(std::unique_ptr<PartInfo>& part);
+	bool readSectors(void* dst, uint64_t sector, size_t count);
+	unsigned scanMbrEntries();
+	std::unique_ptr<PartInfo> nextMbrPartition();
+	std::unique_ptr<PartInfo> createMbrPartition(const gpt_mbr_record_t& entry);
+	bool readEbr(gpt_mbr_record_t& entry);
+	bool loadGpt(uint64_t lba);
+	bool readGptEntries(const gpt_header_t& gpt);
+	bool readGptChunk();
+	bool gptFailed();
+	std::unique_ptr<PartInfo> nextGptPartition();
 
 	Device& device;
 	SectorBuffer buffer;
-	SectorBuffer entryBuffer; // GPT
+	SectorBuffer entryBuffer;						// GPT: partition entries
+	PartInfo::OwnedList pending;					// GPT: partitions found in verified entry array
 	State state{};
-	uint64_t sector{0};								// GPT
+	uint64_t entryLba{0};							// GPT: first sector of partition entry array
+	uint32_t entryArraySectors{0};					// GPT: size of partition entry array
+	uint32_t entrySize{0};							// GPT: size of each partition entry
+	uint32_t entryChunkSectors{0};					// GPT: sectors read at a time from entry array
+	uint32_t entryArrayCrc{0};						// GPT: expected CRC of partition entry array
+	uint32_t entryCrc{0};							// GPT: CRC of entries read so far
 	std::unique_ptr<gpt_mbr_record_t[]> mbrEntries; // MBR
-	uint16_t numPartitionEntries{0};
-	uint16_t partitionIndex{0};
+	std::unique_ptr<uint32_t[]> ebrHistory;			// MBR: EBRs visited, to detect loops
+	uint32_t extendedBase{0};						// MBR: first sector of extended partition
+	uint32_t extendedSize{0};						// MBR: sectors in extended partition
+	uint32_t ebrLba{0};								// MBR: next EBR to read, 0 if none
+	uint16_t ebrCount{0};							// MBR: number of EBRs visited
+	uint32_t numPartitionEntries{0};
+	uint32_t partitionIndex{0};
 	uint16_t mbrPartID{0};
 	uint16_t sectorSize{0};
 	uint8_t sectorSizeShift{0};
+	bool backupGpt{false};		   // GPT: primary damaged, using backup
+	bool extendedPartition{false}; // MBR
+	bool identifyVolumes;
+};
+
+/**
+ * @brief Populate a device partition table in stages
+ *
+ * Each step performs one `Scanner::step()`, so reads at most one chunk of the partition table
+ * or one partition table sector and one volume window.
+ * Completes with `Error::BadPartitionTable` if the scan fails.
+ *
+ * @see `Storage::Disk::scanPartitions()`
+ */
+class ScanTask : public Task
+{
+public:
+	ScanTask(Device& device, bool identifyVolumes = true) : device(device), scanner(device, identifyVolumes)
+	{
+	}
+
+	const Scanner& getScanner() const
+	{
+		return scanner;
+	}
+
+protected:
+	bool step() override;
+
+private:
+	Device& device;
+	Scanner scanner;
+	bool started{false};
+};
+
+/**
+ * @brief Populate partition tables for several devices in stages
+ *
+ * Each step reads the next partition from one device, taking each unfinished device in turn,
+ * so when started from the task queue the scans are interleaved with each other and with the rest of the application.
+ * Progress is reported as the number of devices finished.
+ *
+ * The array of devices must remain valid until the task completes.
+ *
+ * @see `Storage::Disk::scanPartitions(Device* const[], unsigned, bool[], bool)`
+ */
+class MultiScanTask : public Task
+{
+public:
+	MultiScanTask(Device* const devices[], unsigned count, bool identifyVolumes = true);
+
+	/**
+	 * @brief Determine whether a device was scanned successfully
+	 */
+	bool getResult(unsigned index) const
+	{
+		return scans && index < count && scans[index].result;
+	}
+
+	/**
+	 * @brief Get number of devices successfully scanned
+	 */
+	unsigned getSuccessCount() const
+	{
+		return successCount;
+	}
+
+protected:
+	bool step() override;
+
+private:
+	struct Scan {
+		std::unique_ptr<Scanner> scanner; ///< nullptr when finished
+		bool result{false};
+	};
+
+	Device* const* devices;
+	std::unique_ptr<Scan[]> scans;
+	unsigned count;
+	unsigned current{0};
+	unsigned finishedCount{0};
+	unsigned successCount{0};
+	bool started{false};
 };
 
 } // namespace Disk
@@ -0,0 +1,228 @@
+/****
+ * SdCardEmulator.h
+ *
+ * Copyright 2022 mikee47 <mike@sillyhouse.net>
+ *
+ * This file is part of the DiskStorage Library
+ *
+ * This library is free software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation, version 3 or later.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this library.
+ * If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****/
+
+#pragma once
+
+#include "BlockDevice.h"
+#include "LatencyModel.h"
+
+namespace Storage::Disk
+{
+/**
+ * @brief Latency model approximating the behaviour of an SD card
+ *
+ * Cards program flash in pages and erase in much larger allocation units (erase blocks).
+ * Within an erase block, sequential writes are cheap but the following are expensive:
+ *
+ * - Writes which do not start or end on a page boundary require the page to be read and re-programmed
+ * - Writes to an area of an erase block which has already been written require the card
+ *   to copy the entire block (read-modify-write)
+ * - The first write to a freshly erased block incurs additional setup time
+ *
+ * The model tracks the state of each erase block to account for these.
+ */
+class SdCardModel : public LatencyModel
+{
+public:
+	struct Config {
+		uint16_t sectorSize;		 ///< Logical sector size
+		uint32_t pageSize;			 ///< Flash programming unit
+		uint32_t eraseBlockSize;	 ///< Allocation unit
+		uint32_t commandOverhead;	///< Fixed cost per command (us)
+		uint32_t readPerSector;		 ///< Read transfer cost (us)
+		uint32_t programPerPage;	 ///< Page program cost (us)
+		uint32_t partialPagePenalty; ///< Extra cost for each partially written page (us)
+		uint32_t blockCopyPenalty;   ///< Cost of read-modify-write for an erase block (us)
+		uint32_t firstWritePenalty;  ///< Extra cost for first write after erase (us)
+		uint32_t erasePerBlock;		 ///< Cost to erase a block (us)
+	};
+
+	/**
+	 * @brief Approximate figures for a typical class 10 card with 4 MiB allocation units
+	 */
+	static constexpr Config defaultConfig{
+		.sectorSize = 512,
+		.pageSize = 16384,
+		.eraseBlockSize = 4 * 1024 * 1024,
+		.commandOverhead = 100,
+		.readPerSector = 20,
+		.programPerPage = 1600,
+		.partialPagePenalty = 800,
+		.blockCopyPenalty = 150000,
+		.firstWritePenalty = 2000,
+		.erasePerBlock = 3000,
+	};
+
+	struct Stats {
+		uint32_t reads;
+		uint32_t writes;
+		uint32_t erases;
+		uint32_t partialPageWrites; ///< Writes not aligned to page boundaries
+		uint32_t blockCopies;		///< Erase block read-modify-write cycles
+		uint32_t firstWrites;		///< Writes to freshly erased blocks
+	};
+
+	SdCardModel(const Config& config = defaultConfig) : config(config)
+	{
+	}
+
+	uint32_t getLatency(Operation op, uint64_t sector, size_t count) override;
+
+	const Config& getConfig() const
+	{
+		return config;
+	}
+
+	const Stats& getStats() const
+	{
+		return stats;
+	}
+
+	/**
+	 * @brief Clear statistics and return all erase blocks to initial (erased) state
+	 */
+	void reset()
+	{
+		stats = {};
+		blocks.clear();
+	}
+
+private:
+	struct BlockState {
+		uint32_t writePointer{0}; ///< Page following highest page written since erase
+		bool erased{true};
+	};
+
+	uint32_t writeCost(uint64_t startByte, uint64_t endByte);
+	uint32_t eraseCost(uint64_t startByte, uint64_t endByte);
+
+	Config config;
+	Stats stats{};
+	std::map<uint64_t, BlockState> blocks; ///< By erase block; absent entries are in erased state
+};
+
+/**
+ * @brief Emulates an SD card using another block device for storage
+ *
+ * All I/O is passed to the backing device (e.g. a `RamBlockDevice` or `HostFileDevice`)
+ * whilst an `SdCardModel` accumulates the time a real card would take.
+ * Use this to evaluate buffer counts, write coalescing and partition alignment without hardware.
+ *
+ * Read and write failures may be injected using `setFaults()` to test error handling.
+ * Failed operations do not reach the backing device.
+ */
+class SdCardEmulator : public BlockDevice
+{
+public:
+	/**
+	 * @brief Fault injection settings
+	 *
+	 * Faults are deterministic so tests are repeatable.
+	 */
+	struct Faults {
+		uint32_t readInterval{0};	///< Fail every Nth read command, 0 to disable
+		uint32_t writeInterval{0};	///< Fail every Nth write command, 0 to disable
+		uint64_t badSector{0};		///< First sector of range which always fails
+		uint64_t badSectorCount{0}; ///< Number of bad sectors, 0 to disable
+		bool syncFails{false};		///< Fail all sync requests
+	};
+
+	/**
+	 * @brief Construct an emulated card
+	 * @param name Name of device
+	 * @param backing Device providing storage, must remain valid for the lifetime of this device
+	 * @param config Card characteristics. Sector size is taken from the backing device.
+	 */
+	SdCardEmulator(const String& name, BlockDevice& backing,
+				   const SdCardModel::Config& config = SdCardModel::defaultConfig);
+
+	String getName() const override
+	{
+		return name.c_str();
+	}
+
+	Type getType() const override
+	{
+		return Type::sdcard;
+	}
+
+	SdCardModel& getModel()
+	{
+		return model;
+	}
+
+	/**
+	 * @brief Get total simulated time spent in device operations
+	 * @retval uint64_t Time in microseconds
+	 */
+	uint64_t getElapsedTime() const
+	{
+		return elapsedTime;
+	}
+
+	void resetElapsedTime()
+	{
+		elapsedTime = 0;
+	}
+
+	/**
+	 * @brief Set faults to be injected
+	 *
+	 * Command counters are reset, so with an interval of N the Nth command from now fails.
+	 */
+	void setFaults(const Faults& faults)
+	{
+		this->faults = faults;
+		readCount = writeCount = 0;
+	}
+
+	/**
+	 * @brief Get number of operations failed by fault injection
+	 */
+	uint32_t getFaultCount() const
+	{
+		return faultCount;
+	}
+
+protected:
+	bool raw_sector_read(storage_size_t address, void* dst, size_t size) override;
+	bool raw_sector_write(storage_size_t address, const void* src, size_t size) override;
+	bool raw_sector_erase_range(storage_size_t address, size_t size) override;
+	bool raw_sync() override;
+	bool raw_sector_is_allocated(storage_size_t address, storage_size_t size) override;
+
+private:
+	void addLatency(LatencyModel::Operation op, uint64_t sector, size_t count)
+	{
+		elapsedTime += model.getLatency(op, sector, count);
+	}
+
+	bool injectFault(uint32_t interval, uint32_t& counter, uint64_t sector, size_t count);
+
+	CString name;
+	BlockDevice& backing;
+	SdCardModel model;
+	uint64_t elapsedTime{0};
+	Faults faults;
+	uint32_t readCount{0};
+	uint32_t writeCount{0};
+	uint32_t faultCount{0};
+};
+
+} // namespace Storage::Disk
@@ -21,6 +21,7 @@
 
 #include <cstdint>
 #include <memory>
+#include <new>
 
 namespace Storage
 {
@@ -38,7 +39,28 @@ public:
 
 	SectorBuffer(size_t sectorSize, size_t sectorCount) : mSectorCount(sectorCount), mSize(sectorSize * sectorCount)
 	{
-		reset(new uint8_t[mSize]);
+		reset(new(std::nothrow) uint8_t[mSize]);
+		if(!*this) {
+			mSectorCount = mSize = 0;
+		}
+	}
+
+	/**
+	 * @brief Allocate the largest buffer available, up to a limit
+	 * @param sectorSize
+	 * @param maxSectors Preferred buffer size
+	 * @param minSectors Smallest acceptable buffer size, a power of 2. Size is always a multiple of this value.
+	 * @retval bool false if minimum size could not be allocated
+	 */
+	bool allocate(size_t sectorSize, size_t maxSectors, size_t minSectors = 1)
+	{
+		for(size_t count = maxSectors; count >= minSectors; count /= 2) {
+			*this = SectorBuffer(sectorSize, count & ~(minSectors - 1));
+			if(*this) {
+				return true;
+			}
+		}
+		return false;
 	}
 
 	template <typename T> T& as()
@@ -0,0 +1,95 @@
+/****
+ * SectorSizeEmulator.h
+ *
+ * Copyright 2022 mikee47 <mike@sillyhouse.net>
+ *
+ * This file is part of the DiskStorage Library
+ *
+ * This library is free software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation, version 3 or later.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this library.
+ * If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****/
+
+#pragma once
+
+#include "BlockDevice.h"
+
+namespace Storage::Disk
+{
+/**
+ * @brief Presents a device with large physical sectors as having smaller logical sectors
+ *
+ * Typically used to provide 512-byte sectors ('512e') on 4Kn media for software which requires them.
+ * Transfers which do not cover whole physical sectors are handled by read-modify-write
+ * using the physical device's sector buffers.
+ *
+ * The number of such transfers is recorded so the cost of misaligned access can be evaluated.
+ * Partitions and filesystem structures aligned to `getPhysicalSectorSize()` avoid this overhead.
+ */
+class SectorSizeEmulator : public BlockDevice
+{
+public:
+	struct Stats {
+		uint32_t reads;
+		uint32_t writes;
+		uint32_t misalignedReads;
+		uint32_t misalignedWrites; ///< Includes erases
+		uint32_t rmwSectors;	   ///< Physical sectors partially written
+	};
+
+	/**
+	 * @brief Construct an emulator
+	 * @param name Name of device
+	 * @param physical Device to access, with sector size larger than logicalSectorSize
+	 * @param logicalSectorSize Sector size to present
+	 * @param numBuffers Number of sector buffers to allocate on physical device, see `BlockDevice::allocateBuffers()`
+	 */
+	SectorSizeEmulator(const String& name, BlockDevice& physical, uint16_t logicalSectorSize = defaultSectorSize,
+					   unsigned numBuffers = 4);
+
+	String getName() const override
+	{
+		return name.c_str();
+	}
+
+	Type getType() const override
+	{
+		return physical.getType();
+	}
+
+	const Stats& getStats() const
+	{
+		return stats;
+	}
+
+	void resetStats()
+	{
+		stats = {};
+	}
+
+protected:
+	bool raw_sector_read(storage_size_t address, void* dst, size_t size) override;
+	bool raw_sector_write(storage_size_t address, const void* src, size_t size) override;
+	bool raw_sector_erase_range(storage_size_t address, size_t size) override;
+	bool raw_sync() override;
+	bool raw_sector_is_allocated(storage_size_t address, storage_size_t size) override;
+
+private:
+	/**
+	 * @brief Get number of physical sectors only partially covered by a transfer
+	 */
+	unsigned getPartialSectors(uint64_t offset, uint64_t length) const;
+
+	CString name;
+	BlockDevice& physical;
+	Stats stats{};
+};
+
+} // namespace Storage::Disk
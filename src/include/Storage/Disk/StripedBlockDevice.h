@@ -0,0 +1,102 @@
+/****
+ * StripedBlockDevice.h
+ *
+ * Copyright 2022 mikee47 <mike@sillyhouse.net>
+ *
+ * This file is part of the DiskStorage Library
+ *
+ * This library is free software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation, version 3 or later.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this library.
+ * If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****/
+
+#pragma once
+
+#include "BlockDevice.h"
+#include <memory>
+#include <vector>
+
+namespace Storage::Disk
+{
+/**
+ * @brief Block device which stripes data across several member devices (RAID-0)
+ *
+ * Consecutive stripes are allocated to members in turn, so large transfers are spread
+ * across all members. On Host builds, requests spanning several members are performed
+ * in parallel by a pool of worker threads, one for each additional member.
+ *
+ * All members must have the same sector size. Capacity is determined by the smallest member.
+ * Member devices must remain valid for the lifetime of this device.
+ */
+class StripedBlockDevice : public BlockDevice
+{
+public:
+	/**
+	 * @brief Construct a striped device
+	 * @param name Name of device
+	 * @param stripeSize Size of each stripe in bytes, must be a power of 2 and a multiple of the sector size
+	 */
+	StripedBlockDevice(const String& name, uint32_t stripeSize);
+
+	~StripedBlockDevice();
+
+	/**
+	 * @brief Add a member device
+	 * @retval bool false if device is incompatible or already present
+	 * @note Members must be added before the device is used, since adding a member changes the layout
+	 */
+	bool addMember(BlockDevice& device);
+
+	/**
+	 * @brief Get number of member devices
+	 */
+	size_t getMemberCount() const
+	{
+		return members.size();
+	}
+
+	String getName() const override
+	{
+		return name.c_str();
+	}
+
+	Type getType() const override
+	{
+		return Type::disk;
+	}
+
+protected:
+	bool raw_sector_read(storage_size_t address, void* dst, size_t size) override;
+	bool raw_sector_write(storage_size_t address, const void* src, size_t size) override;
+	bool raw_sector_erase_range(storage_size_t address, size_t size) override;
+	bool raw_sync() override;
+	bool raw_sector_is_allocated(storage_size_t address, storage_size_t size) override;
+
+private:
+	enum class Operation {
+		read,
+		write,
+		erase,
+	};
+
+	bool transfer(Operation op, uint64_t sector, uint8_t* buffer, size_t count);
+	bool memberTransfer(unsigned memberIndex, Operation op, uint64_t sector, uint8_t* buffer, size_t count);
+
+#ifdef ARCH_HOST
+	class WorkerPool;
+	std::unique_ptr<WorkerPool> workers;
+#endif
+	CString name;
+	std::vector<BlockDevice*> members;
+	uint32_t stripeSize;
+	uint32_t stripeSectors{0};
+};
+
+} // namespace Storage::Disk
@@ -0,0 +1,154 @@
+/****
+ * Task.h
+ *
+ * Copyright 2022 mikee47 <mike@sillyhouse.net>
+ *
+ * This file is part of the DiskStorage Library
+ *
+ * This library is free software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation, version 3 or later.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this library.
+ * If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****/
+
+#pragma once
+
+#include "Error.h"
+#include <Delegate.h>
+
+namespace Storage::Disk
+{
+/**
+ * @brief Base class for disk operations which may be performed in stages
+ *
+ * Scanning or formatting a large or slow device can take some time.
+ * Calling `start()` performs the operation from the task queue, a bounded amount of I/O at a time,
+ * so networking and watchdog servicing are not held up.
+ * Alternatively, `run()` performs the whole operation before returning.
+ *
+ * The task object must remain valid until `onComplete` has been called, even after `cancel()`,
+ * since the next step is already queued.
+ */
+class Task
+{
+public:
+	/**
+	 * @brief Called after each step
+	 * @param task
+	 * @param done Amount of work completed
+	 * @param total Total amount of work, may change as the operation proceeds
+	 */
+	using ProgressDelegate = Delegate<void(Task& task, uint32_t done, uint32_t total)>;
+
+	/**
+	 * @brief Called when task finishes
+	 * @param task
+	 * @param err Result of the operation
+	 */
+	using CompleteDelegate = Delegate<void(Task& task, Error err)>;
+
+	virtual ~Task()
+	{
+	}
+
+	/**
+	 * @brief Perform the entire operation now
+	 * @retval Error
+	 */
+	Error run();
+
+	/**
+	 * @brief Perform the operation in steps from the task queue
+	 * @param onComplete Called when operation finishes
+	 * @param onProgress Called after each step
+	 * @retval bool false if task is already running or has finished
+	 */
+	bool start(CompleteDelegate onComplete, ProgressDelegate onProgress = nullptr);
+
+	/**
+	 * @brief Stop a running task
+	 *
+	 * The operation is abandoned before the next step, and completes with `Error::Cancelled`.
+	 * When started asynchronously this happens from the task queue, so the task must not be destroyed
+	 * until `onComplete` is called.
+	 * The device may be left in an inconsistent state.
+	 */
+	void cancel()
+	{
+		cancelled = true;
+	}
+
+	bool isRunning() const
+	{
+		return state == State::running;
+	}
+
+	bool isComplete() const
+	{
+		return state == State::complete;
+	}
+
+	Error getError() const
+	{
+		return error;
+	}
+
+	uint32_t getProgress() const
+	{
+		return progress;
+	}
+
+	uint32_t getProgressTotal() const
+	{
+		return progressTotal;
+	}
+
+protected:
+	/**
+	 * @brief Implementations perform one bounded unit of work
+	 * @retval bool true if there is more to do, false on completion or error
+	 */
+	virtual bool step() = 0;
+
+	/**
+	 * @brief Record an error, which stops the task
+	 * @retval bool Always false, for convenience when returning from `step()`
+	 */
+	bool setError(Error err)
+	{
+		error = err;
+		return false;
+	}
+
+	void setProgress(uint32_t done, uint32_t total)
+	{
+		progress = done;
+		progressTotal = total;
+	}
+
+private:
+	enum class State {
+		idle,
+		running,
+		complete,
+	};
+
+	void service();
+	void complete();
+
+	CompleteDelegate onComplete;
+	ProgressDelegate onProgress;
+	uint32_t progress{0};
+	uint32_t progressTotal{0};
+	Error error{};
+	State state{};
+	bool cancelled{false};
+};
+
+} // namespace Storage::Disk
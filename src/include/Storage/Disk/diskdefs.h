@@ -23,17 +23,27 @@
 #include <cstddef>
 #include <sys/pgmspace.h>
 #include <Data/Uuid.h>
+#include <Storage/Types.h>
 
 #define DISK_MIN_SECTOR_SIZE 512
 
+#ifndef DISK_MAX_SECTOR_SIZE
+#define DISK_MAX_SECTOR_SIZE 4096
+#endif
+
 #define FSTYPE_FAT 0x2020202020544146ULL   // "FAT     " 46 41 54 20 20 20 20 20
 #define FSTYPE_FAT32 0x2020203233544146ULL // "FAT32   " 46 41 54 33 32 20 20 20
 #define FSTYPE_EXFAT 0x2020205441465845ULL // "EXFAT   " 45 58 46 41 54 20 20 20
 
 #define N_SEC_TRACK 63 // Sectors per track for determination of drive CHS
 #define GPT_ITEMS 128  // Number of GPT table size (>=128, sector aligned)
+#define GPT_MIN_ENTRY_ARRAY_SIZE 16384 // Minimum space reserved for GPT partition entry array
+#define FORMAT_MAX_TRANSFER_SIZE 0x10000 // Largest buffer used for bulk writes when formatting
+#define FORMAT_MAX_DISCARD_SIZE 0x4000000 // Largest region discarded in one formatting step
 
-#define OSTYPE_EXTENDED 0x05
+#define OSTYPE_EXTENDED 0x05		// Extended partition, CHS addressing
+#define OSTYPE_EXTENDED_LBA 0x0F	// Extended partition, LBA addressing
+#define OSTYPE_EXTENDED_LINUX 0x85 // Linux extended partition
 
 namespace Storage
 {
@@ -61,7 +71,38 @@ template <typename T> auto getBlockCount(T byteCount, uint32_t blockSize)
 	return (byteCount + blockSize - 1) / blockSize;
 }
 
+/**
+ * @brief Determine whether a sector size is supported
+ * @param size Size of sector in bytes
+ * @retval bool true if size is a power of 2 between DISK_MIN_SECTOR_SIZE and DISK_MAX_SECTOR_SIZE
+ */
+inline bool isValidSectorSize(size_t size)
+{
+	return size >= DISK_MIN_SECTOR_SIZE && size <= DISK_MAX_SECTOR_SIZE && isLog2(size);
+}
+
+/**
+ * @brief Determine whether a block of memory contains only zeroes
+ * @param data Start of block
+ * @param length Number of bytes to check
+ * @retval bool true if all bytes are zero
+ */
+bool isZeroFilled(const void* data, size_t length);
+
+/**
+ * @brief Update raw (non-inverted) CRC32 value with one byte
+ */
 uint32_t crc32_byte(uint32_t crc, uint8_t d);
+
+/**
+ * @brief Calculate CRC32 (as used by GPT, zlib, etc.)
+ * @param bcc Result of previous call to continue a calculation, 0 to start
+ * @param data
+ * @param length
+ * @retval uint32_t
+ *
+ * Uses hardware acceleration where available, otherwise a slice-by-8 table.
+ */
 uint32_t crc32(uint32_t bcc, const void* data, size_t length);
 
 inline uint32_t crc32(const void* data, size_t length)
@@ -69,5 +110,47 @@ inline uint32_t crc32(const void* data, size_t length)
 	return crc32(0, data, length);
 }
 
+/**
+ * @brief Obtain CRC32 of two adjacent blocks from their individual values
+ * @param crc1 CRC of first block
+ * @param crc2 CRC of second block
+ * @param length2 Length of second block
+ * @retval uint32_t CRC of first block followed by second
+ *
+ * Allows a checksum to be updated when part of the data changes without reading the rest.
+ */
+uint32_t crc32_combine(uint32_t crc1, uint32_t crc2, uint64_t length2);
+
+/**
+ * @brief Incremental CRC32 calculation
+ *
+ * Allows checksums to be calculated as data is read in blocks.
+ */
+class Crc32
+{
+public:
+	Crc32(uint32_t initial = 0) : crc(initial)
+	{
+	}
+
+	void update(const void* data, size_t length)
+	{
+		crc = crc32(crc, data, length);
+	}
+
+	uint32_t value() const
+	{
+		return crc;
+	}
+
+	void reset(uint32_t initial = 0)
+	{
+		crc = initial;
+	}
+
+private:
+	uint32_t crc;
+};
+
 } // namespace Disk
 } // namespace Storage
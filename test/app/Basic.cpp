@@ -78,8 +78,12 @@ public:
 			partitions.add("custom partition type", SysType::unknown, 0, 2, part5guid, myTypeGuid);
 			// partitions.add(new Partition::Info{"custom partition type", Partition::SubType::Data::littlefs, 0, 2});
 
+			// Will be checking generated image file later, so clear BPB for each partition
+			GPT::FormatOptions options;
+			options.zeroSize = 512;
+
 			auto dev = createDevice(GPT_DEVICE_FILENAME, 100 * DIV_MB);
-			auto err = Disk::formatDisk(*dev, partitions, myDiskGuid);
+			auto err = Disk::formatDisk(*dev, partitions, myDiskGuid, options);
 			Serial << "formatDisk: " << err << endl;
 			for(auto& p : partitions) {
 				Serial << p << endl;
@@ -87,12 +91,6 @@ public:
 			Debug::listPartitions(Serial, *dev);
 			checkPartitions(*dev, 5);
 
-			// Will be checking generated image file later, so clear BPB for each partition
-			for(auto part : dev->partitions()) {
-				uint8_t buffer[512]{};
-				CHECK(part.write(0, buffer, sizeof(buffer)));
-			}
-
 			delete dev;
 		}
 
@@ -133,6 +131,32 @@ public:
 
 			delete dev;
 		}
+
+		TEST_CASE("Sparse")
+		{
+			auto dev = openDevice(GPT_DEVICE_FILENAME);
+			REQUIRE(Disk::scanPartitions(*dev));
+			// Partition BPBs were cleared, so partitioned area should be mostly empty
+			auto lastPart = *dev->partitions().begin();
+			for(auto part : dev->partitions()) {
+				lastPart = part;
+			}
+			CHECK(dev->isAllocated(0, 512));
+			CHECK(!dev->isAllocated(lastPart.address() + 4096, lastPart.size() - 4096));
+
+			uint8_t buffer[512];
+			memset(buffer, 0xa5, sizeof(buffer));
+			storage_size_t offset = lastPart.address() + 8192;
+			CHECK(dev->write(offset, buffer, sizeof(buffer)));
+			CHECK(dev->sync());
+			CHECK(dev->isAllocated(offset, sizeof(buffer)));
+			CHECK(dev->erase_range(offset, sizeof(buffer)));
+			CHECK(!dev->isAllocated(offset, sizeof(buffer)));
+			CHECK(dev->read(offset, buffer, sizeof(buffer)));
+			CHECK(buffer[0] == 0 && memcmp(buffer, &buffer[1], sizeof(buffer) - 1) == 0);
+
+			delete dev;
+		}
 	}
 
 	void checkPartitions(Device& dev, unsigned expectedPartitionCount)
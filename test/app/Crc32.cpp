@@ -0,0 +1,94 @@
+#include <Storage/Disk/diskdefs.h>
+#include <SmingTest.h>
+
+using namespace Storage::Disk;
+
+namespace
+{
+// Original bit-by-bit implementation, for reference
+uint32_t crc32_bitwise(uint32_t bcc, const void* data, size_t length)
+{
+	bcc = ~bcc;
+	auto ptr = static_cast<const uint8_t*>(data);
+	while(length-- != 0) {
+		bcc ^= *ptr++;
+		for(unsigned i = 0; i < 8; ++i) {
+			uint32_t mask = -(bcc & 1);
+			bcc = (bcc >> 1) ^ (0xEDB88320 & mask);
+		}
+	}
+	return ~bcc;
+}
+
+} // namespace
+
+class Crc32Test : public TestGroup
+{
+public:
+	Crc32Test() : TestGroup(_F("CRC32"))
+	{
+	}
+
+	void execute() override
+	{
+		// Size of a GPT partition entry array
+		constexpr size_t bufSize{16384};
+		std::unique_ptr<uint8_t[]> buffer(new uint8_t[bufSize]);
+		os_get_random(buffer.get(), bufSize);
+
+		TEST_CASE("Verify")
+		{
+			REQUIRE_EQ(crc32("123456789", 9), 0xCBF43926);
+			for(unsigned offset = 0; offset < 8; ++offset) {
+				for(size_t len : {0, 1, 7, 15, 63, 64, 65, 100, 511, 512, 4095}) {
+					auto crc = crc32(0x12345678, &buffer[offset], len);
+					REQUIRE_EQ(crc, crc32_bitwise(0x12345678, &buffer[offset], len));
+				}
+			}
+
+			Crc32 crc;
+			crc.update(&buffer[0], 100);
+			crc.update(&buffer[100], bufSize - 100);
+			REQUIRE_EQ(crc.value(), crc32(buffer.get(), bufSize));
+		}
+
+		TEST_CASE("Combine")
+		{
+			auto whole = crc32(buffer.get(), bufSize);
+			for(size_t len1 : {0, 1, 100, 512, 8192, 16383, 16384}) {
+				auto len2 = bufSize - len1;
+				auto crc1 = crc32(buffer.get(), len1);
+				auto crc2 = crc32(&buffer[len1], len2);
+				REQUIRE_EQ(crc32_combine(crc1, crc2, len2), whole);
+			}
+		}
+
+		TEST_CASE("Benchmark")
+		{
+			constexpr unsigned iterations{16};
+
+			auto start = micros();
+			uint32_t crc1{0};
+			for(unsigned i = 0; i < iterations; ++i) {
+				crc1 = crc32_bitwise(crc1, buffer.get(), bufSize);
+			}
+			auto bitwiseTime = micros() - start;
+
+			start = micros();
+			uint32_t crc2{0};
+			for(unsigned i = 0; i < iterations; ++i) {
+				crc2 = crc32(crc2, buffer.get(), bufSize);
+			}
+			auto fastTime = micros() - start;
+
+			REQUIRE_EQ(crc1, crc2);
+			Serial << _F("CRC32 of ") << iterations << " x " << bufSize << _F(" bytes: bitwise ") << bitwiseTime
+				   << _F("us, optimised ") << fastTime << "us" << endl;
+		}
+	}
+};
+
+void REGISTER_TEST(crc32)
+{
+	registerGroup<Crc32Test>();
+}
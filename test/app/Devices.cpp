@@ -0,0 +1,1074 @@
+/****
+ * Devices.cpp
+ *
+ * Copyright 2022 mikee47 <mike@sillyhouse.net>
+ *
+ * This file is part of the DiskStorage Library
+ *
+ * This library is free software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation, version 3 or later.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this library.
+ * If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****/
+
+#include <Storage/Disk.h>
+#include <Storage/Disk/RamBlockDevice.h>
+#include <Storage/Disk/SdCardEmulator.h>
+#include <Storage/Disk/StripedBlockDevice.h>
+#include <Storage/Disk/MirroredBlockDevice.h>
+#include <Storage/Disk/OverlayDevice.h>
+#include <Storage/Disk/SectorSizeEmulator.h>
+#include <Storage/Disk/FixedBlockDevice.h>
+#include <Storage/Disk/Scanner.h>
+#include <Storage/Disk/diskdefs.h>
+#include <SmingTest.h>
+#include <vector>
+
+#define DIV_KB 1024ULL
+#define DIV_MB (DIV_KB * DIV_KB)
+
+using namespace Storage;
+using namespace Disk;
+
+namespace
+{
+// Backend for FixedBlockDevice using RAM device
+class RamBackend
+{
+public:
+	RamBackend(storage_size_t size) : dev("fixed", size)
+	{
+	}
+
+	String getName() const
+	{
+		return dev.getName();
+	}
+
+	Device::Type getType() const
+	{
+		return dev.getType();
+	}
+
+	uint64_t getSectorCount() const
+	{
+		return dev.getSectorCount();
+	}
+
+	bool read(uint64_t sector, void* dst, size_t count)
+	{
+		return dev.read(sector << 9, dst, count << 9);
+	}
+
+	bool write(uint64_t sector, const void* src, size_t count)
+	{
+		return dev.write(sector << 9, src, count << 9);
+	}
+
+	bool erase(uint64_t sector, size_t count)
+	{
+		return dev.erase_range(sector << 9, count << 9);
+	}
+
+	bool sync()
+	{
+		return dev.sync();
+	}
+
+	bool isAllocated(uint64_t sector, uint64_t count)
+	{
+		return dev.isAllocated(sector << 9, count << 9);
+	}
+
+private:
+	RamBlockDevice dev;
+};
+
+// Records device requests
+class RequestLog : public LatencyModel
+{
+public:
+	struct Request {
+		Operation op;
+		uint64_t sector;
+		size_t count;
+	};
+
+	uint32_t getLatency(Operation op, uint64_t sector, size_t count) override
+	{
+		requests.push_back({op, sector, count});
+		return 0;
+	}
+
+	unsigned count(Operation op) const
+	{
+		unsigned n{0};
+		for(auto& req : requests) {
+			n += (req.op == op);
+		}
+		return n;
+	}
+
+	std::vector<Request> requests;
+};
+
+} // namespace
+
+class DevicesTest : public TestGroup
+{
+public:
+	DevicesTest() : TestGroup(_F("Devices"))
+	{
+	}
+
+	void execute() override
+	{
+		TEST_CASE("RAM device")
+		{
+			RamBlockDevice dev("ram", 100 * DIV_MB);
+			SimpleLatencyModel model(SimpleLatencyModel::sdCard);
+			dev.setLatencyModel(&model);
+			REQUIRE_EQ(dev.getSize(), 100 * DIV_MB);
+
+			GPT::PartitionTable partitions;
+			partitions.add("part1", SysType::fat32, 0, 50);
+			partitions.add("part2", SysType::unknown, 0, 50);
+			auto err = Disk::formatDisk(dev, partitions);
+			REQUIRE_EQ(err, Error::Success);
+			checkPartitions(dev, 2);
+
+			Serial << _F("Allocated ") << dev.getAllocatedSize() << _F(" bytes, elapsed ") << dev.getElapsedTime()
+				   << "us" << endl;
+			CHECK(dev.getAllocatedSize() < 64 * DIV_KB);
+			CHECK(dev.getElapsedTime() != 0);
+
+			auto part = *dev.partitions().begin();
+			CHECK(!dev.isAllocated(part.address(), part.size()));
+			uint8_t buffer[512];
+			memset(buffer, 0xa5, sizeof(buffer));
+			CHECK(part.write(0, buffer, sizeof(buffer)));
+			CHECK(dev.isAllocated(part.address(), part.size()));
+			memset(buffer, 0, sizeof(buffer));
+			CHECK(part.read(0, buffer, sizeof(buffer)));
+			CHECK_EQ(buffer[sizeof(buffer) - 1], 0xa5);
+		}
+
+		TEST_CASE("SD card emulation")
+		{
+			RamBlockDevice ram("ram", 16 * DIV_MB);
+			SdCardEmulator card("card", ram);
+			REQUIRE_EQ(card.getSize(), ram.getSize());
+			auto& stats = card.getModel().getStats();
+
+			// Default page size
+			constexpr size_t bufSize{16384};
+			std::unique_ptr<uint8_t[]> buffer(new uint8_t[bufSize]);
+			memset(buffer.get(), 0x5a, bufSize);
+
+			// Sequential, page-aligned writes
+			for(unsigned i = 0; i < 16; ++i) {
+				CHECK(card.write(i * bufSize, buffer.get(), bufSize));
+			}
+			auto alignedTime = card.getElapsedTime();
+			CHECK_EQ(stats.blockCopies, 0);
+			CHECK_EQ(stats.partialPageWrites, 0);
+
+			// Same amount of data re-written at a misaligned offset
+			card.resetElapsedTime();
+			for(unsigned i = 0; i < 16; ++i) {
+				CHECK(card.write(512 + i * bufSize, buffer.get(), bufSize));
+			}
+			auto misalignedTime = card.getElapsedTime();
+			Serial << _F("Aligned ") << alignedTime << _F("us, misaligned ") << misalignedTime << "us" << endl;
+			CHECK(stats.blockCopies != 0);
+			CHECK(misalignedTime > alignedTime);
+
+			memset(buffer.get(), 0, bufSize);
+			CHECK(card.read(512, buffer.get(), bufSize));
+			CHECK_EQ(buffer[bufSize - 1], 0x5a);
+		}
+
+		TEST_CASE("SD card faults")
+		{
+			RamBlockDevice ram("ram", 4 * DIV_MB);
+			SdCardEmulator card("card", ram);
+			card.allocateBuffers(0);
+			uint8_t buffer[512]{};
+
+			SdCardEmulator::Faults faults;
+			faults.writeInterval = 3;
+			faults.badSector = 100;
+			faults.badSectorCount = 2;
+			card.setFaults(faults);
+
+			// Every third write fails
+			CHECK(card.write(0, buffer, sizeof(buffer)));
+			CHECK(card.write(0, buffer, sizeof(buffer)));
+			CHECK(!card.write(0, buffer, sizeof(buffer)));
+			CHECK(card.write(0, buffer, sizeof(buffer)));
+
+			// Bad sectors
+			CHECK(card.read(99 * 512, buffer, sizeof(buffer)));
+			CHECK(!card.read(100 * 512, buffer, sizeof(buffer)));
+			CHECK(!card.read(101 * 512, buffer, sizeof(buffer)));
+			CHECK(card.read(102 * 512, buffer, sizeof(buffer)));
+			CHECK_EQ(card.getFaultCount(), 3U);
+
+			card.setFaults({});
+			CHECK(card.read(100 * 512, buffer, sizeof(buffer)));
+		}
+
+		TEST_CASE("Striped device")
+		{
+			RamBlockDevice ram1("ram1", 8 * DIV_MB);
+			RamBlockDevice ram2("ram2", 8 * DIV_MB);
+			StripedBlockDevice dev("striped", 64 * DIV_KB);
+			REQUIRE(dev.addMember(ram1));
+			REQUIRE(dev.addMember(ram2));
+			REQUIRE_EQ(dev.getSize(), 16 * DIV_MB);
+
+			GPT::PartitionTable partitions;
+			partitions.add("part1", SysType::unknown, 0, 100);
+			REQUIRE_EQ(Disk::formatDisk(dev, partitions), Error::Success);
+			checkPartitions(dev, 1);
+
+			// Span several stripes so both members are used
+			constexpr size_t bufSize{256 * DIV_KB};
+			std::unique_ptr<uint8_t[]> buf1(new uint8_t[bufSize]);
+			std::unique_ptr<uint8_t[]> buf2(new uint8_t[bufSize]);
+			os_get_random(buf1.get(), bufSize);
+			auto part = *dev.partitions().begin();
+			CHECK(part.write(0, buf1.get(), bufSize));
+			CHECK(part.read(0, buf2.get(), bufSize));
+			CHECK(memcmp(buf1.get(), buf2.get(), bufSize) == 0);
+			CHECK(ram1.getAllocatedSize() >= bufSize / 2);
+			CHECK(ram2.getAllocatedSize() >= bufSize / 2);
+		}
+
+		TEST_CASE("Mirrored device")
+		{
+			RamBlockDevice ram1("ram1", 8 * DIV_MB);
+			RamBlockDevice ram2("ram2", 8 * DIV_MB);
+			MirroredBlockDevice dev("mirror");
+			REQUIRE(dev.addMember(ram1));
+			REQUIRE(dev.addMember(ram2));
+			REQUIRE_EQ(dev.getSize(), 8 * DIV_MB);
+
+			constexpr size_t bufSize{4096};
+			uint8_t buf1[bufSize];
+			uint8_t buf2[bufSize];
+			os_get_random(buf1, bufSize);
+
+			// Member misses a write whilst offline
+			dev.setOnline(1, false);
+			CHECK(dev.write(2 * DIV_MB, buf1, bufSize));
+			dev.setOnline(1, true);
+			CHECK_EQ(dev.getDirtyRegionCount(0), 0);
+			CHECK_EQ(dev.getDirtyRegionCount(1), 1);
+
+			// Reads must never come from the stale copy
+			dev.setReadPolicy(MirroredBlockDevice::ReadPolicy::roundRobin);
+			for(unsigned i = 0; i < 4; ++i) {
+				CHECK(dev.read(2 * DIV_MB, buf2, bufSize));
+				CHECK(memcmp(buf1, buf2, bufSize) == 0);
+			}
+
+			CHECK(dev.resync());
+			CHECK_EQ(dev.getDirtyRegionCount(1), 0);
+			CHECK(ram2.read(2 * DIV_MB, buf2, bufSize));
+			CHECK(memcmp(buf1, buf2, bufSize) == 0);
+
+			// Member which fails to sync may have lost any write, so must be entirely resynchronised
+			RamBlockDevice ram3("ram3", 8 * DIV_MB);
+			SdCardEmulator card("card", ram3);
+			REQUIRE(dev.addMember(card));
+			SdCardEmulator::Faults faults;
+			faults.syncFails = true;
+			card.setFaults(faults);
+			CHECK(!dev.sync());
+			CHECK_EQ(dev.getDirtyRegionCount(2), 8);
+			card.setFaults({});
+			CHECK(dev.resync());
+			CHECK(dev.sync());
+		}
+
+		TEST_CASE("Buffered transfers")
+		{
+			RamBlockDevice dev("ram", DIV_MB);
+			REQUIRE(dev.allocateBuffers(4));
+			RequestLog log;
+			dev.setLatencyModel(&log);
+
+			constexpr size_t bufSize{8192};
+			uint8_t buf1[bufSize];
+			uint8_t buf2[bufSize];
+			os_get_random(buf1, bufSize);
+
+			// Unwritten data in buffer is picked up by multi-sector read
+			CHECK(dev.write(4096 + 100, buf1, 10));
+			CHECK_EQ(log.count(LatencyModel::Operation::write), 0);
+			CHECK(dev.read(0, buf2, bufSize));
+			CHECK(memcmp(&buf2[4096 + 100], buf1, 10) == 0);
+			CHECK_EQ(log.count(LatencyModel::Operation::write), 1);
+			CHECK_EQ(log.requests.back().count, bufSize / 512);
+
+			// Multi-sector write replaces buffered content with a single request
+			log.requests.clear();
+			CHECK(dev.read(6144, buf2, 512));
+			CHECK(dev.write(0, buf1, bufSize));
+			REQUIRE_EQ(log.requests.size(), 2);
+			CHECK_EQ(log.requests[1].count, bufSize / 512);
+			CHECK(dev.read(6144, buf2, 512));
+			CHECK(memcmp(buf2, &buf1[6144], 512) == 0);
+			CHECK(dev.sync());
+		}
+
+		TEST_CASE("Overlay device")
+		{
+			RamBlockDevice base("base", 8 * DIV_MB);
+			GPT::PartitionTable partitions;
+			partitions.add("part1", SysType::unknown, 0, 100);
+			REQUIRE_EQ(Disk::formatDisk(base, partitions), Error::Success);
+			auto baseAllocated = base.getAllocatedSize();
+
+			RamBlockDevice delta("delta", 8 * DIV_MB);
+			OverlayDevice dev("overlay", base, delta);
+			REQUIRE_EQ(dev.getSize(), base.getSize());
+			checkPartitions(dev, 1);
+
+			constexpr size_t bufSize{4096};
+			uint8_t buf1[bufSize];
+			uint8_t buf2[bufSize];
+			os_get_random(buf1, bufSize);
+			auto part = *dev.partitions().begin();
+			CHECK(part.write(0, buf1, bufSize));
+			CHECK(dev.sync());
+			CHECK_EQ(base.getAllocatedSize(), baseAllocated);
+			CHECK_EQ(dev.getMap().totalSectors(), bufSize / 512);
+
+			// Changes visible only via overlay until committed
+			CHECK(dev.read(part.address(), buf2, bufSize));
+			CHECK(memcmp(buf1, buf2, bufSize) == 0);
+			CHECK(dev.commit());
+			CHECK_EQ(dev.getMap().count(), 0);
+			CHECK(base.read(part.address(), buf2, bufSize));
+			CHECK(memcmp(buf1, buf2, bufSize) == 0);
+		}
+
+		TEST_CASE("Overlay map reload")
+		{
+			constexpr size_t bufSize{4096};
+			uint8_t baseData[bufSize];
+			uint8_t buf[bufSize];
+			os_get_random(baseData, bufSize);
+			RamBlockDevice base("base", 8 * DIV_MB);
+			REQUIRE(base.write(DIV_MB, baseData, bufSize));
+			RamBlockDevice delta("delta", 8 * DIV_MB);
+			RamBlockDevice mapDevice("map", 64 * 1024);
+
+			// Write one sector with data and another with zeroes
+			uint8_t sector[512];
+			os_get_random(sector, sizeof(sector));
+			{
+				OverlayDevice dev("overlay", base, delta, &mapDevice);
+				CHECK(!dev.loadMap());
+				CHECK(dev.write(DIV_MB + 1024, sector, sizeof(sector)));
+				memset(buf, 0, sizeof(sector));
+				CHECK(dev.write(DIV_MB + 2048, buf, sizeof(sector)));
+				CHECK(dev.sync());
+			}
+
+			// Remainder of block must still come from base
+			OverlayDevice dev("overlay", base, delta, &mapDevice);
+			REQUIRE(dev.loadMap());
+			CHECK_EQ(dev.getMap().totalSectors(), 2);
+			CHECK(dev.read(DIV_MB, buf, bufSize));
+			memcpy(baseData + 1024, sector, sizeof(sector));
+			memset(baseData + 2048, 0, sizeof(sector));
+			CHECK(memcmp(buf, baseData, bufSize) == 0);
+
+			// Stored map updated on commit
+			CHECK(dev.commit());
+			OverlayDevice dev2("overlay", base, delta, &mapDevice);
+			REQUIRE(dev2.loadMap());
+			CHECK_EQ(dev2.getMap().count(), 0);
+			CHECK(dev2.read(DIV_MB, buf, bufSize));
+			CHECK(memcmp(buf, baseData, bufSize) == 0);
+		}
+
+		TEST_CASE("4Kn device")
+		{
+			RamBlockDevice ram("ram", 8 * DIV_MB, 4096);
+			REQUIRE_EQ(ram.getSectorSize(), 4096);
+			GPT::PartitionTable partitions;
+			partitions.add("part1", SysType::unknown, 0, 100);
+			REQUIRE_EQ(Disk::formatDisk(ram, partitions), Error::Success);
+			checkPartitions(ram, 1);
+
+			SectorSizeEmulator dev("512e", ram);
+			REQUIRE_EQ(dev.getSectorSize(), 512);
+			REQUIRE_EQ(dev.getPhysicalSectorSize(), 4096);
+			// Table written with 4096-byte sectors isn't valid for 512-byte sectors
+			CHECK(!Disk::scanPartitions(dev));
+			partitions.add("part1", SysType::unknown, 0, 100);
+			REQUIRE_EQ(Disk::formatDisk(dev, partitions), Error::Success);
+			checkPartitions(dev, 1);
+
+			constexpr size_t bufSize{4096};
+			uint8_t buf1[bufSize];
+			uint8_t buf2[bufSize];
+			os_get_random(buf1, bufSize);
+			dev.resetStats();
+			auto part = *dev.partitions().begin();
+			CHECK(part.write(512, buf1, bufSize));
+			CHECK(dev.sync());
+			CHECK(ram.read(part.address() + 512, buf2, bufSize));
+			CHECK(memcmp(buf1, buf2, bufSize) == 0);
+			auto& stats = dev.getStats();
+			CHECK_EQ(stats.misalignedWrites, 1);
+			CHECK_EQ(stats.rmwSectors, 2);
+		}
+
+		TEST_CASE("Fixed sector size")
+		{
+			FixedBlockDevice<512, RamBackend> dev(8 * DIV_MB);
+			REQUIRE_EQ(dev.getSize(), 8 * DIV_MB);
+			CHECK(!dev.isAllocated(0, dev.getSize()));
+			GPT::PartitionTable partitions;
+			partitions.add("part1", SysType::unknown, 0, 100);
+			REQUIRE_EQ(Disk::formatDisk(dev, partitions), Error::Success);
+			checkPartitions(dev, 1);
+
+			// Unaligned access goes through internal buffers
+			constexpr size_t bufSize{1000};
+			uint8_t buf1[bufSize];
+			uint8_t buf2[bufSize];
+			os_get_random(buf1, bufSize);
+			auto part = *dev.partitions().begin();
+			CHECK(part.write(123, buf1, bufSize));
+			CHECK(part.read(123, buf2, bufSize));
+			CHECK(memcmp(buf1, buf2, bufSize) == 0);
+			CHECK(dev.sync());
+			CHECK(dev.getBackend().read(part.address() >> 9, buf2, 1));
+			CHECK(memcmp(&buf1[0], &buf2[123], 512 - 123) == 0);
+		}
+
+		TEST_CASE("GPT repair")
+		{
+			RamBlockDevice dev("ram", 8 * DIV_MB);
+			GPT::PartitionTable partitions;
+			partitions.add("part1", SysType::unknown, 0, 50);
+			partitions.add("part2", SysType::unknown, 0, 50);
+			REQUIRE_EQ(Disk::formatDisk(dev, partitions), Error::Success);
+			CHECK_EQ(GPT::repair(dev), Error::Success);
+
+			// Damage primary header, partitions should be found using backup
+			uint8_t header[512];
+			uint8_t buffer[512]{};
+			REQUIRE(dev.read(512, header, sizeof(header)));
+			REQUIRE(dev.write(512, buffer, sizeof(buffer)));
+			dev.editablePartitions().clear();
+			Scanner scanner(dev);
+			unsigned partCount{0};
+			while(scanner.next()) {
+				++partCount;
+			}
+			CHECK(scanner);
+			CHECK(scanner.usedBackupGpt());
+			CHECK_EQ(partCount, 2);
+
+			CHECK_EQ(GPT::repair(dev), Error::Success);
+			CHECK(dev.read(512, buffer, sizeof(buffer)));
+			CHECK(memcmp(header, buffer, sizeof(buffer)) == 0);
+			checkPartitions(dev, 2);
+
+			// Both copies damaged
+			memset(buffer, 0, sizeof(buffer));
+			REQUIRE(dev.write(512, buffer, sizeof(buffer)));
+			REQUIRE(dev.write(dev.getSize() - 512, buffer, sizeof(buffer)));
+			CHECK_EQ(GPT::repair(dev), Error::BadPartitionTable);
+		}
+
+		TEST_CASE("Large GPT")
+		{
+			RamBlockDevice dev("ram", 16 * DIV_MB);
+			GPT::PartitionTable partitions;
+			partitions.add("part1", SysType::unknown, 0, 50);
+			partitions.add("part2", SysType::unknown, 0, 50);
+			GPT::FormatOptions options;
+			options.numEntries = 1000;
+			options.entrySize = 256;
+			REQUIRE_EQ(Disk::formatDisk(dev, partitions, {}, options), Error::Success);
+			checkPartitions(dev, 2);
+			CHECK_EQ(GPT::repair(dev), Error::Success);
+
+			// Entry array is read once, in chunks
+			RequestLog log;
+			dev.setLatencyModel(&log);
+			Scanner scanner(dev, false);
+			while(scanner.next()) {
+			}
+			CHECK(scanner);
+			dev.setLatencyModel(nullptr);
+			size_t entryArraySectors{0};
+			for(auto& req : log.requests) {
+				CHECK(req.count <= 16384 / 512);
+				if(req.sector >= 2 && req.sector < 2 + 500) {
+					entryArraySectors += req.count;
+				}
+			}
+			CHECK_EQ(entryArraySectors, 1000 * 256 / 512);
+
+			// Entry size must be 128 * 2^n
+			partitions.add("part1", SysType::unknown, 0, 100);
+			options.entrySize = 192;
+			CHECK_EQ(Disk::formatDisk(dev, partitions, {}, options), Error::BadParam);
+		}
+
+		TEST_CASE("GPT editor")
+		{
+			RamBlockDevice dev("ram", 16 * DIV_MB);
+			GPT::PartitionTable partitions;
+			partitions.add("part1", SysType::unknown, 0, 40);
+			partitions.add("part2", SysType::unknown, 0, 40);
+			REQUIRE_EQ(Disk::formatDisk(dev, partitions), Error::Success);
+			auto part1Guid = (*dev.partitions().begin()).diskpart()->uniqueGuid;
+
+			GPT::Editor editor(dev);
+			REQUIRE_EQ(editor.load(), Error::Success);
+			CHECK_EQ(editor.count(), 2U);
+			PartInfo part("part3", Partition::SubType::Data::any, 0, 2 * DIV_MB);
+			CHECK_EQ(editor.add(part), Error::Success);
+			CHECK(part.offset != 0);
+			CHECK_EQ(editor.resize(part1Guid, DIV_MB), Error::Success);
+			CHECK_EQ(editor.commit(), Error::Success);
+			checkPartitions(dev, 3);
+			CHECK_EQ((*dev.partitions().begin()).size(), DIV_MB);
+
+			// Both copies must be valid
+			Scanner scanner(dev);
+			while(scanner.next()) {
+			}
+			CHECK(scanner);
+			CHECK(!scanner.usedBackupGpt());
+
+			// Headers written only once the entries they describe have been synced
+			CHECK_EQ(editor.remove(part1Guid), Error::Success);
+			RequestLog log;
+			dev.setLatencyModel(&log);
+			CHECK_EQ(editor.commit(), Error::Success);
+			dev.setLatencyModel(nullptr);
+			const uint64_t lastSector = dev.getSectorCount() - 1;
+			unsigned headerWrites{0};
+			for(unsigned i = 0; i < log.requests.size(); ++i) {
+				auto& req = log.requests[i];
+				if(req.op == LatencyModel::Operation::write && (req.sector == 1 || req.sector == lastSector)) {
+					++headerWrites;
+					CHECK(i != 0 && log.requests[i - 1].op == LatencyModel::Operation::sync);
+				}
+			}
+			CHECK_EQ(headerWrites, 2);
+			checkPartitions(dev, 2);
+		}
+
+		TEST_CASE("Scan cache")
+		{
+			RamBlockDevice dev("ram", 8 * DIV_MB);
+			GPT::PartitionTable partitions;
+			partitions.add("part1", SysType::unknown, 0, 50);
+			partitions.add("part2", SysType::unknown, 0, 50);
+			REQUIRE_EQ(Disk::formatDisk(dev, partitions), Error::Success);
+
+			uint8_t buffer[512]{};
+			ScanCache cache(buffer, sizeof(buffer));
+			CHECK(!cache.load(dev));
+			REQUIRE(Disk::scanPartitions(dev, cache));
+			CHECK(cache.isModified());
+
+			// Next session
+			ScanCache cache2(buffer, sizeof(buffer));
+			REQUIRE(cache2.load(dev));
+			CHECK(!cache2.isModified());
+			unsigned partCount{0};
+			for(auto part : dev.partitions()) {
+				CHECK(part.diskpart() != nullptr);
+				++partCount;
+			}
+			CHECK_EQ(partCount, 2);
+
+			// Changing partition table invalidates cache
+			partitions.add("part1", SysType::unknown, 0, 100);
+			REQUIRE_EQ(Disk::formatDisk(dev, partitions), Error::Success);
+			CHECK(!cache2.load(dev));
+		}
+
+		TEST_CASE("Lazy identification")
+		{
+			RamBlockDevice dev("ram", 8 * DIV_MB);
+			GPT::PartitionTable partitions;
+			partitions.add("part1", SysType::fat32, 0, 100);
+			REQUIRE_EQ(Disk::formatDisk(dev, partitions), Error::Success);
+
+			// Minimal FAT32 boot sector
+			uint8_t buffer[512]{};
+			buffer[0] = 0xEB;
+			buffer[12] = 0x02;
+			buffer[13] = 0x08;
+			buffer[33] = 0x20;
+			memcpy(&buffer[82], "FAT32   ", 8);
+			buffer[510] = 0x55;
+			buffer[511] = 0xAA;
+			auto part = *dev.partitions().begin();
+			REQUIRE(part.write(0, buffer, sizeof(buffer)));
+
+			REQUIRE(Disk::scanPartitions(dev, false));
+			part = *dev.partitions().begin();
+			CHECK(part.diskpart()->systype == SysType::unknown);
+			REQUIRE(Disk::identifyPartitions(dev));
+			CHECK(part.diskpart()->systype == SysType::fat32);
+		}
+
+		TEST_CASE("Volume names")
+		{
+			RamBlockDevice dev("ram", 8 * DIV_MB);
+			GPT::PartitionTable partitions;
+			partitions.add("part1", SysType::fat32, 0, 50);
+			partitions.add(String(), SysType::fat32, 0, 50);
+			REQUIRE_EQ(Disk::formatDisk(dev, partitions), Error::Success);
+
+			// Labelled FAT32 volume in first partition, unlabelled in second
+			uint8_t buffer[512]{};
+			buffer[0] = 0xEB;
+			buffer[12] = 0x02;
+			buffer[13] = 0x08;
+			buffer[33] = 0x20;
+			memcpy(&buffer[71], "MYLABEL    ", 11);
+			memcpy(&buffer[82], "FAT32   ", 8);
+			buffer[510] = 0x55;
+			buffer[511] = 0xAA;
+			auto it = dev.partitions().begin();
+			REQUIRE((*it).write(0, buffer, sizeof(buffer)));
+			memset(&buffer[71], ' ', 11);
+			REQUIRE((*++it).write(0, buffer, sizeof(buffer)));
+
+			// Partition name comes from table, or unique GUID if unnamed, for both eager and lazy scans
+			for(bool identify : {true, false}) {
+				dev.editablePartitions().clear();
+				REQUIRE(Disk::scanPartitions(dev, identify));
+				if(!identify) {
+					REQUIRE(Disk::identifyPartitions(dev));
+				}
+				it = dev.partitions().begin();
+				CHECK((*it).diskpart()->systype == SysType::fat32);
+				CHECK_EQ((*it).name(), "part1");
+				auto dp = (*++it).diskpart();
+				CHECK(dp->systype == SysType::fat32);
+				CHECK_EQ((*it).name(), String(dp->uniqueGuid));
+			}
+		}
+
+		TEST_CASE("Volume probes")
+		{
+			RamBlockDevice dev("ram", 8 * DIV_MB);
+			GPT::PartitionTable partitions;
+			partitions.add("part1", SysType::unknown, 0, 50, {}, GPT::PARTITION_LINUX_DATA_GUID);
+			partitions.add("part2", SysType::unknown, 0, 50);
+			REQUIRE_EQ(Disk::formatDisk(dev, partitions), Error::Success);
+
+			// Minimal ext2 superblock: 1024 blocks of 1K
+			uint8_t buffer[2048]{};
+			buffer[1028] = 0x00;
+			buffer[1029] = 0x04;
+			buffer[1080] = 0x53;
+			buffer[1081] = 0xEF;
+			memcpy(&buffer[1144], "myvol", 5);
+			auto part = *dev.partitions().begin();
+			REQUIRE(part.write(0, buffer, sizeof(buffer)));
+
+			// LittleFS superblock with 256 blocks of 4K
+			memset(buffer, 0, sizeof(buffer));
+			memcpy(&buffer[8], "littlefs", 8);
+			buffer[25] = 0x10;
+			buffer[29] = 0x01;
+			for(auto p : dev.partitions()) {
+				part = p;
+			}
+			REQUIRE(part.write(0, buffer, sizeof(buffer)));
+
+			REQUIRE(Disk::scanPartitions(dev));
+			auto it = dev.partitions().begin();
+			auto dp = (*it).diskpart();
+			CHECK(dp->systype == SysType::ext2);
+			CHECK_EQ((*it).size(), 1024 * 1024);
+			dp = (*++it).diskpart();
+			CHECK(dp->systype == SysType::littlefs);
+			CHECK_EQ((*it).size(), 256 * 4096);
+		}
+
+		TEST_CASE("Multiple devices")
+		{
+			constexpr unsigned numDevices{4};
+			Device* devices[numDevices];
+			for(unsigned i = 0; i < numDevices; ++i) {
+				auto dev = new RamBlockDevice("ram" + String(i), 8 * DIV_MB);
+				GPT::PartitionTable partitions;
+				for(unsigned j = 0; j <= i; ++j) {
+					partitions.add("part" + String(j), SysType::unknown, 0, 10);
+				}
+				REQUIRE_EQ(Disk::formatDisk(*dev, partitions), Error::Success);
+				dev->editablePartitions().clear();
+				devices[i] = dev;
+			}
+
+			MultiScanTask task(devices, numDevices);
+			CHECK_EQ(task.run(), Error::Success);
+			CHECK_EQ(task.getSuccessCount(), numDevices);
+			CHECK_EQ(task.getProgress(), numDevices);
+
+			bool results[numDevices]{};
+			CHECK_EQ(Disk::scanPartitions(devices, numDevices, results), numDevices);
+			for(unsigned i = 0; i < numDevices; ++i) {
+				CHECK(results[i]);
+				unsigned partCount{0};
+				for(auto part : devices[i]->partitions()) {
+					(void)part;
+					++partCount;
+				}
+				CHECK_EQ(partCount, i + 1);
+				delete devices[i];
+			}
+		}
+
+		TEST_CASE("Extended partitions")
+		{
+			RamBlockDevice dev("ram", 64 * DIV_MB);
+			auto writeRecord = [&](uint32_t lba, uint8_t osType, uint32_t start, uint32_t size, uint32_t link) {
+				legacy_mbr_t mbr{};
+				auto& rec = mbr.partition_record[0];
+				rec.os_type = osType;
+				rec.starting_lba = start;
+				rec.size_in_lba = size;
+				if(link != 0) {
+					auto& next = mbr.partition_record[1];
+					next.os_type = OSTYPE_EXTENDED;
+					next.starting_lba = link;
+					next.size_in_lba = 2048;
+				}
+				mbr.signature = MSDOS_MBR_SIGNATURE;
+				REQUIRE(dev.write(storage_size_t(lba) << 9, &mbr, sizeof(mbr)));
+			};
+
+			// Primary, extended and primary
+			legacy_mbr_t mbr{};
+			mbr.partition_record[0] = {.os_type = SI_FAT32X, .starting_lba = 2048, .size_in_lba = 8192};
+			mbr.partition_record[1] = {.os_type = OSTYPE_EXTENDED_LBA, .starting_lba = 16384, .size_in_lba = 65536};
+			mbr.partition_record[2] = {.os_type = SI_LINUX, .starting_lba = 90112, .size_in_lba = 8192};
+			mbr.signature = MSDOS_MBR_SIGNATURE;
+			REQUIRE(dev.write(0, &mbr, sizeof(mbr)));
+
+			// Logical partitions start relative to their EBR, links relative to extended partition
+			writeRecord(16384, SI_LINUX, 2048, 8192, 32768);
+			writeRecord(16384 + 32768, SI_FAT32X, 2048, 8192, 16384);
+			writeRecord(16384 + 16384, SI_LINUX, 2048, 8192, 0);
+			checkPartitions(dev, 5);
+
+			// Chain loops back, so must stop before re-reading an EBR
+			writeRecord(16384 + 16384, SI_LINUX, 2048, 8192, 32768);
+			checkPartitions(dev, 5);
+
+			// Logical partition start which wraps around to within the extended partition
+			writeRecord(16384 + 16384, SI_LINUX, 0xFFFFF000, 8192, 0);
+			checkPartitions(dev, 4);
+		}
+
+		TEST_CASE("Staged operations")
+		{
+			RamBlockDevice dev("ram", 4 * DIV_MB);
+			GPT::PartitionTable partitions;
+			partitions.add("part1", SysType::unknown, 0, 40);
+			partitions.add("part2", SysType::unknown, 0, 40);
+			GPT::Formatter formatter(dev, partitions);
+			REQUIRE_EQ(formatter.run(), Error::Success);
+			CHECK(formatter.isComplete());
+			CHECK(partitions.isEmpty());
+			// 32 entry array sectors, two headers and protective MBR
+			CHECK_EQ(formatter.getProgressTotal(), 35U);
+			CHECK_EQ(formatter.getProgress(), formatter.getProgressTotal());
+
+			dev.editablePartitions().clear();
+			ScanTask scanTask(dev);
+			REQUIRE_EQ(scanTask.run(), Error::Success);
+			unsigned partCount{0};
+			for(auto part : dev.partitions()) {
+				(void)part;
+				++partCount;
+			}
+			CHECK_EQ(partCount, 2U);
+
+			// Tasks run only once
+			CHECK_EQ(scanTask.run(), Error::BadParam);
+		}
+
+		TEST_CASE("GPT write order")
+		{
+			RamBlockDevice dev("ram", 16 * DIV_MB);
+			REQUIRE(dev.allocateBuffers(4));
+			RequestLog log;
+			dev.setLatencyModel(&log);
+			GPT::PartitionTable partitions;
+			partitions.add("part1", SysType::unknown, 0, 100);
+			REQUIRE_EQ(Disk::formatDisk(dev, partitions), Error::Success);
+			dev.setLatencyModel(nullptr);
+
+			// Each entry array in one request, then each header and the MBR separately synced
+			using Op = LatencyModel::Operation;
+			const uint64_t lastSector = dev.getSectorCount() - 1;
+			const RequestLog::Request expected[]{
+				{Op::write, 2, 32}, {Op::write, lastSector - 32, 32}, // Entry arrays
+				{Op::sync, 0, 0},	{Op::write, lastSector, 1},		  // Backup header
+				{Op::sync, 0, 0},	{Op::write, 1, 1},				  // Primary header
+				{Op::sync, 0, 0},	{Op::write, 0, 1},				  // Protective MBR
+				{Op::sync, 0, 0},
+			};
+			REQUIRE_EQ(log.requests.size(), ARRAY_SIZE(expected));
+			for(unsigned i = 0; i < ARRAY_SIZE(expected); ++i) {
+				auto& req = log.requests[i];
+				CHECK(req.op == expected[i].op);
+				CHECK_EQ(req.sector, expected[i].sector);
+				CHECK_EQ(req.count, expected[i].count);
+			}
+		}
+
+		TEST_CASE("Partition alignment")
+		{
+			RamBlockDevice ram("ram", 64 * DIV_MB);
+			SdCardEmulator card("card", ram);
+			// Default emulated allocation unit
+			REQUIRE_EQ(getPartitionAlignment(card), 4 * DIV_MB);
+			REQUIRE_EQ(getPartitionAlignment(ram), PARTITION_ALIGN);
+
+			GPT::PartitionTable partitions;
+			partitions.add("part1", SysType::unknown, 0, 30);
+			partitions.add("part2", SysType::unknown, 0, 10 * DIV_MB);
+			partitions.add("part3", SysType::unknown, 0, 30);
+			REQUIRE_EQ(Disk::formatDisk(card, partitions), Error::Success);
+			checkPartitions(card, 3);
+			for(auto part : card.partitions()) {
+				CHECK_EQ(part.address() % (4 * DIV_MB), 0U);
+			}
+
+			// Alignment may also be given explicitly
+			partitions.add("part1", SysType::unknown, 0, 3 * DIV_MB);
+			partitions.add("part2", SysType::unknown, 0, 3 * DIV_MB);
+			GPT::FormatOptions options;
+			options.alignment = 2 * DIV_MB;
+			REQUIRE_EQ(Disk::formatDisk(ram, partitions, {}, options), Error::Success);
+			checkPartitions(ram, 2);
+			for(auto part : ram.partitions()) {
+				CHECK_EQ(part.address() % (2 * DIV_MB), 0U);
+			}
+		}
+
+		TEST_CASE("Format options")
+		{
+			RamBlockDevice dev("ram", 4 * DIV_MB);
+			uint8_t buffer[512];
+			memset(buffer, 0xa5, sizeof(buffer));
+			auto isZero = [&](storage_size_t offset) {
+				return dev.read(offset, buffer, sizeof(buffer)) && buffer[0] == 0 &&
+					   memcmp(buffer, &buffer[1], sizeof(buffer) - 1) == 0;
+			};
+
+			// Stale data at start of first partition
+			REQUIRE(dev.write(DIV_MB, buffer, sizeof(buffer)));
+			REQUIRE(dev.write(DIV_MB + 8192, buffer, sizeof(buffer)));
+			MBR::PartitionTable mbrPartitions;
+			mbrPartitions.add(SysType::fat16, SI_FAT16B, 0, 50);
+			mbrPartitions.add(SysType::fat16, SI_FAT16B, 0, 50);
+			FormatOptions mbrOptions;
+			mbrOptions.zeroSize = 4096;
+			REQUIRE_EQ(Disk::formatDisk(dev, mbrPartitions, mbrOptions), Error::Success);
+			checkPartitions(dev, 2);
+			CHECK(isZero(DIV_MB));
+			CHECK(!isZero(DIV_MB + 8192));
+
+			GPT::PartitionTable gptPartitions;
+			gptPartitions.add("part1", SysType::unknown, 0, 100);
+			GPT::FormatOptions gptOptions;
+			gptOptions.discard = true;
+			GPT::Formatter formatter(dev, gptPartitions, {}, gptOptions);
+			REQUIRE_EQ(formatter.run(), Error::Success);
+			// Discard step added
+			CHECK_EQ(formatter.getProgressTotal(), 36U);
+			checkPartitions(dev, 1);
+			CHECK(isZero(DIV_MB + 8192));
+		}
+
+		TEST_CASE("Bounded format steps")
+		{
+			// Sparse, so large device costs nothing
+			RamBlockDevice dev("ram", 256 * DIV_MB);
+			REQUIRE(dev.allocateBuffers(4));
+			uint8_t buffer[512];
+			memset(buffer, 0xa5, sizeof(buffer));
+
+			// Unsynced data in buffer is dropped by discard
+			REQUIRE(dev.write(200 * DIV_MB, buffer, sizeof(buffer)));
+			RequestLog log;
+			dev.setLatencyModel(&log);
+			GPT::PartitionTable partitions;
+			partitions.add("part1", SysType::unknown, 0, 100);
+			GPT::FormatOptions options;
+			options.discard = true;
+			REQUIRE_EQ(Disk::formatDisk(dev, partitions, {}, options), Error::Success);
+			const size_t discardSectors = FORMAT_MAX_DISCARD_SIZE / 512;
+			CHECK_EQ(log.count(LatencyModel::Operation::erase), 4U);
+			for(auto& req : log.requests) {
+				if(req.op == LatencyModel::Operation::erase) {
+					CHECK_EQ(req.count, discardSectors);
+				}
+			}
+			REQUIRE(dev.read(200 * DIV_MB, buffer, sizeof(buffer)));
+			CHECK_EQ(buffer[0], 0);
+
+			// Large zero area is written over several steps
+			memset(buffer, 0xa5, sizeof(buffer));
+			const uint32_t zeroSize = 4 * FORMAT_MAX_TRANSFER_SIZE;
+			REQUIRE(dev.write(DIV_MB + zeroSize - 512, buffer, sizeof(buffer)));
+			log.requests.clear();
+			partitions.add("part1", SysType::unknown, 0, 100);
+			options.discard = false;
+			options.zeroSize = zeroSize;
+			REQUIRE_EQ(Disk::formatDisk(dev, partitions, {}, options), Error::Success);
+			unsigned zeroWrites{0};
+			for(auto& req : log.requests) {
+				if(req.op == LatencyModel::Operation::write && req.sector >= DIV_MB / 512) {
+					CHECK(req.count <= FORMAT_MAX_TRANSFER_SIZE / 512);
+					zeroWrites += (req.sector < (DIV_MB + zeroSize) / 512);
+				}
+			}
+			CHECK(zeroWrites >= 4);
+			REQUIRE(dev.read(DIV_MB + zeroSize - 512, buffer, sizeof(buffer)));
+			CHECK_EQ(buffer[0], 0);
+		}
+
+#ifdef ARCH_HOST
+		TEST_CASE("Zero detection")
+		{
+			DEFINE_FSTR_LOCAL(ZERO_DETECT_FILENAME, "out/test-zero.img")
+
+			HostFileDevice dev("zero", ZERO_DETECT_FILENAME, DIV_MB);
+			REQUIRE_EQ(dev.getSize(), DIV_MB);
+			dev.setZeroDetect(true);
+
+			// Only second sector contains data
+			constexpr size_t bufSize{4 * 512};
+			uint8_t buf1[bufSize]{};
+			uint8_t buf2[bufSize];
+			memset(&buf1[512], 0xa5, 512);
+
+			// Start with all sectors allocated so holes must be punched
+			memset(buf2, 0x5a, bufSize);
+			REQUIRE(dev.write(0, buf2, bufSize));
+			REQUIRE(dev.sync());
+			CHECK(dev.isAllocated(0, bufSize));
+
+			REQUIRE(dev.write(0, buf1, bufSize));
+			REQUIRE(dev.sync());
+			REQUIRE(dev.read(0, buf2, bufSize));
+			CHECK(memcmp(buf1, buf2, bufSize) == 0);
+			CHECK(!dev.isAllocated(0, 512));
+			CHECK(dev.isAllocated(512, 512));
+			CHECK(!dev.isAllocated(1024, 1024));
+		}
+
+		TEST_CASE("Chunked image")
+		{
+			DEFINE_FSTR_LOCAL(CHUNKED_IMAGE_FILENAME, "out/test-chunked.img")
+
+			constexpr size_t bufSize{16384};
+			uint8_t buf1[bufSize];
+			uint8_t buf2[bufSize];
+			os_get_random(buf1, bufSize);
+
+			{
+				ChunkedImageDevice dev("chunked", CHUNKED_IMAGE_FILENAME, 100 * DIV_MB);
+				REQUIRE_EQ(dev.getSize(), 100 * DIV_MB);
+				GPT::PartitionTable partitions;
+				partitions.add("part1", SysType::unknown, 0, 50);
+				partitions.add("part2", SysType::unknown, 0, 50);
+				REQUIRE_EQ(Disk::formatDisk(dev, partitions), Error::Success);
+				checkPartitions(dev, 2);
+
+				// Rewrite chunk so there's some garbage to compact
+				auto part = *dev.partitions().begin();
+				CHECK(part.write(0, buf2, bufSize));
+				CHECK(dev.sync());
+				CHECK(part.write(0, buf1, bufSize));
+				CHECK(dev.sync());
+				auto stats = dev.getStats();
+				Serial << "File size " << stats.fileSize << ", " << stats.storedCount << " chunks stored" << endl;
+				CHECK(stats.fileSize < DIV_MB);
+			}
+
+			CHECK(ChunkedImageDevice::compact(CHUNKED_IMAGE_FILENAME));
+
+			ChunkedImageDevice dev("chunked", CHUNKED_IMAGE_FILENAME);
+			checkPartitions(dev, 2);
+			auto part = *dev.partitions().begin();
+			CHECK(part.read(0, buf2, bufSize));
+			CHECK(memcmp(buf1, buf2, bufSize) == 0);
+		}
+#endif
+
+		// Must be last as it completes asynchronously
+		TEST_CASE("Cancel task")
+		{
+			taskDevice.reset(new RamBlockDevice("ram", 4 * DIV_MB));
+			taskPartitions.add("part1", SysType::unknown, 0, 100);
+			taskFormatter.reset(new GPT::Formatter(*taskDevice, taskPartitions));
+			auto onComplete = [this](Task& task, Error err) {
+				CHECK_EQ(err, Error::Cancelled);
+				CHECK(task.isComplete());
+				// Table not applied to device
+				CHECK(!taskPartitions.isEmpty());
+				for(auto part : taskDevice->partitions()) {
+					(void)part;
+					CHECK(false);
+				}
+				complete();
+			};
+			auto onProgress = [](Task& task, uint32_t, uint32_t) { task.cancel(); };
+			REQUIRE(taskFormatter->start(onComplete, onProgress));
+			pending();
+		}
+	}
+
+	void checkPartitions(Device& dev, unsigned expectedPartitionCount)
+	{
+		REQUIRE(Disk::scanPartitions(dev));
+		size_t partCount{0};
+		for(auto part : dev.partitions()) {
+			Serial << part << endl;
+			CHECK(part.diskpart() != nullptr);
+			++partCount;
+		}
+		REQUIRE_EQ(partCount, expectedPartitionCount);
+	}
+
+private:
+	std::unique_ptr<RamBlockDevice> taskDevice;
+	GPT::PartitionTable taskPartitions;
+	std::unique_ptr<GPT::Formatter> taskFormatter;
+};
+
+void REGISTER_TEST(devices)
+{
+	registerGroup<DevicesTest>();
+}
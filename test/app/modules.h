@@ -1,3 +1,3 @@
 // List of test modules to register
 
-#define TEST_MAP(XX) XX(basic)
+#define TEST_MAP(XX) XX(crc32) XX(basic) XX(devices)